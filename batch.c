@@ -0,0 +1,287 @@
+/* Structure-of-arrays batch integrator.
+
+   The x, y and z coordinates of every trajectory live in separate
+   aligned arrays so that one RK4 stage advances several trajectories
+   at once, one per SIMD lane. The arrays are padded up to a multiple of
+   BATCH_WIDTH so the vector kernels never need a scalar remainder
+   loop. Padding lanes start at the origin and are never drawn; every
+   system either has a fixed point there or pulls it onto a bounded
+   attractor, so they never overflow.
+
+   The float arrays always hold the state that gets drawn. Depending on
+   the precision mode they are also the state that is integrated
+   (PRECISION_FLOAT), a copy converted after every step from double
+   arrays that are integrated instead (PRECISION_DOUBLE), or the high
+   part of a float state whose rounding error is carried in separate
+   compensation arrays, Kahan style, so the increments of tiny steps
+   are not lost while every stage still runs in float lanes
+   (PRECISION_MIXED).
+*/
+
+#include <string.h>
+
+#define BATCH_ALIGN 32
+#define BATCH_WIDTH 8
+/* Trajectories per cache line; the unit in which work is split between
+   threads. */
+#define BATCH_GRAIN (64 / (int)sizeof(float))
+
+typedef enum {
+  PRECISION_FLOAT, PRECISION_DOUBLE, PRECISION_MIXED, PRECISION_COUNT
+} batch_precision;
+
+typedef struct {
+  int count;
+  int capacity;
+  batch_precision precision;
+  /* Parameters of the system being integrated, and rounded to float
+     for the kernels that work in float. */
+  double params[SYSTEM_MAX_PARAMS];
+  float params_float[SYSTEM_MAX_PARAMS];
+  float *x, *y, *z;
+  /* PRECISION_DOUBLE only. */
+  double *xd, *yd, *zd;
+  /* PRECISION_MIXED only. */
+  float *cx, *cy, *cz;
+} batch;
+
+/* Advance trajectories [begin, end) (a multiple of the kernel width)
+   by one RK4 step of size dt. */
+typedef void (*batch_kernel)(batch *b, int begin, int end, float dt);
+
+static void *
+batch_array(size_t size) {
+  void *array = aligned_alloc(BATCH_ALIGN, size);
+
+  if (array)
+    memset(array, 0, size);
+  return array;
+}
+
+static int
+batch_init(batch *b, int count, batch_precision precision) {
+  size_t size;
+  int ok;
+
+  memset(b, 0, sizeof(*b));
+  b->count = count;
+  b->capacity = (count + BATCH_WIDTH - 1) / BATCH_WIDTH * BATCH_WIDTH;
+  b->precision = precision;
+  size = b->capacity * sizeof(float);
+
+  b->x = batch_array(size);
+  b->y = batch_array(size);
+  b->z = batch_array(size);
+  ok = b->x && b->y && b->z;
+
+  if (precision == PRECISION_DOUBLE) {
+    b->xd = batch_array(2 * size);
+    b->yd = batch_array(2 * size);
+    b->zd = batch_array(2 * size);
+    ok = ok && b->xd && b->yd && b->zd;
+  }
+  if (precision == PRECISION_MIXED) {
+    b->cx = batch_array(size);
+    b->cy = batch_array(size);
+    b->cz = batch_array(size);
+    ok = ok && b->cx && b->cy && b->cz;
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Unable to allocate batch of %d trajectories\n", count);
+    return 0;
+  }
+  return 1;
+}
+
+static void
+batch_set_params(batch *b, const double params[SYSTEM_MAX_PARAMS]) {
+  for (int i = 0; i < SYSTEM_MAX_PARAMS; i++) {
+    b->params[i] = params[i];
+    b->params_float[i] = params[i];
+  }
+}
+
+static void
+batch_free(batch *b) {
+  free(b->x);
+  free(b->y);
+  free(b->z);
+  free(b->xd);
+  free(b->yd);
+  free(b->zd);
+  free(b->cx);
+  free(b->cy);
+  free(b->cz);
+  memset(b, 0, sizeof(*b));
+}
+
+static void
+batch_set(batch *b, int i, vec3 v) {
+  b->x[i] = v.x;
+  b->y[i] = v.y;
+  b->z[i] = v.z;
+  if (b->xd) {
+    b->xd[i] = v.x;
+    b->yd[i] = v.y;
+    b->zd[i] = v.z;
+  }
+  if (b->cx)
+    b->cx[i] = b->cy[i] = b->cz[i] = 0.0f;
+}
+
+static __attribute__((unused)) vec3
+batch_get(const batch *b, int i) {
+  vec3 v = {b->x[i], b->y[i], b->z[i]};
+  return v;
+}
+
+/* How a kernel adds the step's increment to a coordinate: plainly, or
+   with the rounding error of the addition carried over in `comp`. */
+#define RK4_ADD(T, v, increment, comp) ((v) += (increment))
+
+#define RK4_ADD_COMPENSATED(T, v, increment, comp)                      \
+  do {                                                                  \
+    T c_, y_, t_;                                                       \
+    memcpy(&c_, (comp) + i, sizeof(T));                                 \
+    y_ = (increment) - c_;                                              \
+    t_ = (v) + y_;                                                      \
+    c_ = (t_ - (v)) - y_;                                               \
+    (v) = t_;                                                           \
+    memcpy((comp) + i, &c_, sizeof(T));                                 \
+  } while (0)
+
+/* One RK4 step of system SYS over arrays x, y, z of n elements, W at a
+   time as vectors of type T. */
+#define RK4_BATCH_BODY(T, W, ADD, SYS)                                  \
+  for (int i = 0; i < n; i += (W)) {                                    \
+    T x0, y0, z0;                                                       \
+    memcpy(&x0, x + i, sizeof(T));                                      \
+    memcpy(&y0, y + i, sizeof(T));                                      \
+    memcpy(&z0, z + i, sizeof(T));                                      \
+                                                                        \
+    T k1x = SYS##_DX(x0, y0, z0);                                       \
+    T k1y = SYS##_DY(x0, y0, z0);                                       \
+    T k1z = SYS##_DZ(x0, y0, z0);                                       \
+                                                                        \
+    T x1 = x0 + (dt/2) * k1x;                                           \
+    T y1 = y0 + (dt/2) * k1y;                                           \
+    T z1 = z0 + (dt/2) * k1z;                                           \
+    T k2x = SYS##_DX(x1, y1, z1);                                       \
+    T k2y = SYS##_DY(x1, y1, z1);                                       \
+    T k2z = SYS##_DZ(x1, y1, z1);                                       \
+                                                                        \
+    T x2 = x0 + (dt/2) * k2x;                                           \
+    T y2 = y0 + (dt/2) * k2y;                                           \
+    T z2 = z0 + (dt/2) * k2z;                                           \
+    T k3x = SYS##_DX(x2, y2, z2);                                       \
+    T k3y = SYS##_DY(x2, y2, z2);                                       \
+    T k3z = SYS##_DZ(x2, y2, z2);                                       \
+                                                                        \
+    T x3 = x0 + dt * k3x;                                               \
+    T y3 = y0 + dt * k3y;                                               \
+    T z3 = z0 + dt * k3z;                                               \
+    T k4x = SYS##_DX(x3, y3, z3);                                       \
+    T k4y = SYS##_DY(x3, y3, z3);                                       \
+    T k4z = SYS##_DZ(x3, y3, z3);                                       \
+                                                                        \
+    ADD(T, x0, (dt/6) * (k1x + 2*k2x + 2*k3x + k4x), cx);               \
+    ADD(T, y0, (dt/6) * (k1y + 2*k2y + 2*k3y + k4y), cy);               \
+    ADD(T, z0, (dt/6) * (k1z + 2*k2z + 2*k3z + k4z), cz);               \
+                                                                        \
+    memcpy(x + i, &x0, sizeof(T));                                      \
+    memcpy(y + i, &y0, sizeof(T));                                      \
+    memcpy(z + i, &z0, sizeof(T));                                      \
+  }
+
+/* Kernel definitions for each precision, given the vector type and
+   width to use and the system to integrate. */
+#define RK4_FLOAT_KERNEL(name, T, W, SYS)                               \
+  static void                                                           \
+  name(batch *b, int begin, int end, float dt) {                        \
+    float *x = b->x + begin, *y = b->y + begin, *z = b->z + begin;      \
+    int n = end - begin;                                                \
+    SYSTEM_PARAMS(float, b->params_float);                              \
+    RK4_BATCH_BODY(T, W, RK4_ADD, SYS)                                  \
+  }
+
+#define RK4_DOUBLE_KERNEL(name, T, W, SYS)                              \
+  static void                                                           \
+  name(batch *b, int begin, int end, float step) {                      \
+    double *x = b->xd + begin, *y = b->yd + begin, *z = b->zd + begin;  \
+    double dt = step;                                                   \
+    int n = end - begin;                                                \
+    SYSTEM_PARAMS(double, b->params);                                   \
+    RK4_BATCH_BODY(T, W, RK4_ADD, SYS)                                  \
+    for (int i = 0; i < n; i++) {                                       \
+      b->x[begin + i] = x[i];                                           \
+      b->y[begin + i] = y[i];                                           \
+      b->z[begin + i] = z[i];                                           \
+    }                                                                   \
+  }
+
+#define RK4_MIXED_KERNEL(name, T, W, SYS)                               \
+  static void                                                           \
+  name(batch *b, int begin, int end, float dt) {                        \
+    float *x = b->x + begin, *y = b->y + begin, *z = b->z + begin;      \
+    float *cx = b->cx + begin, *cy = b->cy + begin, *cz = b->cz + begin; \
+    int n = end - begin;                                                \
+    SYSTEM_PARAMS(float, b->params_float);                              \
+    RK4_BATCH_BODY(T, W, RK4_ADD_COMPENSATED, SYS)                      \
+  }
+
+/* Every system in every precision, and a row of the kernel tables for
+   each system. */
+#define RK4_KERNELS(NAME, name, ISA, ATTRIBUTES, FT, FW, DT, DW)        \
+  ATTRIBUTES RK4_FLOAT_KERNEL(rk4_##name##_float##ISA, FT, FW, NAME)    \
+  ATTRIBUTES RK4_DOUBLE_KERNEL(rk4_##name##_double##ISA, DT, DW, NAME)  \
+  ATTRIBUTES RK4_MIXED_KERNEL(rk4_##name##_mixed##ISA, FT, FW, NAME)
+
+#define RK4_KERNEL_ROW(name, ISA)                                       \
+  {rk4_##name##_float##ISA, rk4_##name##_double##ISA,                   \
+   rk4_##name##_mixed##ISA},
+
+#define RK4_SCALAR_KERNELS(NAME, name)                                  \
+  RK4_KERNELS(NAME, name, _scalar, , float, 1, double, 1)
+#define RK4_SCALAR_ROW(NAME, name) RK4_KERNEL_ROW(name, _scalar)
+SYSTEM_LIST(RK4_SCALAR_KERNELS)
+
+#ifdef HAVE_X86_VECTORS
+#define HAVE_X86_KERNELS 1
+
+#define RK4_SSE_KERNELS(NAME, name)                                     \
+  RK4_KERNELS(NAME, name, _sse, __attribute__((target("sse2"))),        \
+              float4, 4, double2, 2)
+#define RK4_SSE_ROW(NAME, name) RK4_KERNEL_ROW(name, _sse)
+SYSTEM_LIST(RK4_SSE_KERNELS)
+
+#define RK4_AVX2_KERNELS(NAME, name)                                    \
+  RK4_KERNELS(NAME, name, _avx2, __attribute__((target("avx2,fma"))),   \
+              float8, 8, double4, 4)
+#define RK4_AVX2_ROW(NAME, name) RK4_KERNEL_ROW(name, _avx2)
+SYSTEM_LIST(RK4_AVX2_KERNELS)
+#endif
+
+/* Pick the widest kernel for `system` in `precision` the running CPU
+   supports. */
+static __attribute__((unused)) batch_kernel
+batch_select_kernel(system_id system, batch_precision precision) {
+  static const batch_kernel scalar[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_SCALAR_ROW)
+  };
+#ifdef HAVE_X86_KERNELS
+  static const batch_kernel sse[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_SSE_ROW)
+  };
+  static const batch_kernel avx2[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_AVX2_ROW)
+  };
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return avx2[system][precision];
+  if (__builtin_cpu_supports("sse2"))
+    return sse[system][precision];
+#endif
+  return scalar[system][precision];
+}
@@ -0,0 +1,120 @@
+/* Precision benchmark, run with --bench-precision STEPS.
+
+   The configured initial conditions are integrated in every RK4
+   precision mode on a single thread, first alone to measure throughput
+   and then next to a reference solution: double precision with a step
+   BENCH_SUBSTEPS times smaller. Because the system is chaotic any
+   error grows exponentially, so how long a mode stays within
+   BENCH_DIVERGENCE of the reference is the length of a run whose
+   trajectories can be trusted.
+*/
+
+#define BENCH_SUBSTEPS 8
+#define BENCH_DIVERGENCE 1.0
+
+static const char *const bench_precision_names[PRECISION_COUNT] = {
+  "float", "double", "mixed"
+};
+
+static double
+bench_seconds(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Steps per second of the given mode, over all trajectories. */
+static double
+bench_throughput(const config *cfg, batch_precision precision, long steps) {
+  batch_kernel kernel = batch_select_kernel(cfg->system, precision);
+  batch b;
+  double start, elapsed;
+
+  if (!batch_init(&b, cfg->count, precision))
+    return 0.0;
+  config_initial_state(cfg, &b);
+
+  start = bench_seconds();
+  for (long s = 0; s < steps; s++)
+    kernel(&b, 0, b.capacity, cfg->dt);
+  elapsed = bench_seconds() - start;
+
+  batch_free(&b);
+  return elapsed > 0.0 ? (double)steps * cfg->count / elapsed : 0.0;
+}
+
+/* Time at which each trajectory first strays from the reference,
+   averaged over those that do; `*diverged` receives how many did. */
+static double
+bench_divergence(const config *cfg, batch_precision precision, long steps,
+                 int *diverged) {
+  batch_kernel kernel = batch_select_kernel(cfg->system, precision);
+  batch_kernel reference_kernel =
+    batch_select_kernel(cfg->system, PRECISION_DOUBLE);
+  batch b, reference;
+  bool *done = calloc(cfg->count, sizeof(bool));
+  double total = 0.0;
+
+  *diverged = 0;
+  if (!done || !batch_init(&b, cfg->count, precision)
+      || !batch_init(&reference, cfg->count, PRECISION_DOUBLE)) {
+    free(done);
+    return 0.0;
+  }
+  config_initial_state(cfg, &b);
+  config_initial_state(cfg, &reference);
+
+  for (long s = 1; s <= steps && *diverged < cfg->count; s++) {
+    kernel(&b, 0, b.capacity, cfg->dt);
+    for (int k = 0; k < BENCH_SUBSTEPS; k++)
+      reference_kernel(&reference, 0, reference.capacity,
+                       cfg->dt / BENCH_SUBSTEPS);
+
+    for (int i = 0; i < cfg->count; i++) {
+      double dx, dy, dz;
+
+      if (done[i])
+        continue;
+      if (b.xd) {
+        dx = b.xd[i] - reference.xd[i];
+        dy = b.yd[i] - reference.yd[i];
+        dz = b.zd[i] - reference.zd[i];
+      }
+      else {
+        dx = b.x[i] - reference.xd[i];
+        dy = b.y[i] - reference.yd[i];
+        dz = b.z[i] - reference.zd[i];
+      }
+      if (dx*dx + dy*dy + dz*dz > BENCH_DIVERGENCE * BENCH_DIVERGENCE) {
+        done[i] = true;
+        total += s * (double)cfg->dt;
+        (*diverged)++;
+      }
+    }
+  }
+
+  batch_free(&b);
+  batch_free(&reference);
+  free(done);
+  return *diverged ? total / *diverged : 0.0;
+}
+
+static int
+bench_precision(const config *cfg) {
+  long steps = cfg->bench_precision;
+
+  printf("%-9s %14s %10s %16s\n", "precision", "steps/s", "diverged",
+         "mean divergence");
+  for (int p = 0; p < PRECISION_COUNT; p++) {
+    double rate = bench_throughput(cfg, p, steps);
+    int diverged;
+    double time = bench_divergence(cfg, p, steps, &diverged);
+
+    if (rate == 0.0)
+      return 0;
+    printf("%-9s %14.4g %4d/%-5d %16.3f\n", bench_precision_names[p], rate,
+           diverged, cfg->count, time);
+  }
+  return 1;
+}
@@ -0,0 +1,17 @@
+/* lorenz-sweep: bifurcation diagrams without a display.
+
+   Takes lorenz's options, of which the --sweep ones say what to draw:
+
+     ./lorenz-sweep --sweep 2000 --sweep-param rho --sweep-from 20 \
+         --sweep-to 200 --sweep-image rho.pgm --sweep-data rho.csv
+
+   and integrates a batch of --count trajectories for each value of the
+   parameter on the worker pool. Only libsim.a is linked.
+*/
+
+#include "sim.h"
+
+int
+main(int argc, char **argv) {
+  return !sim_sweep(argc, argv);
+}
@@ -0,0 +1,4 @@
+/* Shared by every program; filled in once per frame by render(). */
+layout(std140) uniform camera {
+  mat4 view_projection;
+};
@@ -0,0 +1,331 @@
+/* Asynchronous frame capture.
+
+   Frames are read back into a small ring of pixel pack buffers, each
+   followed by a fence, so glReadPixels only queues a copy on the GPU.
+   A buffer is mapped CAPTURE_RING frames later, when its fence has long
+   since signalled, and its pixels handed to a writer thread which does
+   the color conversion and I/O. When the writer falls behind, frames
+   are dropped rather than holding up rendering, unless the capture was
+   started with `lossless` (as headless rendering does).
+*/
+
+#define CAPTURE_RING 3
+#define CAPTURE_QUEUE 8
+#define CAPTURE_FPS 60
+
+typedef enum {CAPTURE_NONE, CAPTURE_PPM, CAPTURE_Y4M} capture_format;
+
+typedef struct {
+  capture_format format;
+  const char *output;
+  bool lossless;
+  int width, height;
+
+  GLuint pbo[CAPTURE_RING];
+  GLsync fence[CAPTURE_RING];
+  long issued, collected;
+
+  /* Frames travel from `free` to `ready` and back; both are stacks or
+     queues of indices into `frames`, guarded by `lock`. */
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  unsigned char *frames[CAPTURE_QUEUE];
+  long frame_number[CAPTURE_QUEUE];
+  int free[CAPTURE_QUEUE], nfree;
+  int ready[CAPTURE_QUEUE], ready_head, nready;
+  bool done;
+
+  FILE *stream;
+  bool piped;
+  long written, dropped;
+  bool failed;
+} capture;
+
+static void
+rgba_to_rgb(const unsigned char *rgba, unsigned char *rgb, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    rgb[3*i + 0] = rgba[4*i + 0];
+    rgb[3*i + 1] = rgba[4*i + 1];
+    rgb[3*i + 2] = rgba[4*i + 2];
+  }
+}
+
+/* Full-range BT.601 4:2:0, as YUV4MPEG2 "C420jpeg" expects. */
+static void
+rgba_to_yuv420_flipped(const unsigned char *rgba, unsigned char *yuv,
+                       int width, int height) {
+  unsigned char *py = yuv;
+  unsigned char *pu = py + (size_t)width*height;
+  unsigned char *pv = pu + (size_t)(width/2)*(height/2);
+
+  for (int y = 0; y < height; y++) {
+    const unsigned char *src = rgba + (size_t)(height - 1 - y)*width*4;
+    for (int x = 0; x < width; x++) {
+      int r = src[4*x], g = src[4*x + 1], b = src[4*x + 2];
+      py[(size_t)y*width + x] = (77*r + 150*g + 29*b + 128) >> 8;
+    }
+  }
+
+  for (int y = 0; y < height/2; y++) {
+    const unsigned char *row0 = rgba + (size_t)(height - 1 - 2*y)*width*4;
+    const unsigned char *row1 = row0 - (size_t)width*4;
+    for (int x = 0; x < width/2; x++) {
+      int r = 0, g = 0, b = 0;
+      for (int i = 0; i < 2; i++) {
+        r += row0[8*x + 4*i] + row1[8*x + 4*i];
+        g += row0[8*x + 4*i + 1] + row1[8*x + 4*i + 1];
+        b += row0[8*x + 4*i + 2] + row1[8*x + 4*i + 2];
+      }
+      pu[(size_t)y*(width/2) + x] = (-43*r - 85*g + 128*b + 4*128*256 + 512)
+        >> 10;
+      pv[(size_t)y*(width/2) + x] = (128*r - 107*g - 21*b + 4*128*256 + 512)
+        >> 10;
+    }
+  }
+}
+
+static int
+capture_write(capture *cap, const unsigned char *rgba, long number,
+              unsigned char *scratch) {
+  int w = cap->width, h = cap->height;
+
+  if (cap->format == CAPTURE_Y4M) {
+    size_t size = (size_t)w*h + 2*(size_t)(w/2)*(h/2);
+    rgba_to_yuv420_flipped(rgba, scratch, w, h);
+    return fputs("FRAME\n", cap->stream) >= 0
+      && fwrite(scratch, 1, size, cap->stream) == size;
+  }
+
+  rgba_to_rgb(rgba, scratch, (size_t)w*h);
+  if (cap->stream) {
+    return write_ppm(cap->stream, scratch, w, h);
+  }
+  else {
+    char filename[4096];
+    FILE *f;
+    int ok;
+
+    snprintf(filename, sizeof(filename), "%s%05ld.ppm", cap->output, number);
+    f = fopen(filename, "wb");
+    if (!f) {
+      fprintf(stderr, "Unable to open %s for writing\n", filename);
+      return 0;
+    }
+    ok = write_ppm(f, scratch, w, h);
+    ok = fclose(f) == 0 && ok;
+    return ok;
+  }
+}
+
+static void *
+capture_writer_main(void *arg) {
+  capture *cap = arg;
+  unsigned char *scratch = malloc((size_t)cap->width*cap->height*3);
+
+  pthread_mutex_lock(&cap->lock);
+  for (;;) {
+    int index;
+    long number;
+
+    while (cap->nready == 0 && !cap->done)
+      pthread_cond_wait(&cap->changed, &cap->lock);
+    if (cap->nready == 0)
+      break;
+
+    index = cap->ready[cap->ready_head];
+    number = cap->frame_number[index];
+    cap->ready_head = (cap->ready_head + 1) % CAPTURE_QUEUE;
+    cap->nready--;
+    pthread_mutex_unlock(&cap->lock);
+
+    if (!cap->failed && scratch) {
+      if (capture_write(cap, cap->frames[index], number, scratch)) {
+        cap->written++;
+      }
+      else {
+        fprintf(stderr, "Capture: unable to write frame %ld\n", number);
+        cap->failed = true;
+      }
+    }
+
+    pthread_mutex_lock(&cap->lock);
+    cap->free[cap->nfree++] = index;
+    pthread_cond_broadcast(&cap->changed);
+  }
+  pthread_mutex_unlock(&cap->lock);
+
+  free(scratch);
+  return NULL;
+}
+
+/* Destinations: "-" is stdout, "|command" pipes into a command, and
+   anything else is a file name (for PPM, a prefix for one file per
+   frame). */
+static int
+capture_init(capture *cap, capture_format format, const char *output,
+             int width, int height, bool lossless) {
+  memset(cap, 0, sizeof(*cap));
+  cap->format = format;
+  cap->output = output;
+  cap->lossless = lossless;
+  cap->width = width;
+  cap->height = height;
+
+  if (strcmp(output, "-") == 0) {
+    cap->stream = stdout;
+  }
+  else if (output[0] == '|') {
+    cap->stream = popen(output + 1, "w");
+    cap->piped = true;
+  }
+  else if (format == CAPTURE_Y4M) {
+    cap->stream = fopen(output, "wb");
+  }
+  if ((cap->piped || format == CAPTURE_Y4M) && !cap->stream) {
+    fprintf(stderr, "Capture: unable to open %s\n", output);
+    goto fail;
+  }
+  if (format == CAPTURE_Y4M) {
+    fprintf(cap->stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+            width, height, CAPTURE_FPS);
+  }
+
+  for (int i = 0; i < CAPTURE_QUEUE; i++) {
+    cap->frames[i] = malloc((size_t)width*height*4);
+    if (!cap->frames[i]) {
+      fprintf(stderr, "Capture: unable to allocate frame buffers\n");
+      goto fail;
+    }
+    cap->free[cap->nfree++] = i;
+  }
+
+  glGenBuffers(CAPTURE_RING, cap->pbo);
+  for (int i = 0; i < CAPTURE_RING; i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width*height*4, NULL,
+                 GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  pthread_mutex_init(&cap->lock, NULL);
+  pthread_cond_init(&cap->changed, NULL);
+  if (pthread_create(&cap->writer, NULL, capture_writer_main, cap) != 0) {
+    fprintf(stderr, "Capture: unable to start writer thread\n");
+    pthread_cond_destroy(&cap->changed);
+    pthread_mutex_destroy(&cap->lock);
+    goto fail;
+  }
+
+  return 1;
+
+  /* Buffer names still 0 are ignored by glDeleteBuffers. */
+ fail:
+  glDeleteBuffers(CAPTURE_RING, cap->pbo);
+  for (int i = 0; i < CAPTURE_QUEUE; i++)
+    free(cap->frames[i]);
+  if (cap->piped && cap->stream)
+    pclose(cap->stream);
+  else if (cap->stream && cap->stream != stdout)
+    fclose(cap->stream);
+  memset(cap, 0, sizeof(*cap));
+  return 0;
+}
+
+/* Map the oldest in-flight readback and queue it for the writer. */
+static void
+capture_collect(capture *cap) {
+  int slot = cap->collected % CAPTURE_RING;
+  int index = -1;
+  void *pixels;
+
+  glClientWaitSync(cap->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                   1000000000);
+  glDeleteSync(cap->fence[slot]);
+  cap->fence[slot] = NULL;
+
+  pthread_mutex_lock(&cap->lock);
+  while (cap->nfree == 0 && cap->lossless && !cap->failed)
+    pthread_cond_wait(&cap->changed, &cap->lock);
+  if (cap->nfree > 0)
+    index = cap->free[--cap->nfree];
+  pthread_mutex_unlock(&cap->lock);
+
+  if (index < 0) {
+    cap->dropped++;
+  }
+  else {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[slot]);
+    pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                              (GLsizeiptr)cap->width*cap->height*4,
+                              GL_MAP_READ_BIT);
+    if (pixels) {
+      memcpy(cap->frames[index], pixels, (size_t)cap->width*cap->height*4);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pthread_mutex_lock(&cap->lock);
+    cap->frame_number[index] = cap->collected;
+    cap->ready[(cap->ready_head + cap->nready) % CAPTURE_QUEUE] = index;
+    cap->nready++;
+    pthread_cond_broadcast(&cap->changed);
+    pthread_mutex_unlock(&cap->lock);
+  }
+
+  cap->collected++;
+}
+
+/* Queue a readback of the current read framebuffer. */
+static void
+capture_frame(capture *cap) {
+  int slot = cap->issued % CAPTURE_RING;
+
+  if (cap->issued - cap->collected == CAPTURE_RING)
+    capture_collect(cap);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbo[slot]);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, cap->width, cap->height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  cap->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  cap->issued++;
+}
+
+/* Drain the ring, wait for the writer to finish and close the output.
+   Returns 0 if any frame failed to write. */
+static int
+capture_finish(capture *cap) {
+  bool ok;
+
+  while (cap->collected < cap->issued)
+    capture_collect(cap);
+
+  pthread_mutex_lock(&cap->lock);
+  cap->done = true;
+  pthread_cond_broadcast(&cap->changed);
+  pthread_mutex_unlock(&cap->lock);
+  pthread_join(cap->writer, NULL);
+
+  ok = !cap->failed;
+  if (cap->stream) {
+    if (cap->piped)
+      ok = pclose(cap->stream) == 0 && ok;
+    else if (cap->stream == stdout)
+      ok = fflush(stdout) == 0 && ok;
+    else
+      ok = fclose(cap->stream) == 0 && ok;
+  }
+  if (cap->dropped)
+    fprintf(stderr, "Capture: dropped %ld of %ld frames\n",
+            cap->dropped, cap->issued);
+
+  glDeleteBuffers(CAPTURE_RING, cap->pbo);
+  for (int i = 0; i < CAPTURE_QUEUE; i++)
+    free(cap->frames[i]);
+  pthread_cond_destroy(&cap->changed);
+  pthread_mutex_destroy(&cap->lock);
+
+  return ok;
+}
@@ -0,0 +1,362 @@
+/* Checkpoints of the whole simulation state, taken with --checkpoint
+   FILE and resumed from with --restore FILE.
+
+   A checkpoint is a header page followed by regions, each starting on
+   a page boundary: the tail ring, then every array of the batch, then
+   the integrator's own arrays (dopri5's step state, the Lyapunov
+   tangent vectors). The arrays are stored exactly as they lie in
+   memory, so taking a checkpoint is a memcpy per array and restoring
+   one is mapping the file and copying them back, after which the run
+   goes on bit for bit as if it had never stopped. As with recordings,
+   `byte_order` tells a reader whether the file came from a machine of
+   the same byte order.
+
+   The outputs the run was writing are in it too, so a restored run
+   picks them up where they were: how far the section file and the
+   recording had got, the number of crossings, and the density totals
+   as one more region after the state's.
+
+   Every --checkpoint-interval steps the simulation copies its arrays
+   into a staging buffer laid out like the file and hands it to a
+   background thread. The writer puts it in FILE.tmp with a single
+   pwrite, syncs it, and renames it over FILE, so a crash midway
+   leaves the previous checkpoint whole. A checkpoint that comes due
+   while the last one is still being written is taken a tick later.
+*/
+
+#include <sys/mman.h>
+
+#define CHECKPOINT_MAGIC "LRZCKPT1"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_MAX_REGIONS 32
+/* lorenz's camera: rotation, then translation. */
+#define CHECKPOINT_VIEW 6
+
+#define CHECKPOINT_HAS_VIEW 1u
+
+/* The outputs a checkpoint holds the progress of. */
+#define CHECKPOINT_SECTION 1u
+#define CHECKPOINT_DENSITY 2u
+#define CHECKPOINT_RECORDING 4u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t byte_order;
+  uint32_t flags;
+  uint32_t system;
+  uint32_t integrator;
+  uint32_t precision;
+  uint32_t count;
+  uint32_t tail_length;
+  uint32_t lyapunov;
+  uint32_t region_count;
+  uint32_t outputs;
+  uint64_t step;
+  float dt, tolerance;
+  double params[SYSTEM_MAX_PARAMS];
+  float view[CHECKPOINT_VIEW];
+  /* Bytes of the section file and crossings in it. */
+  uint64_t section_bytes, section_total;
+  /* Steps in the recording. */
+  uint64_t record_steps;
+  /* The density grid; its totals are the last region. */
+  uint64_t density_outside;
+  uint32_t density_resolution;
+  float density_lo[3], density_hi[3];
+  /* Bytes in each region, not counting the padding to a page. */
+  uint64_t region_size[CHECKPOINT_MAX_REGIONS];
+} checkpoint_header;
+
+typedef struct {
+  void *data;
+  size_t size;
+} checkpoint_region;
+
+typedef struct {
+  const char *filename;
+  char *temporary;
+
+  unsigned char *staging;
+  size_t staging_size;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  /* Set while the staging buffer waits for or is being written. */
+  bool pending;
+  bool done;
+  bool failed;
+  unsigned long written;
+
+  /* Set from the render thread, copied into every checkpoint. */
+  float view[CHECKPOINT_VIEW];
+  bool has_view;
+} checkpointer;
+
+/* A checkpoint mapped for reading. */
+typedef struct {
+  int fd;
+  const unsigned char *base;
+  size_t size;
+  checkpoint_header header;
+} checkpoint_file;
+
+static size_t
+checkpoint_round(uint64_t size) {
+  return (size + RECORD_PAGE - 1) / RECORD_PAGE * RECORD_PAGE;
+}
+
+static uint64_t
+checkpoint_region_offset(const checkpoint_header *h, int region) {
+  uint64_t offset = h->header_size;
+
+  for (int i = 0; i < region; i++)
+    offset += checkpoint_round(h->region_size[i]);
+  return offset;
+}
+
+static void *
+checkpoint_writer_main(void *arg) {
+  checkpointer *c = arg;
+
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    int fd;
+    bool ok;
+
+    while (!c->pending && !c->done)
+      pthread_cond_wait(&c->changed, &c->lock);
+    if (!c->pending)
+      break;
+    pthread_mutex_unlock(&c->lock);
+
+    fd = open(c->temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && write_all(fd, c->staging, c->staging_size, 0)
+      && fsync(fd) == 0;
+    if (fd >= 0)
+      ok = close(fd) == 0 && ok;
+    ok = ok && rename(c->temporary, c->filename) == 0;
+    if (!ok)
+      perror("Checkpoint");
+
+    pthread_mutex_lock(&c->lock);
+    c->failed = c->failed || !ok;
+    c->written += ok;
+    c->pending = false;
+    pthread_cond_broadcast(&c->changed);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+/* Get ready to write checkpoints of `size` bytes, header included, to
+   `filename`. */
+static int
+checkpoint_open(checkpointer *c, const char *filename, size_t size) {
+  memset(c, 0, sizeof(*c));
+  c->filename = filename;
+  c->temporary = malloc(strlen(filename) + 5);
+  c->staging = alloc_aligned(size);
+  c->staging_size = size;
+  if (!c->temporary || !c->staging) {
+    fprintf(stderr, "Unable to allocate a %zu byte checkpoint buffer\n",
+            size);
+    free(c->temporary);
+    free(c->staging);
+    return 0;
+  }
+  sprintf(c->temporary, "%s.tmp", filename);
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->changed, NULL);
+  if (pthread_create(&c->writer, NULL, checkpoint_writer_main, c) != 0) {
+    fprintf(stderr, "Unable to start checkpoint thread\n");
+    pthread_cond_destroy(&c->changed);
+    pthread_mutex_destroy(&c->lock);
+    free(c->temporary);
+    free(c->staging);
+    return 0;
+  }
+  return 1;
+}
+
+static void
+checkpoint_set_view(checkpointer *c, const float view[CHECKPOINT_VIEW]) {
+  pthread_mutex_lock(&c->lock);
+  memcpy(c->view, view, sizeof(c->view));
+  c->has_view = true;
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Whether the last checkpoint is still being written, so that a new
+   one would have to wait. */
+static bool
+checkpoint_busy(checkpointer *c) {
+  bool busy;
+
+  pthread_mutex_lock(&c->lock);
+  busy = c->pending;
+  pthread_mutex_unlock(&c->lock);
+  return busy;
+}
+
+/* Copy `h` and the regions into the staging buffer and hand it to the
+   writer. If the last checkpoint is still being written, wait for it
+   when `wait` is set and otherwise give up, returning 0. */
+static int
+checkpoint_take(checkpointer *c, checkpoint_header *h,
+                const checkpoint_region *regions, int count, bool wait) {
+  pthread_mutex_lock(&c->lock);
+  while (wait && c->pending)
+    pthread_cond_wait(&c->changed, &c->lock);
+  if (c->pending) {
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+  }
+  memcpy(h->view, c->view, sizeof(h->view));
+  h->flags = c->has_view ? CHECKPOINT_HAS_VIEW : 0;
+  pthread_mutex_unlock(&c->lock);
+
+  memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+  h->version = CHECKPOINT_VERSION;
+  h->header_size = RECORD_PAGE;
+  h->byte_order = RECORD_BYTE_ORDER;
+  h->region_count = count;
+  for (int i = 0; i < count; i++)
+    h->region_size[i] = regions[i].size;
+
+  memcpy(c->staging, h, sizeof(*h));
+  for (int i = 0; i < count; i++) {
+    memcpy(c->staging + checkpoint_region_offset(h, i), regions[i].data,
+           regions[i].size);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->pending = true;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+  return 1;
+}
+
+/* Wait for the last checkpoint to be written and stop the writer.
+   Returns 0 if any checkpoint could not be written. */
+static int
+checkpoint_close(checkpointer *c) {
+  bool ok;
+
+  pthread_mutex_lock(&c->lock);
+  c->done = true;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->writer, NULL);
+  ok = !c->failed;
+  if (!ok)
+    fprintf(stderr, "%s is not up to date\n", c->filename);
+
+  pthread_cond_destroy(&c->changed);
+  pthread_mutex_destroy(&c->lock);
+  free(c->temporary);
+  free(c->staging);
+  return ok;
+}
+
+static void
+checkpoint_unmap(checkpoint_file *f) {
+  if (f->base)
+    munmap((void *)f->base, f->size);
+  if (f->fd >= 0)
+    close(f->fd);
+  f->base = NULL;
+  f->fd = -1;
+}
+
+/* Map a checkpoint and check that its header and regions are all
+   there, and that the tail region holds exactly the ring the header
+   describes, since restoring reads it slot by slot. */
+static int
+checkpoint_map(checkpoint_file *f, const char *filename) {
+  checkpoint_header *h = &f->header;
+  struct stat st;
+
+  memset(f, 0, sizeof(*f));
+  f->fd = open(filename, O_RDONLY);
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    fprintf(stderr, "Unable to open %s for reading\n", filename);
+    checkpoint_unmap(f);
+    return 0;
+  }
+  f->size = st.st_size;
+  if (f->size < RECORD_PAGE) {
+    fprintf(stderr, "%s is not a checkpoint\n", filename);
+    checkpoint_unmap(f);
+    return 0;
+  }
+  f->base = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+  if (f->base == MAP_FAILED) {
+    f->base = NULL;
+    perror("mmap");
+    checkpoint_unmap(f);
+    return 0;
+  }
+
+  memcpy(h, f->base, sizeof(*h));
+  if (memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) != 0
+      || h->version != CHECKPOINT_VERSION || h->header_size != RECORD_PAGE
+      || h->system >= SYSTEM_COUNT || h->count == 0 || h->tail_length < 2
+      || h->region_count > CHECKPOINT_MAX_REGIONS
+      || h->region_count < 1 + ((h->outputs & CHECKPOINT_DENSITY) != 0)
+      || h->region_size[0] != sizeof(vec3) * h->count * h->tail_length
+      || checkpoint_region_offset(h, h->region_count) > f->size) {
+    fprintf(stderr, "%s is not a checkpoint, or is cut short\n", filename);
+    checkpoint_unmap(f);
+    return 0;
+  }
+  if (h->byte_order != RECORD_BYTE_ORDER) {
+    fprintf(stderr, "%s was written on a machine of another byte order\n",
+            filename);
+    checkpoint_unmap(f);
+    return 0;
+  }
+  return 1;
+}
+
+static const void *
+checkpoint_region_data(const checkpoint_file *f, int region) {
+  return f->base + checkpoint_region_offset(&f->header, region);
+}
+
+/* Take the system, its parameters, the trajectory count and how they
+   are integrated from the --restore checkpoint, and the camera if it
+   has one and `view` is not NULL. The caller validates `cfg` again. */
+static int
+checkpoint_configure(config *cfg, float view[CHECKPOINT_VIEW],
+                     bool *has_view) {
+  checkpoint_file f;
+  const checkpoint_header *h = &f.header;
+
+  if (!checkpoint_map(&f, cfg->restore))
+    return 0;
+  if (h->integrator > INTEGRATOR_DOPRI5 || h->precision >= PRECISION_COUNT) {
+    fprintf(stderr, "%s is not a checkpoint\n", cfg->restore);
+    checkpoint_unmap(&f);
+    return 0;
+  }
+  cfg->system = h->system;
+  cfg->params.count = systems[h->system].param_count;
+  memcpy(cfg->params.values, h->params, sizeof(cfg->params.values));
+  cfg->count = h->count;
+  cfg->dt = h->dt;
+  cfg->tolerance = h->tolerance;
+  cfg->integrator = h->integrator;
+  cfg->precision = h->precision;
+  cfg->lyapunov = h->lyapunov;
+  if (view)
+    memcpy(view, h->view, sizeof(h->view));
+  if (has_view)
+    *has_view = (h->flags & CHECKPOINT_HAS_VIEW) != 0;
+  checkpoint_unmap(&f);
+  return 1;
+}
@@ -0,0 +1,713 @@
+/* Runtime configuration.
+
+   Every setting has a name, and can be given either on the command
+   line as `--name value` or in a config file as `name = value`, one per
+   line, with `#` starting a comment. Arguments are applied in order, so
+   options after `--config file` override what the file says.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {INIT_PRESET, INIT_CLOUD, INIT_GRID, INIT_PERTURB} init_mode;
+typedef enum {INTEGRATOR_RK4, INTEGRATOR_DOPRI5} integrator;
+typedef enum {ENGINE_CPU, ENGINE_GPU} engine;
+typedef enum {SWEEP_MAXIMA, SWEEP_SECTION} sweep_collect;
+typedef enum {AXIS_X, AXIS_Y, AXIS_Z} axis;
+
+typedef struct {
+  int count;
+  double values[SYSTEM_MAX_PARAMS];
+} param_list;
+
+typedef struct {
+  system_id system;
+  /* Overrides for the first params.count of the system's defaults. */
+  param_list params;
+
+  int count;
+  int tail_length;
+  int steps_per_frame;
+  int steps_per_second;
+  int threads;
+  float dt;
+  integrator integrator;
+  float tolerance;
+  batch_precision precision;
+  engine engine;
+  int lyapunov;
+
+  const char *section;
+  vec3 section_normal;
+  float section_offset;
+  section_direction section_direction;
+  int section_plot;
+
+  int density;
+  vec3 density_min, density_max;
+  int density_interval;
+  const char *density_output;
+  int density_show;
+
+  int sweep;
+  const char *sweep_param;
+  float sweep_from, sweep_to;
+  int sweep_transient;
+  int sweep_steps;
+  sweep_collect sweep_collect;
+  axis sweep_coordinate;
+  const char *sweep_data;
+  const char *sweep_image;
+  int sweep_height;
+
+  init_mode init;
+  unsigned seed;
+  vec3 center;
+  float spread;
+
+  int headless;
+  int capture;
+  const char *output;
+
+  const char *record;
+  int record_chunk;
+  int record_index;
+
+  const char *checkpoint;
+  int checkpoint_interval;
+  const char *restore;
+
+  const char *replay;
+  int replay_start;
+
+  const char *shader_cache;
+
+  int profile;
+  const char *trace;
+
+  int bench_precision;
+} config;
+
+typedef enum {
+  OPTION_INT, OPTION_UINT, OPTION_FLOAT, OPTION_VEC3, OPTION_ENUM,
+  OPTION_STRING, OPTION_PARAMS
+} option_type;
+
+typedef struct {
+  const char *name;
+  option_type type;
+  size_t offset;
+  const char *const *values;
+  const char *help;
+} option;
+
+static const char *const init_names[] = {
+  "preset", "cloud", "grid", "perturb", NULL
+};
+
+static const char *const integrator_names[] = {
+  "rk4", "dopri5", NULL
+};
+
+static const char *const precision_names[] = {
+  "float", "double", "mixed", NULL
+};
+
+static const char *const engine_names[] = {
+  "cpu", "gpu", NULL
+};
+
+static const char *const section_direction_names[] = {
+  "up", "down", "both", NULL
+};
+
+static const char *const sweep_collect_names[] = {
+  "maxima", "section", NULL
+};
+
+static const char *const axis_names[] = {
+  "x", "y", "z", NULL
+};
+
+static const char *const capture_names[] = {
+  "none", "ppm", "y4m", NULL
+};
+
+static const option options[] = {
+  {"system", OPTION_ENUM, offsetof(config, system), system_names,
+   "lorenz, rossler, thomas, chen, aizawa or halvorsen"},
+  {"params", OPTION_PARAMS, offsetof(config, params), NULL,
+   "system parameters as a,b,..., defaults for any left out"},
+  {"count", OPTION_INT, offsetof(config, count), NULL,
+   "number of trajectories"},
+  {"tail-length", OPTION_INT, offsetof(config, tail_length), NULL,
+   "points kept in each trajectory's tail"},
+  {"steps-per-frame", OPTION_INT, offsetof(config, steps_per_frame), NULL,
+   "integration steps per published snapshot"},
+  {"rate", OPTION_INT, offsetof(config, steps_per_second), NULL,
+   "integration steps per second, 0 for unthrottled"},
+  {"threads", OPTION_INT, offsetof(config, threads), NULL,
+   "integration threads, 0 for one per CPU"},
+  {"dt", OPTION_FLOAT, offsetof(config, dt), NULL,
+   "integration step size (output interval with dopri5)"},
+  {"integrator", OPTION_ENUM, offsetof(config, integrator), integrator_names,
+   "rk4 with a fixed step, or adaptive dopri5"},
+  {"tolerance", OPTION_FLOAT, offsetof(config, tolerance), NULL,
+   "relative and absolute error per dopri5 step"},
+  {"precision", OPTION_ENUM, offsetof(config, precision), precision_names,
+   "rk4 state as float, double, or float with compensated sums (mixed)"},
+  {"engine", OPTION_ENUM, offsetof(config, engine), engine_names,
+   "integrate on the cpu threads, or on the gpu with transform feedback"},
+  {"lyapunov", OPTION_INT, offsetof(config, lyapunov), NULL,
+   "estimate the Lyapunov exponents, re-orthonormalizing every this many "
+   "steps; 0 for off"},
+  {"section", OPTION_STRING, offsetof(config, section), NULL,
+   "write Poincare section crossings to this file, - for stdout, \"\" to "
+   "only plot them"},
+  {"section-normal", OPTION_VEC3, offsetof(config, section_normal), NULL,
+   "normal of the section plane, as x,y,z"},
+  {"section-offset", OPTION_FLOAT, offsetof(config, section_offset), NULL,
+   "the section plane is normal . x = offset"},
+  {"section-direction", OPTION_ENUM, offsetof(config, section_direction),
+   section_direction_names, "crossings to count: up, down or both"},
+  {"section-plot", OPTION_INT, offsetof(config, section_plot), NULL,
+   "crossings kept in the on-screen section plot, 0 for none"},
+  {"density", OPTION_INT, offsetof(config, density), NULL,
+   "count every point in a grid of this many voxels a side, 0 for off"},
+  {"density-min", OPTION_VEC3, offsetof(config, density_min), NULL,
+   "lower corner of the density grid, as x,y,z"},
+  {"density-max", OPTION_VEC3, offsetof(config, density_max), NULL,
+   "upper corner of the density grid (each defaults to the system's box)"},
+  {"density-interval", OPTION_INT, offsetof(config, density_interval), NULL,
+   "steps between adding up the per-thread density grids"},
+  {"density-output", OPTION_STRING, offsetof(config, density_output), NULL,
+   "write the density grid to this file at exit"},
+  {"density-show", OPTION_INT, offsetof(config, density_show), NULL,
+   "1 to draw the density grid in the window, 0 to only count"},
+  {"sweep", OPTION_INT, offsetof(config, sweep), NULL,
+   "lorenz-sweep: number of parameter values in the bifurcation diagram"},
+  {"sweep-param", OPTION_STRING, offsetof(config, sweep_param), NULL,
+   "name of the parameter to sweep, e.g. rho"},
+  {"sweep-from", OPTION_FLOAT, offsetof(config, sweep_from), NULL,
+   "first value of the swept parameter"},
+  {"sweep-to", OPTION_FLOAT, offsetof(config, sweep_to), NULL,
+   "last value of the swept parameter"},
+  {"sweep-transient", OPTION_INT, offsetof(config, sweep_transient), NULL,
+   "steps to let each trajectory settle before collecting points"},
+  {"sweep-steps", OPTION_INT, offsetof(config, sweep_steps), NULL,
+   "steps to collect points over for each parameter value"},
+  {"sweep-collect", OPTION_ENUM, offsetof(config, sweep_collect),
+   sweep_collect_names, "points of the diagram: local maxima, or section "
+   "plane crossings"},
+  {"sweep-coordinate", OPTION_ENUM, offsetof(config, sweep_coordinate),
+   axis_names, "coordinate of the points plotted: x, y or z"},
+  {"sweep-data", OPTION_STRING, offsetof(config, sweep_data), NULL,
+   "write the diagram's points to this file as CSV, - for stdout"},
+  {"sweep-image", OPTION_STRING, offsetof(config, sweep_image), NULL,
+   "draw the diagram to this PGM image, a column per parameter value"},
+  {"sweep-height", OPTION_INT, offsetof(config, sweep_height), NULL,
+   "height of the diagram image in pixels"},
+  {"bench-precision", OPTION_INT, offsetof(config, bench_precision), NULL,
+   "compare the precision modes over this many steps and exit"},
+  {"init", OPTION_ENUM, offsetof(config, init), init_names,
+   "initial conditions: preset, cloud, grid or perturb"},
+  {"seed", OPTION_UINT, offsetof(config, seed), NULL,
+   "random seed for cloud initial conditions"},
+  {"center", OPTION_VEC3, offsetof(config, center), NULL,
+   "center of the initial conditions, as x,y,z"},
+  {"spread", OPTION_FLOAT, offsetof(config, spread), NULL,
+   "size of the cloud or grid, or distance between perturbed points"},
+  {"headless", OPTION_INT, offsetof(config, headless), NULL,
+   "render this many frames offscreen and exit, 0 to open a window"},
+  {"capture", OPTION_ENUM, offsetof(config, capture), capture_names,
+   "record frames as none, ppm or y4m (headless defaults to ppm)"},
+  {"output", OPTION_STRING, offsetof(config, output), NULL,
+   "capture destination: file (prefix for ppm), - or |command"},
+  {"record", OPTION_STRING, offsetof(config, record), NULL,
+   "append every step of every trajectory to this file"},
+  {"record-chunk", OPTION_INT, offsetof(config, record_chunk), NULL,
+   "steps per recording chunk, 0 for about 4 MiB"},
+  {"record-index", OPTION_INT, offsetof(config, record_index), NULL,
+   "1 to end the recording with a chunk index, 0 to leave it out"},
+  {"checkpoint", OPTION_STRING, offsetof(config, checkpoint), NULL,
+   "save the whole simulation state to this file periodically and at exit"},
+  {"checkpoint-interval", OPTION_INT, offsetof(config, checkpoint_interval),
+   NULL, "steps between checkpoints"},
+  {"restore", OPTION_STRING, offsetof(config, restore), NULL,
+   "resume from a checkpoint, taking its system, params, count and "
+   "integrator"},
+  {"replay", OPTION_STRING, offsetof(config, replay), NULL,
+   "play back a recording instead of integrating"},
+  {"replay-start", OPTION_INT, offsetof(config, replay_start), NULL,
+   "step of the recording to start playing back from"},
+  {"shader-cache", OPTION_STRING, offsetof(config, shader_cache), NULL,
+   "directory for compiled shader programs, \"\" to disable"},
+  {"profile", OPTION_INT, offsetof(config, profile), NULL,
+   "1 to time each phase of every frame and print a summary at exit"},
+  {"trace", OPTION_STRING, offsetof(config, trace), NULL,
+   "write the frame phase timings to this file as a Chrome trace"},
+};
+
+#define OPTION_COUNT (int)(sizeof(options) / sizeof(options[0]))
+
+static void
+config_defaults(config *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->system = SYSTEM_LORENZ;
+  cfg->count = 5;
+  cfg->tail_length = 1024;
+  cfg->steps_per_frame = 3;
+  cfg->steps_per_second = 180;
+  cfg->threads = 0;
+  cfg->dt = 0.005f;
+  cfg->integrator = INTEGRATOR_RK4;
+  cfg->tolerance = 1e-6f;
+  cfg->precision = PRECISION_FLOAT;
+  cfg->engine = ENGINE_CPU;
+  cfg->lyapunov = 0;
+
+  cfg->section = NULL;
+  cfg->section_normal.x = 0.0f;
+  cfg->section_normal.y = 0.0f;
+  cfg->section_normal.z = 1.0f;
+  cfg->section_offset = 27.0f;
+  cfg->section_direction = SECTION_UP;
+  cfg->section_plot = 65536;
+
+  cfg->density = 0;
+  /* NaN until given; config_density_box takes the system's box. */
+  cfg->density_min.x = cfg->density_min.y = cfg->density_min.z = NAN;
+  cfg->density_max.x = cfg->density_max.y = cfg->density_max.z = NAN;
+  cfg->density_interval = 60;
+  cfg->density_output = NULL;
+  cfg->density_show = 1;
+
+  cfg->sweep = 0;
+  cfg->sweep_param = NULL;
+  cfg->sweep_transient = 10000;
+  cfg->sweep_steps = 20000;
+  cfg->sweep_collect = SWEEP_MAXIMA;
+  cfg->sweep_coordinate = AXIS_Z;
+  cfg->sweep_data = NULL;
+  cfg->sweep_image = NULL;
+  cfg->sweep_height = 600;
+
+  cfg->init = INIT_PRESET;
+  cfg->seed = 1;
+  cfg->center.x = 0.0f;
+  cfg->center.y = 1.0f;
+  cfg->center.z = 0.2f;
+  cfg->spread = 1.0f;
+
+  cfg->headless = 0;
+  cfg->capture = -1;
+  cfg->output = "frame";
+
+  cfg->record = NULL;
+  cfg->record_chunk = 0;
+  cfg->record_index = 1;
+
+  cfg->checkpoint = NULL;
+  cfg->checkpoint_interval = 100000;
+  cfg->restore = NULL;
+
+  cfg->replay = NULL;
+  cfg->replay_start = 0;
+
+  cfg->shader_cache = NULL;
+
+  cfg->profile = 0;
+  cfg->trace = NULL;
+}
+
+static void
+config_usage(const char *program) {
+  fprintf(stderr, "Usage: %s [--config FILE] [--OPTION VALUE]...\n\n",
+          program);
+  for (int i = 0; i < OPTION_COUNT; i++) {
+    fprintf(stderr, "  --%-18s %s\n", options[i].name, options[i].help);
+  }
+}
+
+static int
+parse_float(const char *value, float *out) {
+  char *end;
+
+  errno = 0;
+  *out = strtof(value, &end);
+  return errno == 0 && end != value && *end == '\0';
+}
+
+static int
+config_set(config *cfg, const char *key, const char *value) {
+  const option *opt = NULL;
+  char *field;
+  char *end;
+
+  for (int i = 0; i < OPTION_COUNT; i++) {
+    if (strcmp(options[i].name, key) == 0)
+      opt = &options[i];
+  }
+  if (!opt) {
+    fprintf(stderr, "Unknown option '%s'\n", key);
+    return 0;
+  }
+
+  field = (char *)cfg + opt->offset;
+  switch (opt->type) {
+  case OPTION_INT: {
+    long v;
+    errno = 0;
+    v = strtol(value, &end, 10);
+    if (errno || end == value || *end || v < 0 || v > INT32_MAX)
+      goto invalid;
+    *(int *)field = v;
+  } break;
+  case OPTION_UINT: {
+    unsigned long v;
+    errno = 0;
+    v = strtoul(value, &end, 10);
+    if (errno || end == value || *end || v > UINT32_MAX)
+      goto invalid;
+    *(unsigned *)field = v;
+  } break;
+  case OPTION_FLOAT: {
+    if (!parse_float(value, (float *)field))
+      goto invalid;
+  } break;
+  case OPTION_VEC3: {
+    vec3 v;
+    int used = -1;
+    sscanf(value, "%f,%f,%f%n", &v.x, &v.y, &v.z, &used);
+    if (used < 0 || value[used] != '\0')
+      goto invalid;
+    *(vec3 *)field = v;
+  } break;
+  case OPTION_ENUM: {
+    int i;
+    for (i = 0; opt->values[i]; i++) {
+      if (strcmp(opt->values[i], value) == 0)
+        break;
+    }
+    if (!opt->values[i])
+      goto invalid;
+    *(int *)field = i;
+  } break;
+  case OPTION_PARAMS: {
+    param_list list = {0};
+    const char *p = value;
+    for (;;) {
+      if (list.count == SYSTEM_MAX_PARAMS)
+        goto invalid;
+      list.values[list.count] = strtod(p, &end);
+      if (end == p)
+        goto invalid;
+      list.count++;
+      if (*end == '\0')
+        break;
+      if (*end != ',')
+        goto invalid;
+      p = end + 1;
+    }
+    *(param_list *)field = list;
+  } break;
+  case OPTION_STRING: {
+    char *copy = strdup(value);
+    if (!copy)
+      goto invalid;
+    *(const char **)field = copy;
+  } break;
+  }
+  return 1;
+
+ invalid:
+  fprintf(stderr, "Invalid value '%s' for %s\n", value, key);
+  return 0;
+}
+
+static char *
+trim(char *s) {
+  char *end;
+
+  while (isspace((unsigned char)*s))
+    s++;
+  end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    end--;
+  *end = '\0';
+  return s;
+}
+
+static int
+config_load(config *cfg, const char *filename) {
+  long length;
+  char *contents = file_contents(filename, &length);
+  char *line, *next;
+  int lineno = 0;
+  int ok = 1;
+
+  if (!contents)
+    return 0;
+
+  for (line = contents; line && ok; line = next) {
+    char *eq, *comment;
+
+    lineno++;
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    line = trim(line);
+    if (!*line)
+      continue;
+
+    eq = strchr(line, '=');
+    if (!eq) {
+      fprintf(stderr, "%s:%d: expected 'name = value'\n", filename, lineno);
+      ok = 0;
+      break;
+    }
+    *eq = '\0';
+    ok = config_set(cfg, trim(line), trim(eq + 1));
+    if (!ok)
+      fprintf(stderr, "%s:%d: invalid setting\n", filename, lineno);
+  }
+
+  free(contents);
+  return ok;
+}
+
+/* The box the density grid covers: --density-min and --density-max,
+   each corner taken from the system's box if it was not given. */
+static void
+config_density_box(const config *cfg, vec3 *lo, vec3 *hi) {
+  const vec3 *min = &cfg->density_min, *max = &cfg->density_max;
+  const float (*box)[3] = systems[cfg->system].box;
+
+  if (isnan(min->x)) {
+    lo->x = box[0][0];
+    lo->y = box[0][1];
+    lo->z = box[0][2];
+  }
+  else {
+    *lo = *min;
+  }
+  if (isnan(max->x)) {
+    hi->x = box[1][0];
+    hi->y = box[1][1];
+    hi->z = box[1][2];
+  }
+  else {
+    *hi = *max;
+  }
+}
+
+/* Index of the parameter --sweep-param names among the system's, or -1
+   if it names none of them. */
+static int
+config_sweep_param(const config *cfg) {
+  const char *names = systems[cfg->system].params;
+  size_t length = cfg->sweep_param ? strlen(cfg->sweep_param) : 0;
+
+  for (int i = 0; length > 0 && *names; i++) {
+    size_t n = strcspn(names, ",");
+    if (n == length && strncmp(names, cfg->sweep_param, n) == 0)
+      return i;
+    names += n + (names[n] == ',');
+  }
+  return -1;
+}
+
+static int
+config_validate(const config *cfg) {
+  if (cfg->count < 1 || cfg->tail_length < 2 || cfg->steps_per_frame < 1) {
+    fprintf(stderr, "count, tail-length and steps-per-frame must be "
+            "positive (and tail-length at least 2)\n");
+    return 0;
+  }
+  if (cfg->steps_per_frame > cfg->tail_length) {
+    fprintf(stderr, "steps-per-frame must not exceed tail-length\n");
+    return 0;
+  }
+  if ((double)cfg->count * 2 * cfg->tail_length > INT32_MAX) {
+    fprintf(stderr, "count * tail-length is too large\n");
+    return 0;
+  }
+  if (cfg->params.count > systems[cfg->system].param_count) {
+    fprintf(stderr, "%s takes %d parameters (%s)\n",
+            system_names[cfg->system], systems[cfg->system].param_count,
+            systems[cfg->system].params);
+    return 0;
+  }
+  if (!(cfg->dt > 0.0f) || !(cfg->tolerance > 0.0f)) {
+    fprintf(stderr, "dt and tolerance must be positive\n");
+    return 0;
+  }
+  if (cfg->engine == ENGINE_GPU && !cfg->replay
+      && (cfg->integrator != INTEGRATOR_RK4
+          || cfg->precision != PRECISION_FLOAT || cfg->record)) {
+    fprintf(stderr, "the gpu engine only integrates rk4 in float "
+            "precision, and cannot record\n");
+    return 0;
+  }
+  if (cfg->lyapunov > 0
+      && (cfg->integrator != INTEGRATOR_RK4
+          || cfg->precision == PRECISION_MIXED
+          || cfg->engine != ENGINE_CPU)) {
+    fprintf(stderr, "lyapunov needs rk4 in float or double precision on "
+            "the cpu engine\n");
+    return 0;
+  }
+  if (cfg->section && cfg->engine != ENGINE_CPU && !cfg->replay) {
+    fprintf(stderr, "section needs the cpu engine\n");
+    return 0;
+  }
+  if (cfg->density > 0) {
+    vec3 lo, hi;
+    config_density_box(cfg, &lo, &hi);
+    if (cfg->density > 1024 || cfg->density_interval < 1
+        || !(lo.x < hi.x && lo.y < hi.y && lo.z < hi.z)
+        || (cfg->engine != ENGINE_CPU && !cfg->replay)) {
+      fprintf(stderr, "density must be at most 1024, with a positive "
+              "interval and a box with density-min below density-max, "
+              "and needs the cpu engine\n");
+      return 0;
+    }
+  }
+  if ((cfg->checkpoint || cfg->restore)
+      && (cfg->checkpoint_interval < 1 || cfg->engine != ENGINE_CPU
+          || cfg->replay)) {
+    fprintf(stderr, "checkpoint and restore need the cpu engine, no "
+            "replay, and a positive checkpoint-interval\n");
+    return 0;
+  }
+  if (cfg->sweep > 0) {
+    if (config_sweep_param(cfg) < 0) {
+      fprintf(stderr, "sweep-param must be one of %s's parameters (%s)\n",
+              system_names[cfg->system], systems[cfg->system].params);
+      return 0;
+    }
+    if (!isfinite(cfg->sweep_from) || !isfinite(cfg->sweep_to)
+        || cfg->sweep_steps < 1 || cfg->sweep_height < 1
+        || cfg->sweep_height > 65535) {
+      fprintf(stderr, "sweep-from and sweep-to must be finite, "
+              "sweep-steps positive and sweep-height at most 65535\n");
+      return 0;
+    }
+    if (cfg->integrator != INTEGRATOR_RK4 || cfg->engine != ENGINE_CPU) {
+      fprintf(stderr, "sweep needs rk4 on the cpu engine\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Apply command line arguments on top of the defaults. Returns 0 if the
+   program should exit. */
+static int
+config_parse_args(config *cfg, int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      config_usage(argv[0]);
+      return 0;
+    }
+    if (strncmp(arg, "--", 2) != 0 || i + 1 >= argc) {
+      fprintf(stderr, "Unexpected argument '%s'\n", arg);
+      config_usage(argv[0]);
+      return 0;
+    }
+    if (strcmp(arg, "--config") == 0) {
+      if (!config_load(cfg, argv[++i]))
+        return 0;
+    }
+    else if (!config_set(cfg, arg + 2, argv[++i])) {
+      return 0;
+    }
+  }
+
+  return config_validate(cfg);
+}
+
+/* splitmix64, so a seed gives the same cloud on every platform. */
+static uint64_t
+random_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [-1, 1). */
+static float
+random_signed(uint64_t *state) {
+  return (random_next(state) >> 40) / (float)(1 << 23) - 1.0f;
+}
+
+/* The system's default parameters, with the ones given overridden. */
+static void
+config_system_params(const config *cfg, double params[SYSTEM_MAX_PARAMS]) {
+  for (int i = 0; i < SYSTEM_MAX_PARAMS; i++) {
+    params[i] = i < cfg->params.count ? cfg->params.values[i]
+      : systems[cfg->system].defaults[i];
+  }
+}
+
+/* Fill the batch with the system parameters and the initial conditions
+   the config asks for. */
+static void
+config_initial_state(const config *cfg, batch *b) {
+  static const vec3 preset[] = {{0.0, 1.2, 0.2},
+                                {1.0, 0.04, 1.0},
+                                {-0.5, -1.0, 0.0},
+                                {0.01, 0.6, 0.2},
+                                {0.01, -0.5, 0.2}};
+  const int presets = sizeof(preset) / sizeof(preset[0]);
+  uint64_t rng = cfg->seed;
+  double params[SYSTEM_MAX_PARAMS];
+  int side = 1;
+
+  config_system_params(cfg, params);
+  batch_set_params(b, params);
+
+  if (cfg->init == INIT_GRID) {
+    while (side * side * side < cfg->count)
+      side++;
+  }
+
+  for (int i = 0; i < cfg->count; i++) {
+    vec3 p = cfg->center;
+
+    switch (cfg->init) {
+    case INIT_PRESET: {
+      /* The classic five points, repeated with a small offset when more
+         trajectories are asked for. */
+      p = preset[i % presets];
+      p.x += 1e-3f * (i / presets);
+    } break;
+    case INIT_CLOUD: {
+      p.x += cfg->spread * random_signed(&rng);
+      p.y += cfg->spread * random_signed(&rng);
+      p.z += cfg->spread * random_signed(&rng);
+    } break;
+    case INIT_GRID: {
+      float step = side > 1 ? 2 * cfg->spread / (side - 1) : 0.0f;
+      float origin = side > 1 ? -cfg->spread : 0.0f;
+      p.x += origin + step * (i % side);
+      p.y += origin + step * (i / side % side);
+      p.z += origin + step * (i / (side * side));
+    } break;
+    case INIT_PERTURB: {
+      p.x += cfg->spread * i;
+    } break;
+    }
+
+    batch_set(b, i, p);
+  }
+}
@@ -0,0 +1,267 @@
+/* Invariant density of the attractor, turned on with --density N.
+
+   Every point integrated, that is the state of every trajectory after
+   every step, is counted in the voxel of an N^3 grid it falls in; the
+   points outside the grid's box go to one extra counter. Each pool
+   slice counts into a private grid of 32-bit counters, so the workers
+   never share a cache line, let alone need atomics. Every --density-
+   interval steps, and before any private counter could overflow, the
+   private grids are added into one grid of 64-bit totals and cleared,
+   with the voxels split over the pool.
+
+   After a reduction the totals can also be turned into an image of one
+   byte per voxel, log(1 + count) scaled to the largest count, which
+   lorenz uploads as a 3D texture and ray-marches. At exit the totals
+   are written to the --density-output file: a header page, then the
+   N^3 counts as 64-bit integers with x varying fastest, then z.
+*/
+
+#define DENSITY_MAGIC "LRZDENS1"
+#define DENSITY_VERSION 2
+/* Voxels handed to a worker at a time when reducing. */
+#define DENSITY_GRAIN 4096
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t byte_order;
+  uint32_t resolution;
+  uint32_t system;
+  uint32_t reserved;
+  /* Corners of the box the grid covers. */
+  float lo[3], hi[3];
+  /* Points counted, inside the box and outside it. */
+  uint64_t inside, outside;
+  double params[SYSTEM_MAX_PARAMS];
+} density_header;
+
+typedef struct {
+  int resolution;
+  /* resolution^3, the index of the outside counter. */
+  size_t voxels;
+  float lo[3], hi[3];
+  /* Voxels per unit length along each axis. */
+  float scale[3];
+
+  uint32_t **grids;
+  int grid_count;
+  uint64_t *totals;
+  uint64_t outside;
+  /* Points any one private grid may have counted since the last
+     reduction, at most. */
+  uint64_t pending;
+  int interval, since;
+
+  /* Only when rendering; `version` counts the images made. */
+  unsigned char *image;
+  unsigned long version;
+  uint64_t largest;
+  /* The largest total in each slice of a reduction. */
+  uint64_t *largest_in_slice;
+
+  pool *workers;
+  const char *output;
+  system_id system;
+  double params[SYSTEM_MAX_PARAMS];
+} density;
+
+static void
+density_free(density *d) {
+  for (int i = 0; d->grids && i < d->grid_count; i++)
+    free(d->grids[i]);
+  free(d->grids);
+  free(d->totals);
+  free(d->image);
+  free(d->largest_in_slice);
+  memset(d, 0, sizeof(*d));
+}
+
+/* Start counting the points of `b` in a grid of resolution^3 voxels
+   between `lo` and `hi`, reducing on `workers` every `interval` steps,
+   and write the grid to `output` at the end if it is not NULL. With
+   `image` set an image of the grid is kept up to date for display. */
+static int
+density_open(density *d, int resolution, vec3 lo, vec3 hi, int interval,
+             const char *output, bool image, const batch *b,
+             system_id system, pool *workers) {
+  float box_lo[3] = {lo.x, lo.y, lo.z}, box_hi[3] = {hi.x, hi.y, hi.z};
+
+  memset(d, 0, sizeof(*d));
+  d->resolution = resolution;
+  d->voxels = (size_t)resolution * resolution * resolution;
+  for (int j = 0; j < 3; j++) {
+    d->lo[j] = box_lo[j];
+    d->hi[j] = box_hi[j];
+    d->scale[j] = resolution / (box_hi[j] - box_lo[j]);
+  }
+  d->interval = interval;
+  d->output = output;
+  d->system = system;
+  memcpy(d->params, b->params, sizeof(d->params));
+  d->workers = workers;
+
+  d->grid_count = workers->nthreads;
+  d->grids = calloc(d->grid_count, sizeof(uint32_t *));
+  d->totals = alloc_aligned(sizeof(uint64_t) * d->voxels);
+  d->largest_in_slice = calloc(d->grid_count, sizeof(uint64_t));
+  if (image)
+    d->image = alloc_aligned(d->voxels);
+  for (int i = 0; d->grids && i < d->grid_count; i++)
+    d->grids[i] = alloc_aligned(sizeof(uint32_t) * (d->voxels + 1));
+  for (int i = 0; d->grids && i < d->grid_count; i++) {
+    if (!d->grids[i])
+      goto fail;
+  }
+  if (!d->grids || !d->totals || !d->largest_in_slice
+      || (image && !d->image))
+    goto fail;
+  return 1;
+
+ fail:
+  fprintf(stderr, "Unable to allocate a density grid of %d^3 voxels for "
+          "%d threads\n", resolution, d->grid_count);
+  density_free(d);
+  return 0;
+}
+
+/* Count trajectories [begin, end) of `b` in slice `slice`'s grid. The
+   voxel is worked out without branches, the outside counter standing
+   in for any point not in the box, so the only thing that holds a
+   point up is its increment missing the cache. */
+static void
+density_count(density *d, int slice, const batch *b, int begin, int end) {
+  uint32_t *restrict grid = d->grids[slice];
+  const float *x = b->x, *y = b->y, *z = b->z;
+  float lo0 = d->lo[0], lo1 = d->lo[1], lo2 = d->lo[2];
+  float s0 = d->scale[0], s1 = d->scale[1], s2 = d->scale[2];
+  float n = d->resolution;
+  uint32_t stride = d->resolution, outside = d->voxels;
+
+  for (int c = begin; c < end; c++) {
+    float fx = (x[c] - lo0) * s0, fy = (y[c] - lo1) * s1;
+    float fz = (z[c] - lo2) * s2;
+    int inside = (fx >= 0.0f) & (fx < n) & (fy >= 0.0f) & (fy < n)
+      & (fz >= 0.0f) & (fz < n);
+    uint32_t ix = (int32_t)(inside ? fx : 0.0f);
+    uint32_t iy = (int32_t)(inside ? fy : 0.0f);
+    uint32_t iz = (int32_t)(inside ? fz : 0.0f);
+
+    grid[inside ? ix + stride * (iy + stride * iz) : outside]++;
+  }
+}
+
+/* Pool task: add the private grids into the totals over voxels
+   [begin, end) and clear them. */
+static void
+density_reduce_range(void *arg, int begin, int end) {
+  density *d = arg;
+  uint64_t largest = 0;
+
+  for (int i = 0; i < d->grid_count; i++) {
+    uint32_t *restrict grid = d->grids[i];
+    uint64_t *restrict totals = d->totals;
+
+    for (int v = begin; v < end; v++) {
+      totals[v] += grid[v];
+      grid[v] = 0;
+    }
+  }
+  for (int v = begin; v < end; v++)
+    largest = d->totals[v] > largest ? d->totals[v] : largest;
+  d->largest_in_slice[pool_slice(d->workers, begin)] = largest;
+}
+
+/* Pool task: redraw the image over voxels [begin, end). */
+static void
+density_image_range(void *arg, int begin, int end) {
+  density *d = arg;
+  float scale = d->largest > 0 ? 255.0f / log1pf(d->largest) : 0.0f;
+
+  for (int v = begin; v < end; v++)
+    d->image[v] = (unsigned char)(log1pf(d->totals[v]) * scale + 0.5f);
+}
+
+static void
+density_reduce(density *d) {
+  for (int i = 0; i < d->grid_count; i++) {
+    d->outside += d->grids[i][d->voxels];
+    d->grids[i][d->voxels] = 0;
+    d->largest_in_slice[i] = 0;
+  }
+  pool_run(d->workers, density_reduce_range, d, d->voxels, DENSITY_GRAIN);
+  d->largest = 0;
+  for (int i = 0; i < d->grid_count; i++) {
+    if (d->largest_in_slice[i] > d->largest)
+      d->largest = d->largest_in_slice[i];
+  }
+  d->pending = 0;
+  d->since = 0;
+
+  if (d->image) {
+    pool_run(d->workers, density_image_range, d, d->voxels, DENSITY_GRAIN);
+    d->version++;
+  }
+}
+
+/* Note that `steps` steps of `count` trajectories are about to be
+   counted, and reduce first if that could overflow a counter, or after
+   if the interval is up. */
+static void
+density_before(density *d, int count, int steps) {
+  if (d->pending + (uint64_t)count * steps > UINT32_MAX)
+    density_reduce(d);
+  d->pending += (uint64_t)count * steps;
+}
+
+static void
+density_after(density *d, int steps) {
+  d->since += steps;
+  if (d->since >= d->interval)
+    density_reduce(d);
+}
+
+/* Reduce what is left, write the totals out if asked to, and free
+   everything. Returns 0 if the file could not be written. */
+static int
+density_close(density *d) {
+  uint64_t inside = 0;
+  int ok = 1;
+
+  density_reduce(d);
+  for (size_t v = 0; v < d->voxels; v++)
+    inside += d->totals[v];
+  fprintf(stderr, "density: %llu points in the grid, %llu outside\n",
+          (unsigned long long)inside, (unsigned long long)d->outside);
+
+  if (d->output) {
+    unsigned char page[RECORD_PAGE] = {0};
+    density_header h = {{0}};
+    int fd = open(d->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    memcpy(h.magic, DENSITY_MAGIC, sizeof(h.magic));
+    h.version = DENSITY_VERSION;
+    h.header_size = RECORD_PAGE;
+    h.byte_order = RECORD_BYTE_ORDER;
+    h.resolution = d->resolution;
+    h.system = d->system;
+    memcpy(h.lo, d->lo, sizeof(h.lo));
+    memcpy(h.hi, d->hi, sizeof(h.hi));
+    h.inside = inside;
+    h.outside = d->outside;
+    memcpy(h.params, d->params, sizeof(h.params));
+    memcpy(page, &h, sizeof(h));
+
+    ok = fd >= 0 && write_all(fd, page, sizeof(page), 0)
+      && write_all(fd, d->totals, sizeof(uint64_t) * d->voxels,
+                   sizeof(page));
+    if (fd >= 0)
+      ok = close(fd) == 0 && ok;
+    if (!ok)
+      fprintf(stderr, "Unable to write the density grid to %s\n",
+              d->output);
+  }
+
+  density_free(d);
+  return ok;
+}
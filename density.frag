@@ -0,0 +1,35 @@
+#version 330
+
+in vec3 Point;
+out vec4 outColor;
+
+uniform sampler3D density;
+/* The camera, in the same coordinates as Point. */
+uniform vec3 eye;
+
+const int STEPS = 160;
+const float GAIN = 12.0;
+const vec3 GLOW = vec3(1.0, 0.55, 0.2);
+
+void main() {
+  /* Where the ray from the eye through this fragment enters and leaves
+     the box, with the fragment at t = 1. */
+  vec3 direction = Point - eye;
+  vec3 t0 = -eye / direction, t1 = (1.0 - eye) / direction;
+  vec3 near = min(t0, t1), far = max(t0, t1);
+  float enter = max(max(near.x, near.y), max(near.z, 0.0));
+  float leave = min(min(far.x, far.y), far.z);
+
+  /* Only the faces the ray leaves through are marched from, so every
+     ray is counted once whichever way the cube's faces wind. */
+  if (leave > 1.0 + 1e-4)
+    discard;
+
+  float sum = 0.0;
+  float step = (1.0 - enter) / STEPS;
+  for (int i = 0; i < STEPS; i++)
+    sum += texture(density, eye + direction * (enter + (i + 0.5) * step)).r;
+
+  float depth = length(direction) * (1.0 - enter);
+  outColor = vec4(GLOW * (1.0 - exp(-GAIN * sum / STEPS * depth)), 1.0);
+}
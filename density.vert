@@ -0,0 +1,16 @@
+#version 330
+
+/* A corner of the unit cube, which is stretched over the density
+   grid's box. */
+in vec3 corner;
+
+/* Where the fragment is in the grid, the box being the unit cube. */
+out vec3 Point;
+
+#include "camera.glsl"
+uniform vec3 box_lo, box_size;
+
+void main() {
+  gl_Position = view_projection * vec4(box_lo + corner * box_size, 1.0);
+  Point = corner;
+}
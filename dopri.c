@@ -0,0 +1,235 @@
+/* Adaptive Dormand-Prince 5(4) integration with dense output.
+
+   Every trajectory carries its own step size, adjusted after each step
+   from the embedded fourth-order error estimate, so trajectories in
+   calm parts of the attractor take long steps while those swinging
+   between the wings take short ones. Steps no longer line up with the
+   frames, so the batch is instead filled at the uniform output times
+   step*dt by evaluating the continuous extension of the last accepted
+   step (Hairer, Norsett & Wanner, "Solving Ordinary Differential
+   Equations I", section II.6).
+
+   Steps are taken one trajectory at a time in double precision: with
+   per-trajectory step sizes there is nothing for SIMD lanes to share,
+   and float rounding would swamp any tolerance below about 1e-6. The
+   stepping code is inlined into one function per system, so the
+   derivative is a direct call rather than an indirect one per stage.
+*/
+
+#include <math.h>
+
+typedef struct {
+  /* State at time t, the end of the last accepted step, and the
+     derivative there (the first stage of the next step). */
+  double y[3], f[3];
+  double t, h;
+  /* Continuous extension of the step [t_old, t]. */
+  double t_old;
+  double r[5][3];
+  unsigned long accepted, rejected;
+  /* Set once the step has shrunk until it no longer moves t, as it
+     does when the state is no longer finite. The trajectory is not
+     stepped again and reads as NaN. */
+  bool diverged;
+} dopri_state;
+
+typedef struct dopri dopri;
+
+typedef void (*dopri_advance_fn)(const dopri *d, batch *b, int begin,
+                                 int end, double t);
+
+struct dopri {
+  dopri_state *states;
+  int count;
+  double rtol, atol;
+  double params[SYSTEM_MAX_PARAMS];
+  dopri_advance_fn advance;
+};
+
+static const system_derivative system_derivatives[SYSTEM_COUNT] = {
+#define SYSTEM_DERIVATIVE_ENTRY(NAME, name) name##_derivative,
+  SYSTEM_LIST(SYSTEM_DERIVATIVE_ENTRY)
+#undef SYSTEM_DERIVATIVE_ENTRY
+};
+
+/* Attempt one step of size s->h, keeping it and its continuous
+   extension if the error is within tolerance. Either way the step size
+   is adapted for the next attempt. A NaN error is out of tolerance. */
+static inline __attribute__((always_inline)) void
+dopri_step(const dopri *d, dopri_state *s, system_derivative derivative) {
+  static const double
+    a21 = 1.0/5,
+    a31 = 3.0/40, a32 = 9.0/40,
+    a41 = 44.0/45, a42 = -56.0/15, a43 = 32.0/9,
+    a51 = 19372.0/6561, a52 = -25360.0/2187, a53 = 64448.0/6561,
+    a54 = -212.0/729,
+    a61 = 9017.0/3168, a62 = -355.0/33, a63 = 46732.0/5247,
+    a64 = 49.0/176, a65 = -5103.0/18656,
+    a71 = 35.0/384, a73 = 500.0/1113, a74 = 125.0/192,
+    a75 = -2187.0/6784, a76 = 11.0/84,
+    e1 = 71.0/57600, e3 = -71.0/16695, e4 = 71.0/1920,
+    e5 = -17253.0/339200, e6 = 22.0/525, e7 = -1.0/40,
+    d1 = -12715105075.0/11282082432, d3 = 87487479700.0/32700410799,
+    d4 = -10690763975.0/1880347072, d5 = 701980252875.0/199316789632,
+    d6 = -1453857185.0/822651844, d7 = 69997945.0/29380423;
+  double h = s->h;
+  double k2[3], k3[3], k4[3], k5[3], k6[3], k7[3];
+  double y1[3], y2[3];
+  double err = 0.0, factor;
+  const double *k1 = s->f;
+
+  for (int j = 0; j < 3; j++)
+    y1[j] = s->y[j] + h*a21*k1[j];
+  derivative(d->params, y1, k2);
+  for (int j = 0; j < 3; j++)
+    y1[j] = s->y[j] + h*(a31*k1[j] + a32*k2[j]);
+  derivative(d->params, y1, k3);
+  for (int j = 0; j < 3; j++)
+    y1[j] = s->y[j] + h*(a41*k1[j] + a42*k2[j] + a43*k3[j]);
+  derivative(d->params, y1, k4);
+  for (int j = 0; j < 3; j++)
+    y1[j] = s->y[j] + h*(a51*k1[j] + a52*k2[j] + a53*k3[j] + a54*k4[j]);
+  derivative(d->params, y1, k5);
+  for (int j = 0; j < 3; j++)
+    y2[j] = s->y[j] + h*(a61*k1[j] + a62*k2[j] + a63*k3[j] + a64*k4[j]
+                         + a65*k5[j]);
+  derivative(d->params, y2, k6);
+  for (int j = 0; j < 3; j++)
+    y1[j] = s->y[j] + h*(a71*k1[j] + a73*k3[j] + a74*k4[j] + a75*k5[j]
+                         + a76*k6[j]);
+  derivative(d->params, y1, k7);
+
+  for (int j = 0; j < 3; j++) {
+    double e = h*(e1*k1[j] + e3*k3[j] + e4*k4[j] + e5*k5[j] + e6*k6[j]
+                  + e7*k7[j]);
+    double scale = d->atol + d->rtol*fmax(fabs(s->y[j]), fabs(y1[j]));
+    err += (e/scale) * (e/scale);
+  }
+  err = sqrt(err / 3);
+
+  /* Standard controller with safety factor 0.9, never growing the step
+     more than fivefold nor shrinking it below a fifth. A NaN error,
+     from a step long enough to overflow, shrinks it by the most. */
+  factor = err > 0.0 ? 0.9 * pow(err, -0.2) : err == 0.0 ? 5.0 : 0.2;
+  factor = factor < 0.2 ? 0.2 : factor > 5.0 ? 5.0 : factor;
+
+  if (!(err <= 1.0)) {
+    s->h = h * (factor < 1.0 ? factor : 1.0);
+    s->rejected++;
+    if (!(s->t + s->h > s->t))
+      s->diverged = true;
+    return;
+  }
+
+  for (int j = 0; j < 3; j++) {
+    double diff = y1[j] - s->y[j];
+    double spline = h*k1[j] - diff;
+    s->r[0][j] = s->y[j];
+    s->r[1][j] = diff;
+    s->r[2][j] = spline;
+    s->r[3][j] = diff - h*k7[j] - spline;
+    s->r[4][j] = h*(d1*k1[j] + d3*k3[j] + d4*k4[j] + d5*k5[j] + d6*k6[j]
+                    + d7*k7[j]);
+    s->y[j] = y1[j];
+    s->f[j] = k7[j];
+  }
+  s->t_old = s->t;
+  s->t += h;
+  s->h = h * factor;
+  s->accepted++;
+}
+
+static inline __attribute__((always_inline)) void
+dopri_advance_with(const dopri *d, batch *b, int begin, int end, double t,
+                   system_derivative derivative) {
+  for (int i = begin; i < end; i++) {
+    dopri_state *s = &d->states[i];
+    double theta, y[3];
+
+    while (s->t < t && !s->diverged)
+      dopri_step(d, s, derivative);
+    if (s->diverged) {
+      b->x[i] = b->y[i] = b->z[i] = NAN;
+      continue;
+    }
+
+    theta = (t - s->t_old) / (s->t - s->t_old);
+    for (int j = 0; j < 3; j++) {
+      y[j] = s->r[0][j]
+        + theta*(s->r[1][j] + (1 - theta)*(s->r[2][j]
+        + theta*(s->r[3][j] + (1 - theta)*s->r[4][j])));
+    }
+    b->x[i] = y[0];
+    b->y[i] = y[1];
+    b->z[i] = y[2];
+  }
+}
+
+#define DOPRI_ADVANCE(NAME, name)                                       \
+  static void                                                           \
+  dopri_advance_##name(const dopri *d, batch *b, int begin, int end,    \
+                       double t) {                                      \
+    dopri_advance_with(d, b, begin, end, t, name##_derivative);         \
+  }
+SYSTEM_LIST(DOPRI_ADVANCE)
+#undef DOPRI_ADVANCE
+
+static const dopri_advance_fn dopri_advances[SYSTEM_COUNT] = {
+#define DOPRI_ADVANCE_ENTRY(NAME, name) dopri_advance_##name,
+  SYSTEM_LIST(DOPRI_ADVANCE_ENTRY)
+#undef DOPRI_ADVANCE_ENTRY
+};
+
+/* Start every trajectory of `b` at time 0 with an initial step of dt,
+   integrating `system` with the batch's parameters. */
+static int
+dopri_init(dopri *d, const batch *b, system_id system, float dt,
+           float tolerance) {
+  d->count = b->count;
+  d->rtol = d->atol = tolerance;
+  for (int i = 0; i < SYSTEM_MAX_PARAMS; i++)
+    d->params[i] = b->params[i];
+  d->advance = dopri_advances[system];
+  d->states = alloc_aligned(sizeof(dopri_state) * b->count);
+  if (!d->states) {
+    fprintf(stderr, "Unable to allocate integrator state\n");
+    return 0;
+  }
+
+  for (int i = 0; i < b->count; i++) {
+    dopri_state *s = &d->states[i];
+    s->y[0] = b->x[i];
+    s->y[1] = b->y[i];
+    s->y[2] = b->z[i];
+    system_derivatives[system](d->params, s->y, s->f);
+    s->h = dt;
+  }
+  return 1;
+}
+
+static void
+dopri_free(dopri *d) {
+  free(d->states);
+  d->states = NULL;
+}
+
+/* Bring trajectories [begin, end) to time `t` and store their states
+   there in the batch. */
+static void
+dopri_advance(const dopri *d, batch *b, int begin, int end, double t) {
+  d->advance(d, b, begin, end, t);
+}
+
+/* Accepted and rejected steps summed over all trajectories, and how
+   many trajectories diverged. */
+static __attribute__((unused)) void
+dopri_stats(const dopri *d, unsigned long *accepted,
+            unsigned long *rejected, int *diverged) {
+  *accepted = *rejected = 0;
+  *diverged = 0;
+  for (int i = 0; i < d->count; i++) {
+    *accepted += d->states[i].accepted;
+    *rejected += d->states[i].rejected;
+    *diverged += d->states[i].diverged;
+  }
+}
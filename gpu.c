@@ -0,0 +1,106 @@
+/* GPU integration engine, selected with --engine gpu.
+
+   The state of every trajectory lives in a pair of GL buffers and is
+   stepped by the integrate.vert program: one GL_POINTS draw per step
+   runs RK4 on each trajectory and transform feedback captures the new
+   state into the other buffer of the pair and the old one straight into
+   its slot of the tail ring. Nothing is ever copied between the CPU and
+   the GPU after startup; the heads are drawn from whichever state
+   buffer is current.
+
+   Only GL 3.3 core features are used (transform feedback with separate
+   attributes and rasterizer discard), so this also runs on Mesa's
+   llvmpipe.
+*/
+
+typedef struct {
+  GLuint program;
+  GLuint state[2];
+  int current;
+  int count;
+  struct {
+    GLint dt, params, system;
+  } uniforms;
+  GLint position;
+  long step;
+} gpu_engine;
+
+/* The outputs integrate.vert writes, in binding order. */
+static const char *const gpu_feedback[] = {"next_state", "tail_point", NULL};
+
+/* Take ownership of `program` (built from integrate.vert with
+   gpu_feedback) and load the `count` initial states. */
+static int
+gpu_init(gpu_engine *g, GLuint program, const vec3 *initial, int count,
+         system_id system, const float params[SYSTEM_MAX_PARAMS], float dt) {
+  size_t size = (size_t)count * sizeof(vec3);
+
+  memset(g, 0, sizeof(*g));
+  g->program = program;
+  g->count = count;
+  g->position = glGetAttribLocation(program, "position");
+  g->uniforms.dt = glGetUniformLocation(program, "dt");
+  g->uniforms.params = glGetUniformLocation(program, "params");
+  g->uniforms.system = glGetUniformLocation(program, "system");
+  if (g->position < 0) {
+    fprintf(stderr, "integrate.vert: no position input\n");
+    return 0;
+  }
+
+  glGenBuffers(2, g->state);
+  for (int i = 0; i < 2; i++) {
+    glBindBuffer(GL_ARRAY_BUFFER, g->state[i]);
+    glBufferData(GL_ARRAY_BUFFER, size, i == 0 ? initial : NULL,
+                 GL_DYNAMIC_COPY);
+  }
+
+  glUseProgram(program);
+  glUniform1f(g->uniforms.dt, dt);
+  glUniform1fv(g->uniforms.params, SYSTEM_MAX_PARAMS, params);
+  glUniform1i(g->uniforms.system, system);
+  return 1;
+}
+
+/* Take `steps` steps, the old state of step s going to slot
+   s % tail_length of `tail_buffer`. */
+static void
+gpu_step(gpu_engine *g, GLuint tail_buffer, int tail_length, long steps) {
+  GLsizeiptr slot_size = (GLsizeiptr)g->count * sizeof(vec3);
+
+  if (steps <= 0)
+    return;
+
+  glUseProgram(g->program);
+  glEnable(GL_RASTERIZER_DISCARD);
+  glEnableVertexAttribArray(g->position);
+
+  for (long i = 0; i < steps; i++) {
+    GLintptr offset = (GLintptr)(g->step % tail_length) * slot_size;
+
+    glBindBuffer(GL_ARRAY_BUFFER, g->state[g->current]);
+    glVertexAttribPointer(g->position, 3, GL_FLOAT, GL_FALSE,
+                          3*sizeof(float), 0);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0,
+                     g->state[1 - g->current]);
+    glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 1, tail_buffer,
+                      offset, slot_size);
+
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, g->count);
+    glEndTransformFeedback();
+
+    g->current = 1 - g->current;
+    g->step++;
+  }
+
+  glDisableVertexAttribArray(g->position);
+  glDisable(GL_RASTERIZER_DISCARD);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, 0);
+}
+
+/* The buffer holding the newest state, for drawing the heads. */
+static GLuint
+gpu_heads(const gpu_engine *g) {
+  return g->state[g->current];
+}
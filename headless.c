@@ -0,0 +1,180 @@
+/* Offscreen rendering without a window system.
+
+   An OpenGL 3.3 core context is created through EGL, preferably on
+   Mesa's surfaceless platform so that neither a display server nor a
+   GPU is needed (llvmpipe renders in software). Frames are drawn into a
+   multisampled framebuffer object and resolved into a second one that
+   can be read back.
+*/
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+typedef struct {
+  EGLDisplay display;
+  EGLContext context;
+  EGLSurface surface;
+
+  int width, height;
+  GLuint framebuffer, color;
+  GLuint resolve_framebuffer, resolve_color;
+} headless;
+
+static bool
+egl_has_extension(EGLDisplay display, const char *name) {
+  const char *list = eglQueryString(display, EGL_EXTENSIONS);
+  size_t length = strlen(name);
+
+  while (list && (list = strstr(list, name))) {
+    if (list[length] == ' ' || list[length] == '\0')
+      return true;
+    list += length;
+  }
+  return false;
+}
+
+static EGLDisplay
+headless_display(void) {
+  if (egl_has_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+      return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                  EGL_DEFAULT_DISPLAY, NULL);
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+/* Create the context and make it current. */
+static int
+headless_init(headless *h, int width, int height) {
+  static const EGLint config_attributes[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  static const EGLint context_attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE, EGL_TRUE,
+    EGL_NONE
+  };
+  EGLConfig config = NULL;
+  EGLint configs = 0;
+
+  memset(h, 0, sizeof(*h));
+  h->width = width;
+  h->height = height;
+  h->surface = EGL_NO_SURFACE;
+
+  h->display = headless_display();
+  if (h->display == EGL_NO_DISPLAY || !eglInitialize(h->display, NULL, NULL)) {
+    fprintf(stderr, "EGL: unable to initialize a display\n");
+    return 0;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    fprintf(stderr, "EGL: desktop OpenGL is not supported\n");
+    return 0;
+  }
+
+  if (!egl_has_extension(h->display, "EGL_KHR_no_config_context")
+      || !egl_has_extension(h->display, "EGL_KHR_surfaceless_context")) {
+    if (!eglChooseConfig(h->display, config_attributes, &config, 1, &configs)
+        || configs < 1) {
+      fprintf(stderr, "EGL: no suitable config\n");
+      return 0;
+    }
+  }
+
+  h->context = eglCreateContext(h->display, config, EGL_NO_CONTEXT,
+                                context_attributes);
+  if (h->context == EGL_NO_CONTEXT) {
+    fprintf(stderr, "EGL: unable to create an OpenGL 3.3 core context\n");
+    return 0;
+  }
+
+  /* Without surfaceless contexts a tiny pbuffer stands in for the
+     window; everything is drawn into framebuffer objects anyway. */
+  if (config) {
+    static const EGLint pbuffer_attributes[] = {
+      EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE
+    };
+    h->surface = eglCreatePbufferSurface(h->display, config,
+                                         pbuffer_attributes);
+  }
+
+  if (!eglMakeCurrent(h->display, h->surface, h->surface, h->context)) {
+    fprintf(stderr, "EGL: unable to make the context current\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Create the framebuffers; needs the GL entry points to be loaded. */
+static int
+headless_make_framebuffer(headless *h, int samples) {
+  glGenRenderbuffers(1, &h->color);
+  glBindRenderbuffer(GL_RENDERBUFFER, h->color);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8,
+                                   h->width, h->height);
+  glGenFramebuffers(1, &h->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, h->framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, h->color);
+
+  glGenRenderbuffers(1, &h->resolve_color);
+  glBindRenderbuffer(GL_RENDERBUFFER, h->resolve_color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, h->width, h->height);
+  glGenFramebuffers(1, &h->resolve_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, h->resolve_framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, h->resolve_color);
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Offscreen framebuffer is incomplete\n");
+    return 0;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, h->framebuffer);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Offscreen framebuffer is incomplete\n");
+    return 0;
+  }
+  glViewport(0, 0, h->width, h->height);
+
+  return 1;
+}
+
+/* Resolve the frame just drawn and leave the resolved framebuffer bound
+   for reading. */
+static void
+headless_resolve(headless *h) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, h->framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, h->resolve_framebuffer);
+  glBlitFramebuffer(0, 0, h->width, h->height, 0, 0, h->width, h->height,
+                    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, h->framebuffer);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, h->resolve_framebuffer);
+}
+
+static void
+headless_free(headless *h) {
+  if (h->framebuffer) {
+    glDeleteFramebuffers(1, &h->framebuffer);
+    glDeleteFramebuffers(1, &h->resolve_framebuffer);
+    glDeleteRenderbuffers(1, &h->color);
+    glDeleteRenderbuffers(1, &h->resolve_color);
+  }
+  if (h->display != EGL_NO_DISPLAY) {
+    eglMakeCurrent(h->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    if (h->surface != EGL_NO_SURFACE)
+      eglDestroySurface(h->display, h->surface);
+    if (h->context != EGL_NO_CONTEXT)
+      eglDestroyContext(h->display, h->context);
+    eglTerminate(h->display);
+  }
+}
@@ -0,0 +1,23 @@
+#version 330
+
+/* One RK4 step per vertex, captured with transform feedback: the new
+   state goes back into the state buffer and the old one into the
+   current slot of the tail ring. Nothing is rasterized. */
+
+in vec3 position;
+
+out vec3 next_state;
+out vec3 tail_point;
+
+uniform float dt;
+#include "systems.glsl"
+
+void main() {
+  vec3 k1 = derivative(position);
+  vec3 k2 = derivative(position + dt / 2.0 * k1);
+  vec3 k3 = derivative(position + dt / 2.0 * k2);
+  vec3 k4 = derivative(position + dt * k3);
+
+  next_state = position + dt / 6.0 * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
+  tail_point = position;
+}
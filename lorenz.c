@@ -1,65 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <math.h>
+#include <time.h>
 
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
 
-#include "vec3.c"
-#include "util.c"
+#include "sim.c"
+#include "mat4.c"
+#include "shader.c"
 
 #define WIDTH 800
 #define HEIGHT 600
 
-#define COUNT 5
-#define STEPS_PER_FRAME 3
-#define TAIL_LENGTH 1024
-#define SIGMA 10.0f
-#define BETA (-8.0f/3.0f)
-#define RHO 28.0f
+/* Uniform buffer binding point of the camera block both programs
+   share. */
+#define CAMERA_BINDING 0
+
+/* Size of the section plot in the lower right corner of the window. */
+#define SECTION_PLOT_SIZE (HEIGHT / 3)
+
+#include "triple.c"
+#include "benchmark.c"
+#include "headless.c"
+#include "capture.c"
+#include "replay.c"
+#include "gpu.c"
+#include "profile.c"
+
+static config g_config;
 
 typedef enum {BUTTON_NONE, BUTTON_LEFT, BUTTON_MIDDLE, BUTTON_RIGHT} mouse_button;
 
 static struct {
   GLuint vertex_buffer, element_buffer;
   GLuint tail_vertex_buffer;
+  /* When ARB_buffer_storage is available the tail buffer stays mapped
+     for the lifetime of the program; `tail_fence` guards the slots the
+     GPU may still be reading from the previous frame. */
+  bool tail_persistent;
+  vec3 *tail_mapped;
+  GLsync tail_fence;
+  long tail_uploaded;
   GLuint tail_index_buffer;
-  GLuint colors_buffer;
-
-  GLuint head_vertex_shader, head_fragment_shader, head_program;
-  GLuint tail_vertex_shader, tail_fragment_shader, tail_program;
+  GLuint colors_buffer, colors_texture;
+  GLuint camera_buffer;
+
+  GLuint head_program, tail_program;
+  /* Only loaded when taking a section with a plot. */
+  GLuint section_program;
+  GLuint section_buffer;
+  /* Crossings uploaded so far, and the range of their coordinates. */
+  long section_uploaded;
+  float section_bounds[4];
+  /* Only loaded when showing the density grid. */
+  GLuint density_program;
+  GLuint density_texture, cube_buffer;
+  unsigned long density_uploaded;
+  /* Directory of the program binary cache, or NULL when the driver
+     cannot save programs or caching is turned off. */
+  const char *program_cache;
 
   struct {
     struct {
-      GLuint rotation, translation;
+      GLuint colors;
     } uniforms;
     struct {
-      GLuint position, color;
+      GLuint position;
     } attributes;
 
   } head;
 
   struct {
     struct {
-      GLuint rotation, translation;
-      GLuint tail_length, color;
+      GLuint tail_length, colors, count;
     } uniforms;
     struct {
-      GLuint position, index;
+      GLuint position;
     } attributes;
   } tail;
 
+  struct {
+    struct {
+      GLuint bounds, colors;
+    } uniforms;
+    struct {
+      GLuint point, trajectory;
+    } attributes;
+  } section;
+
+  struct {
+    struct {
+      GLuint box_lo, box_size, eye, density;
+    } uniforms;
+    struct {
+      GLuint corner;
+    } attributes;
+  } density;
+
   double xpos, ypos;
 
   vec3 rotation;
   vec3 translation;
   mouse_button button;
 
-  bool pause;
+  atomic_bool pause;
 
 } g_gl_state;
 
+/* With --engine gpu the trajectories are integrated on the render
+   thread, `owed` carrying the fraction of a step left over between
+   frames. */
+static struct {
+  gpu_engine engine;
+  double owed;
+} g_gpu;
+
+static profiler g_profiler;
+
 int colors[] = {
   0x8d, 0xd3, 0xc7,
   0xff, 0xff, 0xb3,
@@ -77,16 +139,96 @@ int colors[] = {
 };
 
 
-static float position[3*COUNT];
+/* Color of each trajectory, cycling through the palette above. Both
+   programs read it from a texture buffer indexed by trajectory, so all
+   tails can go out in a single draw call. */
+static unsigned char *trajectory_colors;
+
+/* Element indices for drawing each trajectory's tail as one line strip.
+   Trajectory c gets 2*tail_length indices walking its points through
+   the ring twice, so the tail_length points starting at any slot are a
+   contiguous range of indices: the ring's wrap-around is handled by the
+   draw offset and the buffer never changes after startup. */
+GLuint *tail_index;
+
+/* Per-trajectory arguments of the single glMultiDrawElements call. */
+static GLsizei *tail_counts;
+static const GLvoid **tail_offsets;
+
+/* What the renderer needs of one simulation instant. `step` is the
+   number of steps integrated so far; the next step writes slot
+   step % tail_length, which therefore holds the oldest point. The
+   section plot is a ring in the same way, `section_total` being the
+   number of crossings found so far, and `density` is the density image
+   numbered `density_version`. */
+typedef struct {
+  float *position;
+  vec3 *tail;
+  long step;
+  section_point *section;
+  long section_total;
+  unsigned char *density;
+  unsigned long density_version;
+} snapshot;
+
+/* The simulation runs on its own thread and owns the core's `tail`
+   and `position`. After every tick it copies them into the back
+   buffer of a triple buffer which the render thread picks up whenever
+   it is ready for a new frame. */
+static struct {
+  pthread_t thread;
+  atomic_bool quit;
+
+  sim core;
+
+  triple exchange;
+  snapshot buffers[3];
+} g_sim;
+
+static size_t
+position_size(void) {
+  return 3 * sizeof(float) * g_config.count;
+}
+
+static size_t
+tail_size(void) {
+  return sizeof(vec3) * g_config.count * g_config.tail_length;
+}
+
+/* Length of the section plot ring, 0 if there is none. */
+static int
+section_plot_length(void) {
+  return g_sim.core.crossings ? g_sim.core.crossings->plot_length : 0;
+}
 
-vec3 tail[TAIL_LENGTH*COUNT];
-GLuint tail_index[TAIL_LENGTH*COUNT];
-int tail_indices[COUNT];
+/* The density grid when it is shown, or NULL. */
+static const density *
+density_shown(void) {
+  const density *d = g_sim.core.histogram;
+  return d && d->image ? d : NULL;
+}
+
+static size_t
+tail_index_size(void) {
+  return 2 * sizeof(GLuint) * g_config.count * g_config.tail_length;
+}
+
+static bool
+has_extension(const char *name) {
+  GLint count;
+
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (int i = 0; i < count; i++) {
+    if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+      return true;
+  }
+  return false;
+}
 
 static GLuint
 make_buffer(GLenum target,
             const void *buffer_data,
-            GLsizei buffer_size) {
+            GLsizeiptr buffer_size) {
   GLuint buffer;
   glGenBuffers(1, &buffer);
   glBindBuffer(target, buffer);
@@ -111,39 +253,51 @@ show_info_log(GLuint object,
 
 
 static GLuint
-make_shader(GLenum type, const char *filename) {
-  GLint length;
-  GLchar *source = file_contents(filename, &length);
+make_shader(GLenum type, const shader_source *source) {
+  const GLchar *text = source->text;
+  GLint length = source->length;
   GLuint shader;
   GLint shader_ok;
 
-  if (!source)
-    return 0;
-
   shader = glCreateShader(type);
-  glShaderSource(shader, 1, (const GLchar**)&source, &length);
-  free(source);
+  glShaderSource(shader, 1, &text, &length);
   glCompileShader(shader);
 
   /* Check that shader compiled properly */
   glGetShaderiv(shader, GL_COMPILE_STATUS, &shader_ok);
   if (!shader_ok) {
-    fprintf(stderr, "Failed to compile %s:\n", filename);
+    fprintf(stderr, "Failed to compile %s:\n", source->names[0]);
     show_info_log(shader, glGetShaderiv, glGetShaderInfoLog);
+    if (source->files > 1)
+      shader_show_files(source);
     glDeleteShader(shader);
     return 0;
   }
   return shader;
 }
 
+/* `fragment_shader` is 0 for transform feedback programs, which list
+   the outputs to capture, each into its own buffer, in `feedback`. */
 static GLuint
-make_program(GLuint vertex_shader, GLuint fragment_shader) {
+make_program(GLuint vertex_shader, GLuint fragment_shader,
+             const char *const *feedback) {
   GLint program_ok;
 
   GLuint program = glCreateProgram();
   glAttachShader(program, vertex_shader);
-  glAttachShader(program, fragment_shader);
-  glBindFragDataLocation(program, 0, "outColor");
+  if (fragment_shader) {
+    glAttachShader(program, fragment_shader);
+    glBindFragDataLocation(program, 0, "outColor");
+  }
+  if (feedback) {
+    int count = 0;
+    while (feedback[count])
+      count++;
+    glTransformFeedbackVaryings(program, count, (const GLchar **)feedback,
+                                GL_SEPARATE_ATTRIBS);
+  }
+  if (g_gl_state.program_cache)
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(program);
 
   glGetProgramiv(program, GL_LINK_STATUS, &program_ok);
@@ -157,204 +311,711 @@ make_program(GLuint vertex_shader, GLuint fragment_shader) {
   return program;
 }
 
+/* Build a program from a vertex and a fragment shader file (or a list
+   of transform feedback outputs instead of the latter), loading it
+   from the program binary cache instead when an entry for the same
+   sources and driver exists. */
+static GLuint
+load_program(const char *vertex_file, const char *fragment_file,
+             const char *const *feedback) {
+  shader_source vertex = {0}, fragment = {0};
+  GLuint program = 0;
+  uint64_t key = 0;
+
+  if (!shader_load(&vertex, vertex_file)
+      || (fragment_file && !shader_load(&fragment, fragment_file)))
+    goto done;
+
+  if (g_gl_state.program_cache) {
+    key = program_cache_key(&vertex, &fragment, feedback);
+    program = program_cache_load(g_gl_state.program_cache, key);
+  }
+  if (!program) {
+    GLuint vertex_shader = make_shader(GL_VERTEX_SHADER, &vertex);
+    GLuint fragment_shader = fragment_file
+      ? make_shader(GL_FRAGMENT_SHADER, &fragment) : 0;
+
+    if (vertex_shader && (fragment_shader || !fragment_file))
+      program = make_program(vertex_shader, fragment_shader, feedback);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    if (program && g_gl_state.program_cache)
+      program_cache_store(g_gl_state.program_cache, key, program);
+  }
+
+ done:
+  shader_free(&vertex);
+  shader_free(&fragment);
+  return program;
+}
+
 static int
 make_resources(void) {
   /* Create buffers */
   g_gl_state.vertex_buffer = make_buffer(GL_ARRAY_BUFFER,
-                                         position,
-                                         sizeof(position));
-  g_gl_state.tail_vertex_buffer = make_buffer(GL_ARRAY_BUFFER,
-                                              tail,
-                                              sizeof(tail));
+                                         g_sim.core.position,
+                                         position_size());
+  /* The gpu engine writes the tail with transform feedback, so it is
+     never mapped. */
+  g_gl_state.tail_persistent = g_config.engine == ENGINE_CPU
+    && (gl3wIsSupported(4, 4) || has_extension("GL_ARB_buffer_storage"))
+    && glBufferStorage && glMapBufferRange;
+  if (g_gl_state.tail_persistent) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT
+      | GL_MAP_COHERENT_BIT;
+
+    glGenBuffers(1, &g_gl_state.tail_vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.tail_vertex_buffer);
+    glBufferStorage(GL_ARRAY_BUFFER, tail_size(), g_sim.core.tail, flags);
+    g_gl_state.tail_mapped = glMapBufferRange(GL_ARRAY_BUFFER,
+                                              0, tail_size(), flags);
+    if (!g_gl_state.tail_mapped) {
+      fprintf(stderr, "Unable to map tail buffer, falling back to "
+              "glBufferSubData\n");
+      glDeleteBuffers(1, &g_gl_state.tail_vertex_buffer);
+      g_gl_state.tail_persistent = false;
+    }
+  }
+  if (!g_gl_state.tail_persistent) {
+    g_gl_state.tail_vertex_buffer = make_buffer(GL_ARRAY_BUFFER,
+                                                g_sim.core.tail,
+                                                tail_size());
+  }
 
   g_gl_state.tail_index_buffer = make_buffer(GL_ELEMENT_ARRAY_BUFFER,
                                              tail_index,
-                                             sizeof(tail_index));
+                                             tail_index_size());
+
+  for (int c = 0; c < g_config.count; c++) {
+    int palette = c % (sizeof(colors) / sizeof(colors[0]) / 3);
+    for (int i = 0; i < 3; i++) {
+      trajectory_colors[4*c + i] = colors[3*palette + i];
+    }
+    trajectory_colors[4*c + 3] = 0xff;
+  }
+  g_gl_state.colors_buffer = make_buffer(GL_TEXTURE_BUFFER,
+                                         trajectory_colors,
+                                         4*g_config.count);
+  glGenTextures(1, &g_gl_state.colors_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, g_gl_state.colors_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, g_gl_state.colors_buffer);
 
-  g_gl_state.colors_buffer = make_buffer(GL_ARRAY_BUFFER,
-                                         colors,
-                                         sizeof(colors));
   /* Compile GLSL program  */
-  g_gl_state.head_vertex_shader = make_shader(GL_VERTEX_SHADER,
-                                              "head.vert");
-  g_gl_state.head_fragment_shader = make_shader(GL_FRAGMENT_SHADER,
-                                                "head.frag");
-  g_gl_state.head_program = make_program(g_gl_state.head_vertex_shader,
-                                         g_gl_state.head_fragment_shader);
+  GLint binary_formats = 0;
+  if (gl3wIsSupported(4, 1) || has_extension("GL_ARB_get_program_binary"))
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats);
+  if (binary_formats > 0) {
+    g_gl_state.program_cache = !g_config.shader_cache
+      ? program_cache_default_dir()
+      : *g_config.shader_cache ? g_config.shader_cache : NULL;
+  }
 
-  g_gl_state.tail_vertex_shader = make_shader(GL_VERTEX_SHADER,
-                                              "tail.vert");
-  g_gl_state.tail_fragment_shader = make_shader(GL_FRAGMENT_SHADER,
-                                                "tail.frag");
-  g_gl_state.tail_program = make_program(g_gl_state.tail_vertex_shader,
-                                         g_gl_state.tail_fragment_shader);
+  g_gl_state.head_program = load_program("head.vert", "head.frag", NULL);
+  g_gl_state.tail_program = load_program("tail.vert", "tail.frag", NULL);
+  if (!g_gl_state.head_program || !g_gl_state.tail_program)
+    return 0;
+
+  if (section_plot_length() > 0) {
+    GLuint program = load_program("section.vert", "section.frag", NULL);
+    if (!program)
+      return 0;
+    g_gl_state.section_program = program;
+    g_gl_state.section_buffer =
+      make_buffer(GL_ARRAY_BUFFER, NULL,
+                  sizeof(section_point) * section_plot_length());
+    g_gl_state.section.attributes.point =
+      glGetAttribLocation(program, "point");
+    g_gl_state.section.attributes.trajectory =
+      glGetAttribLocation(program, "trajectory");
+    g_gl_state.section.uniforms.bounds =
+      glGetUniformLocation(program, "bounds");
+    g_gl_state.section.uniforms.colors =
+      glGetUniformLocation(program, "colors");
+  }
 
+  if (g_config.engine == ENGINE_GPU) {
+    GLuint program = load_program("integrate.vert", NULL, gpu_feedback);
+    double params[SYSTEM_MAX_PARAMS];
+    float uniforms[SYSTEM_MAX_PARAMS];
+
+    config_system_params(&g_config, params);
+    for (int i = 0; i < SYSTEM_MAX_PARAMS; i++)
+      uniforms[i] = params[i];
+    if (!program
+        || !gpu_init(&g_gpu.engine, program,
+                     (const vec3 *)g_sim.core.position,
+                     g_config.count, g_config.system, uniforms, g_config.dt))
+      return 0;
+  }
+
+
+  if (density_shown()) {
+    const density *d = density_shown();
+    GLfloat corners[36][3];
+    GLuint program = load_program("density.vert", "density.frag", NULL);
+    /* The corners of each face of the unit cube, going round it; corner
+       i has bit 0 of i as x, bit 1 as y and bit 2 as z. */
+    static const int faces[6][4] = {
+      {0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1},
+      {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}
+    };
+    static const int triangles[6] = {0, 1, 2, 0, 2, 3};
+
+    if (!program)
+      return 0;
+    g_gl_state.density_program = program;
+    for (int f = 0; f < 6; f++) {
+      for (int v = 0; v < 6; v++) {
+        int corner = faces[f][triangles[v]];
+        for (int j = 0; j < 3; j++)
+          corners[6*f + v][j] = corner >> j & 1;
+      }
+    }
+    g_gl_state.cube_buffer = make_buffer(GL_ARRAY_BUFFER, corners,
+                                         sizeof(corners));
+
+    glGenTextures(1, &g_gl_state.density_texture);
+    glBindTexture(GL_TEXTURE_3D, g_gl_state.density_texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, d->resolution, d->resolution,
+                 d->resolution, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+
+    g_gl_state.density.attributes.corner =
+      glGetAttribLocation(program, "corner");
+    g_gl_state.density.uniforms.box_lo =
+      glGetUniformLocation(program, "box_lo");
+    g_gl_state.density.uniforms.box_size =
+      glGetUniformLocation(program, "box_size");
+    g_gl_state.density.uniforms.eye = glGetUniformLocation(program, "eye");
+    g_gl_state.density.uniforms.density =
+      glGetUniformLocation(program, "density");
+  }
 
   /* Look up shader variable locations */
   g_gl_state.head.attributes.position =
     glGetAttribLocation(g_gl_state.head_program, "position");
-  g_gl_state.head.attributes.color =
-    glGetAttribLocation(g_gl_state.head_program, "color");
 
   g_gl_state.tail.attributes.position =
     glGetAttribLocation(g_gl_state.tail_program, "position");
 
-  g_gl_state.head.uniforms.rotation =
-    glGetUniformLocation(g_gl_state.head_program, "rotation");
-  g_gl_state.head.uniforms.translation =
-    glGetUniformLocation(g_gl_state.head_program, "translation");
+  g_gl_state.head.uniforms.colors =
+    glGetUniformLocation(g_gl_state.head_program, "colors");
 
-  g_gl_state.tail.uniforms.rotation =
-    glGetUniformLocation(g_gl_state.tail_program, "rotation");
-    g_gl_state.tail.uniforms.translation =
-    glGetUniformLocation(g_gl_state.tail_program, "translation");
   g_gl_state.tail.uniforms.tail_length =
     glGetUniformLocation(g_gl_state.tail_program, "tail_length");
-  g_gl_state.tail.uniforms.color =
-    glGetUniformLocation(g_gl_state.tail_program, "color");
+  g_gl_state.tail.uniforms.colors =
+    glGetUniformLocation(g_gl_state.tail_program, "colors");
+  g_gl_state.tail.uniforms.count =
+    glGetUniformLocation(g_gl_state.tail_program, "count");
+
+  /* The view-projection matrix is the same for every vertex of both
+     programs, so it is computed once per frame and shared through a
+     uniform buffer. */
+  g_gl_state.camera_buffer = make_buffer(GL_UNIFORM_BUFFER, NULL,
+                                         sizeof(mat4));
+  glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING,
+                   g_gl_state.camera_buffer);
+  glUniformBlockBinding(g_gl_state.head_program,
+                        glGetUniformBlockIndex(g_gl_state.head_program,
+                                               "camera"),
+                        CAMERA_BINDING);
+  glUniformBlockBinding(g_gl_state.tail_program,
+                        glGetUniformBlockIndex(g_gl_state.tail_program,
+                                               "camera"),
+                        CAMERA_BINDING);
+  if (g_gl_state.density_program) {
+    GLuint program = g_gl_state.density_program;
+    glUniformBlockBinding(program,
+                          glGetUniformBlockIndex(program, "camera"),
+                          CAMERA_BINDING);
+  }
 
   return 1;
 }
 
-static void pick_color(int i, float *color) {
+static mat4
+view_projection(void) {
+  mat4 m = mat4_view_frustum(radians(45.0f),
+                             (float)WIDTH / HEIGHT, 0.0f, 10.0f);
+
+  m = mat4_mul(m, mat4_translate(g_gl_state.translation.x,
+                                 g_gl_state.translation.y,
+                                 g_gl_state.translation.z));
+  m = mat4_mul(m, mat4_rotate_x(g_gl_state.rotation.x));
+  m = mat4_mul(m, mat4_rotate_y(g_gl_state.rotation.y));
+  m = mat4_mul(m, mat4_rotate_z(g_gl_state.rotation.z));
+  float scale = 1 / systems[g_config.system].extent;
+  m = mat4_mul(m, mat4_scale(scale, scale, scale));
+
+  return m;
+}
+
+/* Where the camera is in the system's coordinates: the transformations
+   of view_projection() undone in reverse, applied to the eye at the
+   origin. */
+static vec3
+camera_eye(void) {
+  float extent = systems[g_config.system].extent;
+  mat4 m = mat4_scale(extent, extent, extent);
+  vec3 eye;
+
+  m = mat4_mul(m, mat4_rotate_z(-g_gl_state.rotation.z));
+  m = mat4_mul(m, mat4_rotate_y(-g_gl_state.rotation.y));
+  m = mat4_mul(m, mat4_rotate_x(-g_gl_state.rotation.x));
+  m = mat4_mul(m, mat4_translate(-g_gl_state.translation.x,
+                                 -g_gl_state.translation.y,
+                                 -g_gl_state.translation.z));
+  eye.x = m.m[12];
+  eye.y = m.m[13];
+  eye.z = m.m[14];
+  return eye;
+}
+
+/* Ray-march the density image through its box, adding a glow to what
+   is behind it. Each fragment of the cube's far side marches from the
+   eye's side of the box to itself. */
+static void
+render_density(void) {
+  const density *d = density_shown();
+  vec3 eye;
+  float size[3], grid_eye[3];
+
+  if (!g_gl_state.density_program || g_gl_state.density_uploaded == 0)
+    return;
+
+  eye = camera_eye();
+  for (int j = 0; j < 3; j++)
+    size[j] = d->hi[j] - d->lo[j];
+  grid_eye[0] = (eye.x - d->lo[0]) / size[0];
+  grid_eye[1] = (eye.y - d->lo[1]) / size[1];
+  grid_eye[2] = (eye.z - d->lo[2]) / size[2];
+
+  glUseProgram(g_gl_state.density_program);
+  glUniform3fv(g_gl_state.density.uniforms.box_lo, 1, d->lo);
+  glUniform3fv(g_gl_state.density.uniforms.box_size, 1, size);
+  glUniform3fv(g_gl_state.density.uniforms.eye, 1, grid_eye);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, g_gl_state.density_texture);
+  glUniform1i(g_gl_state.density.uniforms.density, 1);
+  glActiveTexture(GL_TEXTURE0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.cube_buffer);
+  glEnableVertexAttribArray(g_gl_state.density.attributes.corner);
+  glVertexAttribPointer(g_gl_state.density.attributes.corner,
+                        3, GL_FLOAT, GL_FALSE, 3*sizeof(float), 0);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+  glDrawArrays(GL_TRIANGLES, 0, 36);
+  glDisable(GL_BLEND);
+  glDisableVertexAttribArray(g_gl_state.density.attributes.corner);
+}
 
-  for (int c = 0; c < 3; c++) {
-    color[c] = colors[3*i + c] / 255.0;
+/* Draw the section crossings uploaded so far as points in the lower
+   right corner, scaled to fit. */
+static void
+render_section(void) {
+  int ring = section_plot_length();
+  long shown = g_gl_state.section_uploaded < ring
+    ? g_gl_state.section_uploaded : ring;
+
+  if (!g_gl_state.section_program)
+    return;
+
+  glEnable(GL_SCISSOR_TEST);
+  glViewport(WIDTH - SECTION_PLOT_SIZE, 0, SECTION_PLOT_SIZE,
+             SECTION_PLOT_SIZE);
+  glScissor(WIDTH - SECTION_PLOT_SIZE, 0, SECTION_PLOT_SIZE,
+            SECTION_PLOT_SIZE);
+  glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDisable(GL_SCISSOR_TEST);
+
+  if (shown > 0) {
+    glUseProgram(g_gl_state.section_program);
+    glUniform4fv(g_gl_state.section.uniforms.bounds, 1,
+                 g_gl_state.section_bounds);
+    glUniform1i(g_gl_state.section.uniforms.colors, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.section_buffer);
+    glEnableVertexAttribArray(g_gl_state.section.attributes.point);
+    glEnableVertexAttribArray(g_gl_state.section.attributes.trajectory);
+    glVertexAttribPointer(g_gl_state.section.attributes.point,
+                          2, GL_FLOAT, GL_FALSE, sizeof(section_point), 0);
+    glVertexAttribIPointer(g_gl_state.section.attributes.trajectory,
+                           1, GL_INT, sizeof(section_point),
+                           (const GLvoid *)offsetof(section_point,
+                                                    trajectory));
+    glPointSize(1.0f);
+    glDrawArrays(GL_POINTS, 0, shown);
+    glDisableVertexAttribArray(g_gl_state.section.attributes.point);
+    glDisableVertexAttribArray(g_gl_state.section.attributes.trajectory);
   }
+
+  glViewport(0, 0, WIDTH, HEIGHT);
 }
 
+/* Draw the density glow, the tails and heads, and the section plot, if
+   there are a density grid and a section.
+   `step` is the step the tail ring was last filled up to and `heads`
+   the buffer holding the newest states. */
 static void
-render(GLFWwindow *window) {
+render(long step, GLuint heads) {
+  mat4 camera;
+
+  /* Every tail starts at the oldest slot to avoid creating a closed
+     loop; the slot is the same for all of them. */
+  profile_begin(&g_profiler, PROFILE_INDEX);
+  int ring = g_config.tail_length;
+  for (int c = 0; c < g_config.count; c++) {
+    int offset = 2*c*ring + step % ring;
+    tail_counts[c] = ring;
+    tail_offsets[c] = (const GLvoid *)(offset*sizeof(GLuint));
+  }
+  profile_end(&g_profiler, PROFILE_INDEX);
+
+  profile_begin(&g_profiler, PROFILE_DRAW);
+  camera = view_projection();
   glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT);
 
+  glBindBuffer(GL_UNIFORM_BUFFER, g_gl_state.camera_buffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camera), &camera);
+
+  render_density();
+
   glUseProgram(g_gl_state.tail_program);
-  glUniform3f(g_gl_state.tail.uniforms.rotation,
-              g_gl_state.rotation.x,
-              g_gl_state.rotation.y,
-              g_gl_state.rotation.z);
-  glUniform3f(g_gl_state.tail.uniforms.translation,
-              g_gl_state.translation.x,
-              g_gl_state.translation.y,
-              g_gl_state.translation.z);
+  glUniform1f(g_gl_state.tail.uniforms.tail_length, g_config.tail_length);
+  glUniform1i(g_gl_state.tail.uniforms.count, g_config.count);
 
-  glUniform1f(g_gl_state.tail.uniforms.tail_length, TAIL_LENGTH);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_BUFFER, g_gl_state.colors_texture);
+  glUniform1i(g_gl_state.tail.uniforms.colors, 0);
 
   glEnableVertexAttribArray(g_gl_state.tail.attributes.position);
-  glVertexAttribPointer(g_gl_state.tail.attributes.position,
-                        3, GL_FLOAT, GL_FALSE,
-                        3*sizeof(float), 0);
-  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.tail_index_buffer);
-  glVertexAttribPointer(g_gl_state.tail.attributes.index,
-                        1, GL_FLOAT, GL_FALSE,
-                        sizeof(float), 0);
-
   glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.tail_vertex_buffer);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_gl_state.tail_index_buffer);
   glVertexAttribPointer(g_gl_state.tail.attributes.position,
                         3, GL_FLOAT, GL_FALSE,
                         3*sizeof(float), 0);
-
-  for (int c = 0; c < COUNT; c++) {
-    int offset = c * TAIL_LENGTH;
-    float color[3];
-    pick_color(c, (float *)&color);
-    glUniform3fv(g_gl_state.tail.uniforms.color, 1, color);
-
-    /* Shift index to avoid creating a closed loop. */
-    tail_index[offset] = tail_indices[c];
-    for (int i = 1; i < TAIL_LENGTH; i++) {
-      int curr = tail_index[offset+i-1] + 1;
-      if (curr == (c+1)*TAIL_LENGTH) {
-        curr = c*TAIL_LENGTH;
-      }
-      tail_index[offset+i] = curr;
-    }
-
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                 sizeof(tail_index),
-                 tail_index,
-                 GL_DYNAMIC_DRAW);
-
-    glDrawElements(GL_LINE_STRIP,
-                   TAIL_LENGTH,
-                   GL_UNSIGNED_INT,
-                   (GLvoid *)(offset*sizeof(GLuint)));
-
-  }
+  glMultiDrawElements(GL_LINE_STRIP, tail_counts, GL_UNSIGNED_INT,
+                      tail_offsets, g_config.count);
 
   glUseProgram(g_gl_state.head_program);
-  glUniform3f(g_gl_state.head.uniforms.rotation,
-              g_gl_state.rotation.x,
-              g_gl_state.rotation.y,
-              g_gl_state.rotation.z);
-  glUniform3f(g_gl_state.head.uniforms.translation,
-              g_gl_state.translation.x,
-              g_gl_state.translation.y,
-              g_gl_state.translation.z);
-
-  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.colors_buffer);
-  glEnableVertexAttribArray(g_gl_state.head.attributes.color);
-  glVertexAttribPointer(g_gl_state.head.attributes.color,
-                        3, GL_UNSIGNED_INT, GL_FALSE,
-                        3*sizeof(float), 0);
+  glUniform1i(g_gl_state.head.uniforms.colors, 0);
 
-  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.vertex_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, heads);
   glEnableVertexAttribArray(g_gl_state.head.attributes.position);
   glVertexAttribPointer(g_gl_state.head.attributes.position,
                         3, GL_FLOAT, GL_FALSE,
                         3*sizeof(float), 0);
   glPointSize(8.0f);
-  glDrawArrays(GL_POINTS, 0, COUNT);
+  glDrawArrays(GL_POINTS, 0, g_config.count);
 
   glDisableVertexAttribArray(g_gl_state.tail.attributes.position);
   glDisableVertexAttribArray(g_gl_state.head.attributes.position);
-  glDisableVertexAttribArray(g_gl_state.head.attributes.color);
 
-  glfwSwapBuffers(window);
+  render_section();
+
+  if (g_gl_state.tail_persistent) {
+    if (g_gl_state.tail_fence)
+      glDeleteSync(g_gl_state.tail_fence);
+    g_gl_state.tail_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  profile_end(&g_profiler, PROFILE_DRAW);
+}
+
+/* Prepare for writing tail slots: with a persistent mapping, wait until
+   the previous frame's draws have finished reading them. */
+static void
+tail_upload_begin(void) {
+  if (g_gl_state.tail_persistent && g_gl_state.tail_fence) {
+    glClientWaitSync(g_gl_state.tail_fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                     1000000000);
+    glDeleteSync(g_gl_state.tail_fence);
+    g_gl_state.tail_fence = NULL;
+  }
+  if (!g_gl_state.tail_persistent)
+    glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.tail_vertex_buffer);
+}
+
+/* Write `slots` consecutive slots starting at `slot`. The mapping is
+   coherent, so a plain store is all it takes. */
+static void
+tail_upload_slots(int slot, int slots, const vec3 *data) {
+  size_t offset = (size_t)slot * g_config.count;
+  size_t size = (size_t)slots * g_config.count * sizeof(vec3);
+
+  if (g_gl_state.tail_persistent)
+    memcpy(g_gl_state.tail_mapped + offset, data, size);
+  else
+    glBufferSubData(GL_ARRAY_BUFFER, offset*sizeof(vec3), size, data);
+}
+
+/* Send the tail slots written since the last upload to the GPU, which
+   is proportional to the number of new steps rather than to
+   tail_length. */
+static void
+upload_tail(const snapshot *snap) {
+  int first[2], length[2];
+  int runs = tail_runs(g_config.tail_length, g_gl_state.tail_uploaded,
+                       snap->step, first, length);
+
+  if (runs == 0)
+    return;
+
+  tail_upload_begin();
+  for (int r = 0; r < runs; r++) {
+    tail_upload_slots(first[r], length[r],
+                      snap->tail + first[r]*g_config.count);
+  }
+
+  g_gl_state.tail_uploaded = snap->step;
+}
+
+/* Send the section crossings found since the last upload to the GPU,
+   widening the plot's bounds to take them in. */
+static void
+upload_section(const snapshot *snap) {
+  int first[2], length[2];
+  int runs = tail_runs(section_plot_length(), g_gl_state.section_uploaded,
+                       snap->section_total, first, length);
+  float *bounds = g_gl_state.section_bounds;
+
+  if (runs == 0)
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.section_buffer);
+  for (int r = 0; r < runs; r++) {
+    const section_point *p = snap->section + first[r];
+
+    glBufferSubData(GL_ARRAY_BUFFER, first[r]*sizeof(section_point),
+                    length[r]*sizeof(section_point), p);
+    for (int i = 0; i < length[r]; i++) {
+      if (g_gl_state.section_uploaded == 0 && r == 0 && i == 0) {
+        bounds[0] = bounds[2] = p[i].u;
+        bounds[1] = bounds[3] = p[i].v;
+      }
+      bounds[0] = p[i].u < bounds[0] ? p[i].u : bounds[0];
+      bounds[1] = p[i].v < bounds[1] ? p[i].v : bounds[1];
+      bounds[2] = p[i].u > bounds[2] ? p[i].u : bounds[2];
+      bounds[3] = p[i].v > bounds[3] ? p[i].v : bounds[3];
+    }
+  }
+
+  g_gl_state.section_uploaded = snap->section_total;
+}
+
+/* Replace the density texture with the snapshot's image. */
+static void
+upload_density(const snapshot *snap) {
+  int n = density_shown()->resolution;
+
+  glBindTexture(GL_TEXTURE_3D, g_gl_state.density_texture);
+  glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, n, n, n, GL_RED,
+                  GL_UNSIGNED_BYTE, snap->density);
+  g_gl_state.density_uploaded = snap->density_version;
+}
+
+/* Bring the back buffer up to date. Each buffer remembers the step it
+   was last filled at, so only the tail slots written since then have
+   to be copied, and likewise for the section plot. */
+static void
+sim_publish(void) {
+  snapshot *snap = &g_sim.buffers[g_sim.exchange.back];
+  const sim *core = &g_sim.core;
+  int count = g_config.count;
+  int first[2], length[2];
+  int runs = tail_runs(g_config.tail_length, snap->step, core->step,
+                       first, length);
+
+  for (int r = 0; r < runs; r++) {
+    memcpy(snap->tail + first[r]*count, core->tail + first[r]*count,
+           length[r]*count*sizeof(vec3));
+  }
+  memcpy(snap->position, core->position, position_size());
+  snap->step = core->step;
+
+  if (snap->section) {
+    const section *plot = core->crossings;
+    runs = tail_runs(plot->plot_length, snap->section_total,
+                     plot->plot_total, first, length);
+    for (int r = 0; r < runs; r++) {
+      memcpy(snap->section + first[r], plot->plot + first[r],
+             length[r]*sizeof(section_point));
+    }
+    snap->section_total = plot->plot_total;
+  }
+
+  if (snap->density && snap->density_version != core->histogram->version) {
+    memcpy(snap->density, core->histogram->image,
+           core->histogram->voxels);
+    snap->density_version = core->histogram->version;
+  }
+
+  triple_publish(&g_sim.exchange);
+}
+
+/* Integrate one tick's worth of steps and publish the result. */
+static void
+sim_tick(void) {
+  sim_advance(&g_sim.core, g_config.steps_per_frame);
+  sim_publish();
 }
 
-vec3
-lorenz(vec3 state) {
-  vec3 result;
+static void *
+sim_main(void *arg) {
+  struct timespec next, now;
+  long tick = g_config.steps_per_second > 0
+    ? 1000000000L * g_config.steps_per_frame / g_config.steps_per_second
+    : 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&g_sim.quit)) {
+    if (!g_gl_state.pause) {
+      double start = profile_now();
+      sim_tick();
+      profile_span(&g_profiler, PROFILE_INTEGRATE, PROFILE_SIM_THREAD,
+                   start, profile_now());
+    }
+
+    if (tick == 0) {
+      if (g_gl_state.pause) {
+        struct timespec idle = {0, 10000000L};
+        nanosleep(&idle, NULL);
+      }
+      continue;
+    }
 
-  /*
-    x' = 10(y-x)
-    y' = 28x - y - xz
-    z' = (-8/3)z + xy
-  */
+    next.tv_nsec += tick;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
 
-  result.x = SIGMA * (state.y - state.x);
-  result.y = RHO*state.x - state.y - state.x*state.z;
-  result.z = BETA*state.z + state.x*state.y;
+    /* When a tick overruns, start counting again from now instead of
+       racing to catch up on the backlog. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec ||
+        (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+      next = now;
+    }
+    else {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+  }
 
-  return result;
+  return NULL;
 }
 
-vec3
-rk4_weighted_avg(vec3 a, vec3 b, vec3 c, vec3 d) {
-  vec3 result;
+/* How many steps the render thread should take this frame, when it is
+   the one stepping: `rate` steps per second of wall time in a window,
+   steps_per_frame per frame when `seconds` is negative or the rate is
+   unthrottled. `owed` keeps the fraction of a step left over. */
+static long
+steps_due(double seconds, double *owed) {
+  long steps;
 
-  result.x = (a.x + 2*b.x + 2*c.x + d.x) / 6.0;
-  result.y = (a.y + 2*b.y + 2*c.y + d.y) / 6.0;
-  result.z = (a.z + 2*b.z + 2*c.z + d.z) / 6.0;
+  if (g_gl_state.pause)
+    return 0;
+  if (seconds < 0 || g_config.steps_per_second == 0)
+    return g_config.steps_per_frame;
+  *owed += seconds * g_config.steps_per_second;
+  steps = (long)*owed;
+  *owed -= steps;
+  return steps;
+}
+
+/* In replay mode nothing is integrated: the tail ring and the heads are
+   uploaded straight from the mapped recording. */
+static struct {
+  bool active;
+  replay file;
+  long step;
+  double owed;
+} g_replay;
 
-  return result;
+static void
+replay_seek(long step) {
+  long last = g_replay.file.total_steps - 1;
+  g_replay.step = step < 0 ? 0 : step > last ? last : step;
 }
 
-/* Compute next step of autonomous differential equation. */
-vec3
-rk4(vec3 current, float dt) {
-  vec3 k1 = lorenz(current);
-  vec3 k2 = lorenz(vec3_add(current, vec3_scale(dt/2, k1)));
-  vec3 k3 = lorenz(vec3_add(current, vec3_scale(dt/2, k2)));
-  vec3 k4 = lorenz(vec3_add(current, vec3_scale(dt, k3)));
+static void
+replay_frame(void) {
+  long step = g_replay.step;
+  long from = g_gl_state.tail_uploaded;
+  int ring = g_config.tail_length;
+
+  profile_begin(&g_profiler, PROFILE_UPLOAD);
+  tail_upload_begin();
+
+  /* After seeking backwards the ring is refilled from scratch, which
+     leaves the slots no step has reached yet empty. */
+  if (step < from) {
+    if (step < ring) {
+      vec3 *zeros = alloc_aligned(tail_size());
+      if (zeros) {
+        tail_upload_slots(0, ring, zeros);
+        free(zeros);
+      }
+    }
+    from = 0;
+  }
+  if (step - from > ring)
+    from = step - ring;
+
+  while (from < step) {
+    uint64_t run;
+    const vec3 *states = replay_step(&g_replay.file, from, &run);
+    long slot = from % ring;
+    long n = step - from;
+
+    if ((long)run < n)
+      n = run;
+    if (ring - slot < n)
+      n = ring - slot;
+    tail_upload_slots(slot, n, states);
+    from += n;
+  }
+  g_gl_state.tail_uploaded = step;
+
+  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.vertex_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, position_size(),
+                  replay_step(&g_replay.file, step, NULL));
+  profile_end(&g_profiler, PROFILE_UPLOAD);
 
-  vec3 k = rk4_weighted_avg(k1, k2, k3, k4);
+  render(step, g_gl_state.vertex_buffer);
+}
 
-  vec3 result = vec3_add(current, vec3_scale(dt, k));
+/* Move the replay forward by the steps due after `seconds`. */
+static void
+replay_advance(double seconds) {
+  long steps = steps_due(seconds, &g_replay.owed);
 
-  return result;
+  if (steps > 0)
+    replay_seek(g_replay.step + steps);
+}
+
+/* Step the gpu engine and draw the result. Like the simulation thread
+   it does not race to catch up after a slow frame: more than a tail's
+   worth of steps is dropped. */
+static void
+gpu_frame(double seconds) {
+  long steps = steps_due(seconds, &g_gpu.owed);
+
+  if (steps > g_config.tail_length)
+    steps = g_config.tail_length;
+  profile_begin(&g_profiler, PROFILE_INTEGRATE);
+  gpu_step(&g_gpu.engine, g_gl_state.tail_vertex_buffer,
+           g_config.tail_length, steps);
+  profile_end(&g_profiler, PROFILE_INTEGRATE);
+  render(g_gpu.engine.step, gpu_heads(&g_gpu.engine));
 }
 
 void
@@ -384,6 +1045,20 @@ key_callback(GLFWwindow *window, int key,
     case GLFW_KEY_P: {
       g_gl_state.pause = !g_gl_state.pause;
     } break;
+
+    /* Seeking, when replaying a recording. */
+    case GLFW_KEY_LEFT: {
+      if (g_replay.active)
+        replay_seek(g_replay.step - g_config.tail_length);
+    } break;
+    case GLFW_KEY_RIGHT: {
+      if (g_replay.active)
+        replay_seek(g_replay.step + g_config.tail_length);
+    } break;
+    case GLFW_KEY_HOME: {
+      if (g_replay.active)
+        replay_seek(0);
+    } break;
     }
   }
 }
@@ -445,8 +1120,96 @@ cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
 }
 
 
-int
-main() {
+/* Allocate everything whose size depends on the configuration. */
+static int
+make_state(void) {
+  trajectory_colors = alloc_aligned(4 * g_config.count);
+  tail_index = alloc_aligned(tail_index_size());
+  tail_counts = alloc_aligned(sizeof(GLsizei) * g_config.count);
+  tail_offsets = alloc_aligned(sizeof(GLvoid *) * g_config.count);
+  if (!trajectory_colors || !tail_index || !tail_counts || !tail_offsets)
+    return 0;
+
+  /* Only the simulation thread publishes snapshots. */
+  for (int i = 0; i < 3 && g_config.engine == ENGINE_CPU; i++) {
+    snapshot *snap = &g_sim.buffers[i];
+    snap->position = alloc_aligned(position_size());
+    snap->tail = alloc_aligned(tail_size());
+    if (!snap->position || !snap->tail)
+      return 0;
+    if (section_plot_length() > 0) {
+      snap->section = alloc_aligned(sizeof(section_point)
+                                    * section_plot_length());
+      if (!snap->section)
+        return 0;
+    }
+    if (density_shown()) {
+      snap->density = alloc_aligned(density_shown()->voxels);
+      if (!snap->density)
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Upload the newest published snapshot and draw it. */
+static void
+draw_frame(void) {
+  const snapshot *snap;
+
+  triple_consume(&g_sim.exchange);
+  snap = &g_sim.buffers[g_sim.exchange.front];
+
+  profile_begin(&g_profiler, PROFILE_UPLOAD);
+  upload_tail(snap);
+  if (snap->section)
+    upload_section(snap);
+  if (snap->density && snap->density_version != g_gl_state.density_uploaded)
+    upload_density(snap);
+  glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.vertex_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER,
+                  0, position_size(), snap->position);
+  profile_end(&g_profiler, PROFILE_UPLOAD);
+
+  render(snap->step, g_gl_state.vertex_buffer);
+
+  if (g_config.checkpoint) {
+    float view[CHECKPOINT_VIEW] = {
+      g_gl_state.rotation.x, g_gl_state.rotation.y, g_gl_state.rotation.z,
+      g_gl_state.translation.x, g_gl_state.translation.y,
+      g_gl_state.translation.z
+    };
+    sim_set_view(&g_sim.core, view);
+  }
+}
+
+static int
+make_gl(void) {
+  if (gl3wInit() != 0) {
+    fprintf(stderr, "GL3W: failed to initialize\n");
+    return 0;
+  }
+  if (!gl3wIsSupported(3, 3)) {
+    fprintf(stderr, "OpenGL 3.3 is not supported\n");
+    return 0;
+  }
+
+  GLuint vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  profile_init_gl(&g_profiler);
+  return make_resources();
+}
+
+static int
+run_windowed(void) {
+  capture cap;
+  bool capturing = false;
+  bool threaded = !g_replay.active && g_config.engine == ENGINE_CPU;
+  int status = 1;
+
   if (!glfwInit())
     return -1;
 
@@ -473,16 +1236,182 @@ main() {
   glfwSetMouseButtonCallback(window, mouse_button_callback);
   glfwSetCursorPosCallback(window, cursor_position_callback);
 
-  if (gl3wInit() != 0) {
-    fprintf(stderr, "GL3W: failed to initialize\n");
+  if (!make_gl())
+    goto done;
+
+  if (g_config.capture > CAPTURE_NONE) {
+    if (!capture_init(&cap, g_config.capture, g_config.output,
+                      WIDTH, HEIGHT, false))
+      goto done;
+    capturing = true;
+    glReadBuffer(GL_BACK);
+  }
+
+  if (threaded
+      && pthread_create(&g_sim.thread, NULL, sim_main, NULL) != 0) {
+    fprintf(stderr, "Unable to start simulation thread\n");
+    goto done;
+  }
+
+  double last = glfwGetTime();
+  while (!glfwWindowShouldClose(window)) {
+    double now = glfwGetTime();
+
+    profile_begin(&g_profiler, PROFILE_FRAME);
+    if (g_replay.active) {
+      replay_advance(now - last);
+      replay_frame();
+    }
+    else if (g_config.engine == ENGINE_GPU) {
+      gpu_frame(now - last);
+    }
+    else {
+      draw_frame();
+    }
+    last = now;
+    if (capturing) {
+      profile_begin(&g_profiler, PROFILE_CAPTURE);
+      capture_frame(&cap);
+      profile_end(&g_profiler, PROFILE_CAPTURE);
+    }
+    profile_begin(&g_profiler, PROFILE_SWAP);
+    glfwSwapBuffers(window);
+    profile_end(&g_profiler, PROFILE_SWAP);
+    glfwPollEvents();
+    profile_end(&g_profiler, PROFILE_FRAME);
+  }
+
+  if (threaded) {
+    atomic_store(&g_sim.quit, true);
+    pthread_join(g_sim.thread, NULL);
+  }
+  status = 0;
+
+ done:
+  if (capturing && !capture_finish(&cap))
+    status = 1;
+  profile_finish_gl(&g_profiler);
+  glfwTerminate();
+  return status;
+}
+
+/* Render g_config.headless frames into an offscreen framebuffer and
+   capture them (as PPM files unless told otherwise). The simulation is
+   stepped in lockstep with the frames so that the output is
+   reproducible, and no frame is ever dropped. */
+static int
+run_headless(void) {
+  headless h;
+  capture cap;
+  capture_format format = g_config.capture < 0 ? CAPTURE_PPM
+    : g_config.capture;
+  bool capturing = false;
+  int status = 1;
+
+  if (!headless_init(&h, WIDTH, HEIGHT) || !make_gl()
+      || !headless_make_framebuffer(&h, 4))
+    goto done;
+
+  if (format != CAPTURE_NONE) {
+    if (!capture_init(&cap, format, g_config.output, WIDTH, HEIGHT, true))
+      goto done;
+    capturing = true;
+  }
+
+  for (int frame = 0; frame < g_config.headless; frame++) {
+    profile_begin(&g_profiler, PROFILE_FRAME);
+    if (g_replay.active) {
+      replay_advance(-1);
+      replay_frame();
+    }
+    else if (g_config.engine == ENGINE_GPU) {
+      gpu_frame(-1);
+    }
+    else {
+      profile_begin(&g_profiler, PROFILE_INTEGRATE);
+      sim_tick();
+      profile_end(&g_profiler, PROFILE_INTEGRATE);
+      draw_frame();
+    }
+    profile_begin(&g_profiler, PROFILE_SWAP);
+    headless_resolve(&h);
+    profile_end(&g_profiler, PROFILE_SWAP);
+    if (capturing) {
+      profile_begin(&g_profiler, PROFILE_CAPTURE);
+      capture_frame(&cap);
+      profile_end(&g_profiler, PROFILE_CAPTURE);
+    }
+    profile_end(&g_profiler, PROFILE_FRAME);
+  }
+  status = 0;
+
+ done:
+  if (capturing && !capture_finish(&cap))
+    status = 1;
+  profile_finish_gl(&g_profiler);
+  headless_free(&h);
+  return status;
+}
+
+int
+main(int argc, char **argv) {
+  float view[CHECKPOINT_VIEW];
+  bool restored_view = false;
+  int status;
+
+  config_defaults(&g_config);
+  if (!config_parse_args(&g_config, argc, argv))
     return 1;
+
+  if (g_config.bench_precision > 0)
+    return !bench_precision(&g_config);
+
+  if (!profile_init(&g_profiler, g_config.profile, g_config.trace))
+    return 1;
+  /* From here on every exit goes through `done`, which finishes the
+     trace; sim_close is safe on a simulation that never started. */
+  status = 1;
+
+  /* A replay takes its system, size and step from the recording. */
+  if (g_config.replay) {
+    if (!replay_open(&g_replay.file, g_config.replay))
+      goto done;
+    g_replay.active = true;
+    g_config.count = g_replay.file.header.count;
+    g_config.dt = g_replay.file.header.dt;
+    g_config.params.count = 0;
+    if (g_replay.file.header.system < SYSTEM_COUNT) {
+      g_config.system = g_replay.file.header.system;
+      g_config.params.count = systems[g_config.system].param_count;
+      memcpy(g_config.params.values, g_replay.file.header.params,
+             sizeof(g_config.params.values));
+    }
+    g_config.engine = ENGINE_CPU;
+    g_config.integrator = INTEGRATOR_RK4;
+    g_config.record = NULL;
+    g_config.lyapunov = 0;
+    g_config.section = NULL;
+    g_config.density = 0;
+    if (!config_validate(&g_config))
+      goto done;
+    replay_seek(g_config.replay_start);
   }
 
-  GLuint vao;
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
+  /* A restore takes its system and size from the checkpoint, and the
+     camera too if lorenz wrote it. */
+  if (g_config.restore) {
+    if (!checkpoint_configure(&g_config, view, &restored_view)
+        || !config_validate(&g_config))
+      goto done;
+  }
 
-  float dt = 0.005;
+  if (!sim_init(&g_sim.core, &g_config))
+    goto done;
+  if (!make_state()) {
+    fprintf(stderr, "Unable to allocate state for %d trajectories\n",
+            g_config.count);
+    goto done;
+  }
 
   g_gl_state.rotation.x = 1.65f;
   g_gl_state.rotation.y = 3.08f;
@@ -490,59 +1419,39 @@ main() {
   g_gl_state.translation.x = 0.0f;
   g_gl_state.translation.y = 0.075f;
   g_gl_state.translation.z = 1.81f;
-
-  vec3 initial[COUNT] = {{0.0, 1.2, 0.2},
-                         {1.0, 0.04, 1.0},
-                         {-0.5, -1.0, 0.0},
-                         {0.01, 0.6, 0.2},
-                         {0.01, -0.5, 0.2}};
-  vec3 current[COUNT];
-  for (int i = 0; i < COUNT; i++) {
-    current[i] = initial[i];
+  if (restored_view) {
+    g_gl_state.rotation.x = view[0];
+    g_gl_state.rotation.y = view[1];
+    g_gl_state.rotation.z = view[2];
+    g_gl_state.translation.x = view[3];
+    g_gl_state.translation.y = view[4];
+    g_gl_state.translation.z = view[5];
   }
+  g_gl_state.pause = false;
 
-  for (int i = 0; i < TAIL_LENGTH*COUNT; i++) {
-    tail_index[i] = i;
-    tail[i].x = 0.0f;
-    tail[i].y = 0.0f;
-    tail[i].z = 0.0f;
+  for (int c = 0; c < g_config.count; c++) {
+    int ring = g_config.tail_length;
+    GLuint *index = tail_index + 2*c*ring;
+    for (int i = 0; i < 2*ring; i++) {
+      index[i] = i % ring * g_config.count + c;
+    }
   }
 
-  for (int i = 0; i < COUNT; i++) {
-    tail_indices[i] = i*TAIL_LENGTH;
-  }
+  triple_init(&g_sim.exchange);
 
-  make_resources();
+  if (g_config.headless > 0)
+    status = run_headless();
+  else
+    status = run_windowed();
+  profile_report(&g_profiler, stderr);
 
-  g_gl_state.pause = false;
-  while (!glfwWindowShouldClose(window)) {
-    if (!g_gl_state.pause) {
-      for (int c = 0; c < COUNT; c++) {
-        for (int i = 0; i < STEPS_PER_FRAME; i++) {
-          tail[tail_indices[c]] = current[c];
-          tail_indices[c] = tail_indices[c]+1;
-
-          if (tail_indices[c] == (c+1)*TAIL_LENGTH) {
-            tail_indices[c] = c*TAIL_LENGTH;
-          }
-
-          current[c] = rk4(current[c], dt);
-        }
-        position[3*c + 0] = current[c].x;
-        position[3*c + 1] = current[c].y;
-        position[3*c + 2] = current[c].z;
-      }
-    }
-
-    glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.tail_vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER,
-                 sizeof(tail), tail, GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, g_gl_state.vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER,
-                 sizeof(position), position, GL_DYNAMIC_DRAW);
+ done:
+  if (!sim_close(&g_sim.core))
+    status = 1;
+  if (!profile_close(&g_profiler))
+    status = 1;
+  if (g_replay.active)
+    replay_close(&g_replay.file);
 
-    render(window);
-
-    glfwPollEvents();
-  }
+  return status;
 }
@@ -0,0 +1,398 @@
+/* Lyapunov spectrum of every trajectory, turned on with --lyapunov N.
+
+   Each trajectory carries three tangent vectors that are integrated
+   with the linearization of the system along it, dq/dt = J(x) q, by the
+   same RK4 step that advances the state: the kernels here replace the
+   batch kernel and evaluate the field and the three Jacobian-vector
+   products at every stage, so the state comes out bit for bit as it
+   would without them. The tangent vectors are stored like the state,
+   one aligned array per component, and advanced SIMD lane by lane.
+
+   Left alone the vectors would all swing towards the most expanding
+   direction, so every N steps they are orthogonalized again with
+   modified Gram-Schmidt (the QR decomposition of the 3x3 matrix they
+   form). The logarithms of the lengths Gram-Schmidt leaves them with,
+   summed over the intervals and divided by the time elapsed, converge
+   to the three Lyapunov exponents, largest first (Benettin et al.,
+   Meccanica 15, 1980).
+
+   Rather than normalizing the vectors, which would take a square root
+   and a logarithm per lane, the kernels only scale each one by a power
+   of two that brings its length into [1, 2), and count the octaves
+   taken off. That is exact, and a few integer operations; the lengths
+   and their logarithms are only worked out when an estimate is asked
+   for. Growth over N steps must stay well within float range: about
+   N * dt * |lambda| < 40 for every exponent, the most negative
+   included.
+
+   Only rk4 in float or double precision has kernels here; the mixed
+   precision would need compensation arrays for the tangents too.
+*/
+
+#include <math.h>
+#include <stdint.h>
+
+#define LYAPUNOV_VECTORS 3
+/* The state and the components of the three tangent vectors. */
+#define LYAPUNOV_COMPONENTS (3 + 3 * LYAPUNOV_VECTORS)
+
+typedef struct lyapunov lyapunov;
+
+typedef void (*lyapunov_kernel)(lyapunov *l, batch *b, int begin, int end,
+                                float dt, bool orthogonalize);
+
+struct lyapunov {
+  int count, capacity;
+  int interval;
+  lyapunov_kernel kernel;
+  /* Component j of tangent vector k of every trajectory is in array
+     3*k + j, float or double as the state is. */
+  float *tangent[3 * LYAPUNOV_VECTORS];
+  double *tangentd[3 * LYAPUNOV_VECTORS];
+  /* Octaves each vector has been scaled down by in all; NaN once its
+     length reached zero or infinity. */
+  double *octaves[LYAPUNOV_VECTORS];
+};
+
+/* The loops over the components must be unrolled for the arrays of
+   vectors below to live in registers. */
+#define LYAPUNOV_UNROLL _Pragma("GCC unroll 12")
+
+/* Derivatives f of the state and tangent vectors in s. */
+#define LYAPUNOV_FIELD(SYS, f, s)                                       \
+  do {                                                                  \
+    f[0] = SYS##_DX(s[0], s[1], s[2]);                                  \
+    f[1] = SYS##_DY(s[0], s[1], s[2]);                                  \
+    f[2] = SYS##_DZ(s[0], s[1], s[2]);                                  \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 3; j < LYAPUNOV_COMPONENTS; j += 3) {                  \
+      f[j + 0] = SYS##_JX(s[0], s[1], s[2], s[j], s[j + 1], s[j + 2]); \
+      f[j + 1] = SYS##_JY(s[0], s[1], s[2], s[j], s[j + 1], s[j + 2]); \
+      f[j + 2] = SYS##_JZ(s[0], s[1], s[2], s[j], s[j + 1], s[j + 2]); \
+    }                                                                   \
+  } while (0)
+
+/* The power of two that brings a vector of squared length `squared`
+   to a length in [1, 2), adding the octaves it takes off to `octaves`,
+   or making them NaN if the length was zero or is no longer finite.
+   The halved exponent is floored with an offset that keeps the
+   division on non-negative numbers, and there are no branches. */
+static inline float
+lyapunov_scale_float(float squared, double *octaves) {
+  uint32_t bits;
+  int field, down;
+  float scale;
+
+  memcpy(&bits, &squared, sizeof(bits));
+  field = bits >> 23 & 0xff;
+  down = (field - 127 + 128) / 2 - 64;
+  *octaves += field == 0 || field == 0xff ? NAN : down;
+  bits = (uint32_t)(127 - down) << 23;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+static inline double
+lyapunov_scale_double(double squared, double *octaves) {
+  uint64_t bits;
+  int field, down;
+  double scale;
+
+  memcpy(&bits, &squared, sizeof(bits));
+  field = bits >> 52 & 0x7ff;
+  down = (field - 1023 + 1024) / 2 - 512;
+  *octaves += field == 0 || field == 0x7ff ? NAN : down;
+  bits = (uint64_t)(1023 - down) << 52;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+#define LYAPUNOV_SCALE(squared, octaves)                                \
+  _Generic((squared), float: lyapunov_scale_float,                      \
+                      double: lyapunov_scale_double)(squared, octaves)
+
+/* Modified Gram-Schmidt without the normalization on the tangent
+   vectors in s[3..], W lanes of element type E at a time, then the
+   scaling of each by a power of two, counted in the octaves of
+   trajectories begin + i onwards. */
+#define LYAPUNOV_ORTHOGONALIZE(T, W, E, s)                              \
+  do {                                                                  \
+    T length2[LYAPUNOV_VECTORS];                                        \
+    LYAPUNOV_UNROLL                                                     \
+    for (int k = 0; k < LYAPUNOV_VECTORS; k++) {                        \
+      T *q = s + 3 + 3*k, scale;                                        \
+      E lanes[W];                                                       \
+      for (int m = 0; m < k; m++) {                                     \
+        T *r = s + 3 + 3*m;                                             \
+        T d = (q[0] * r[0] + q[1] * r[1] + q[2] * r[2]) / length2[m];   \
+        q[0] -= d * r[0];                                               \
+        q[1] -= d * r[1];                                               \
+        q[2] -= d * r[2];                                               \
+      }                                                                 \
+      length2[k] = q[0] * q[0] + q[1] * q[1] + q[2] * q[2];             \
+      memcpy(lanes, &length2[k], sizeof(T));                            \
+      for (int w = 0; w < (W); w++)                                     \
+        lanes[w] = LYAPUNOV_SCALE(lanes[w],                             \
+                                  l->octaves[k] + begin + i + w);       \
+      memcpy(&scale, lanes, sizeof(T));                                 \
+      q[0] *= scale;                                                    \
+      q[1] *= scale;                                                    \
+      q[2] *= scale;                                                    \
+      length2[k] *= scale * scale;                                      \
+    }                                                                   \
+  } while (0)
+
+/* One RK4 step of the arrays v[0..LYAPUNOV_COMPONENTS) of n elements, W
+   at a time as vectors of type T, orthogonalizing the tangent vectors
+   at the end if `orthogonalize` is set. The increments are summed in
+   the order RK4_BATCH_BODY uses. */
+#define LYAPUNOV_BODY(T, W, E, SYS)                                     \
+  for (int i = 0; i < n; i += (W)) {                                    \
+    T s0[LYAPUNOV_COMPONENTS], s[LYAPUNOV_COMPONENTS];                  \
+    T k[LYAPUNOV_COMPONENTS], sum[LYAPUNOV_COMPONENTS];                 \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++)                       \
+      memcpy(&s0[j], v[j] + i, sizeof(T));                              \
+                                                                        \
+    LYAPUNOV_FIELD(SYS, k, s0);                                         \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++) {                     \
+      sum[j] = k[j];                                                    \
+      s[j] = s0[j] + (dt/2) * k[j];                                     \
+    }                                                                   \
+    LYAPUNOV_FIELD(SYS, k, s);                                          \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++) {                     \
+      sum[j] = sum[j] + 2*k[j];                                         \
+      s[j] = s0[j] + (dt/2) * k[j];                                     \
+    }                                                                   \
+    LYAPUNOV_FIELD(SYS, k, s);                                          \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++) {                     \
+      sum[j] = sum[j] + 2*k[j];                                         \
+      s[j] = s0[j] + dt * k[j];                                         \
+    }                                                                   \
+    LYAPUNOV_FIELD(SYS, k, s);                                          \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++)                       \
+      s0[j] += (dt/6) * (sum[j] + k[j]);                                \
+                                                                        \
+    if (orthogonalize)                                                  \
+      LYAPUNOV_ORTHOGONALIZE(T, W, E, s0);                              \
+    LYAPUNOV_UNROLL                                                     \
+    for (int j = 0; j < LYAPUNOV_COMPONENTS; j++)                       \
+      memcpy(v[j] + i, &s0[j], sizeof(T));                              \
+  }
+
+#define LYAPUNOV_FLOAT_KERNEL(name, T, W, SYS)                          \
+  static void                                                           \
+  name(lyapunov *l, batch *b, int begin, int end, float dt,            \
+       bool orthogonalize) {                                            \
+    float *v[LYAPUNOV_COMPONENTS] = {                                   \
+      b->x + begin, b->y + begin, b->z + begin                          \
+    };                                                                  \
+    int n = end - begin;                                                \
+    SYSTEM_PARAMS(float, b->params_float);                              \
+    for (int j = 3; j < LYAPUNOV_COMPONENTS; j++)                       \
+      v[j] = l->tangent[j - 3] + begin;                                 \
+    LYAPUNOV_BODY(T, W, float, SYS)                                     \
+  }
+
+#define LYAPUNOV_DOUBLE_KERNEL(name, T, W, SYS)                         \
+  static void                                                           \
+  name(lyapunov *l, batch *b, int begin, int end, float step,          \
+       bool orthogonalize) {                                            \
+    double *v[LYAPUNOV_COMPONENTS] = {                                  \
+      b->xd + begin, b->yd + begin, b->zd + begin                       \
+    };                                                                  \
+    double dt = step;                                                   \
+    int n = end - begin;                                                \
+    SYSTEM_PARAMS(double, b->params);                                   \
+    for (int j = 3; j < LYAPUNOV_COMPONENTS; j++)                       \
+      v[j] = l->tangentd[j - 3] + begin;                                \
+    LYAPUNOV_BODY(T, W, double, SYS)                                    \
+    for (int i = 0; i < n; i++) {                                       \
+      b->x[begin + i] = v[0][i];                                        \
+      b->y[begin + i] = v[1][i];                                        \
+      b->z[begin + i] = v[2][i];                                        \
+    }                                                                   \
+  }
+
+/* Both precisions of every system, and a row of the kernel tables for
+   each system. */
+#define LYAPUNOV_KERNELS(NAME, name, ISA, ATTRIBUTES, FT, FW, DT, DW)   \
+  ATTRIBUTES LYAPUNOV_FLOAT_KERNEL(lyapunov_##name##_float##ISA,        \
+                                   FT, FW, NAME)                        \
+  ATTRIBUTES LYAPUNOV_DOUBLE_KERNEL(lyapunov_##name##_double##ISA,      \
+                                    DT, DW, NAME)
+
+#define LYAPUNOV_KERNEL_ROW(name, ISA)                                  \
+  {lyapunov_##name##_float##ISA, lyapunov_##name##_double##ISA},
+
+#define LYAPUNOV_SCALAR_KERNELS(NAME, name)                             \
+  LYAPUNOV_KERNELS(NAME, name, _scalar, , float, 1, double, 1)
+#define LYAPUNOV_SCALAR_ROW(NAME, name) LYAPUNOV_KERNEL_ROW(name, _scalar)
+SYSTEM_LIST(LYAPUNOV_SCALAR_KERNELS)
+
+#ifdef HAVE_X86_KERNELS
+#define LYAPUNOV_SSE_KERNELS(NAME, name)                                \
+  LYAPUNOV_KERNELS(NAME, name, _sse, __attribute__((target("sse2"))),   \
+                   float4, 4, double2, 2)
+#define LYAPUNOV_SSE_ROW(NAME, name) LYAPUNOV_KERNEL_ROW(name, _sse)
+SYSTEM_LIST(LYAPUNOV_SSE_KERNELS)
+
+#define LYAPUNOV_AVX2_KERNELS(NAME, name)                               \
+  LYAPUNOV_KERNELS(NAME, name, _avx2,                                   \
+                   __attribute__((target("avx2,fma"))),                 \
+                   float8, 8, double4, 4)
+#define LYAPUNOV_AVX2_ROW(NAME, name) LYAPUNOV_KERNEL_ROW(name, _avx2)
+SYSTEM_LIST(LYAPUNOV_AVX2_KERNELS)
+#endif
+
+/* Pick the widest kernel for `system` in float or double precision that
+   the running CPU supports, as batch_select_kernel does. */
+static lyapunov_kernel
+lyapunov_select_kernel(system_id system, batch_precision precision) {
+  static const lyapunov_kernel scalar[SYSTEM_COUNT][2] = {
+    SYSTEM_LIST(LYAPUNOV_SCALAR_ROW)
+  };
+  int p = precision == PRECISION_DOUBLE;
+#ifdef HAVE_X86_KERNELS
+  static const lyapunov_kernel sse[SYSTEM_COUNT][2] = {
+    SYSTEM_LIST(LYAPUNOV_SSE_ROW)
+  };
+  static const lyapunov_kernel avx2[SYSTEM_COUNT][2] = {
+    SYSTEM_LIST(LYAPUNOV_AVX2_ROW)
+  };
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return avx2[system][p];
+  if (__builtin_cpu_supports("sse2"))
+    return sse[system][p];
+#endif
+  return scalar[system][p];
+}
+
+static void
+lyapunov_free(lyapunov *l) {
+  for (int j = 0; j < 3 * LYAPUNOV_VECTORS; j++) {
+    free(l->tangent[j]);
+    free(l->tangentd[j]);
+  }
+  for (int k = 0; k < LYAPUNOV_VECTORS; k++)
+    free(l->octaves[k]);
+}
+
+/* Start every trajectory of `b` from the unit vectors, orthogonalizing
+   them every `interval` steps. */
+static int
+lyapunov_init(lyapunov *l, const batch *b, system_id system, int interval) {
+  bool doubles = b->precision == PRECISION_DOUBLE;
+
+  memset(l, 0, sizeof(*l));
+  l->count = b->count;
+  l->capacity = b->capacity;
+  l->interval = interval;
+  l->kernel = lyapunov_select_kernel(system, b->precision);
+
+  for (int j = 0; j < 3 * LYAPUNOV_VECTORS; j++) {
+    float one = j % 4 == 0;
+    if (doubles)
+      l->tangentd[j] = alloc_aligned(sizeof(double) * l->capacity);
+    else
+      l->tangent[j] = alloc_aligned(sizeof(float) * l->capacity);
+    if (doubles ? !l->tangentd[j] : !l->tangent[j])
+      goto fail;
+    for (int c = 0; c < l->capacity; c++) {
+      if (doubles)
+        l->tangentd[j][c] = one;
+      else
+        l->tangent[j][c] = one;
+    }
+  }
+  for (int k = 0; k < LYAPUNOV_VECTORS; k++) {
+    l->octaves[k] = calloc(l->capacity, sizeof(double));
+    if (!l->octaves[k])
+      goto fail;
+  }
+  return 1;
+
+fail:
+  fprintf(stderr, "Unable to allocate tangent vectors for %d "
+          "trajectories\n", l->count);
+  lyapunov_free(l);
+  return 0;
+}
+
+/* Advance trajectories [begin, end) one step, as the batch kernel
+   would, and orthogonalize their tangent vectors if `step` is the last
+   of an interval. `end` may run into the padding, which is treated like
+   any other trajectory so its tangents stay finite. */
+static void
+lyapunov_advance(lyapunov *l, batch *b, int begin, int end, float dt,
+                 long step) {
+  l->kernel(l, b, begin, end, dt, (step + 1) % l->interval == 0);
+}
+
+/* Natural log of the growth of each tangent vector of trajectory `c`
+   so far: the octaves it was scaled down by, and the lengths
+   Gram-Schmidt gives the vectors as they are now. */
+static void
+lyapunov_growth(const lyapunov *l, int c, double growth[LYAPUNOV_VECTORS]) {
+  double q[LYAPUNOV_VECTORS][3];
+
+  for (int j = 0; j < 3 * LYAPUNOV_VECTORS; j++)
+    q[j / 3][j % 3] = l->tangentd[j] ? l->tangentd[j][c] : l->tangent[j][c];
+  for (int k = 0; k < LYAPUNOV_VECTORS; k++) {
+    double length;
+    for (int m = 0; m < k; m++) {
+      double d = q[k][0]*q[m][0] + q[k][1]*q[m][1] + q[k][2]*q[m][2];
+      for (int j = 0; j < 3; j++)
+        q[k][j] -= d * q[m][j];
+    }
+    length = sqrt(q[k][0]*q[k][0] + q[k][1]*q[k][1] + q[k][2]*q[k][2]);
+    for (int j = 0; j < 3; j++)
+      q[k][j] /= length;
+    growth[k] = l->octaves[k][c] * log(2.0) + log(length);
+  }
+}
+
+/* Running estimates of the exponents after `steps` steps of `dt`: the
+   mean over the trajectories of each, and its standard deviation
+   across them. Trajectories whose tangents broke down are left out.
+   Returns how many were averaged. */
+static __attribute__((unused)) int
+lyapunov_estimate(const lyapunov *l, long steps, double dt,
+                  double mean[LYAPUNOV_VECTORS],
+                  double spread[LYAPUNOV_VECTORS]) {
+  double t = steps * dt;
+  double sum[LYAPUNOV_VECTORS] = {0}, sq[LYAPUNOV_VECTORS] = {0};
+  int finite = 0;
+
+  if (t <= 0.0)
+    return 0;
+  for (int c = 0; c < l->count; c++) {
+    double growth[LYAPUNOV_VECTORS];
+    bool ok = true;
+
+    lyapunov_growth(l, c, growth);
+    for (int k = 0; k < LYAPUNOV_VECTORS; k++)
+      ok = ok && isfinite(growth[k]);
+    if (!ok)
+      continue;
+    finite++;
+    for (int k = 0; k < LYAPUNOV_VECTORS; k++) {
+      double e = growth[k] / t;
+      sum[k] += e;
+      sq[k] += e * e;
+    }
+  }
+  for (int k = 0; k < LYAPUNOV_VECTORS; k++) {
+    double var;
+    mean[k] = finite ? sum[k] / finite : 0.0;
+    var = finite ? sq[k] / finite - mean[k] * mean[k] : 0.0;
+    spread[k] = var > 0.0 ? sqrt(var) : 0.0;
+  }
+  return finite;
+}
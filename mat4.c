@@ -0,0 +1,110 @@
+/* 4x4 matrices, stored column by column the way OpenGL expects them:
+   the element in row r and column c is m[4*c + r]. */
+typedef struct {
+  float m[16];
+} mat4;
+
+static float
+radians(float degrees) {
+  return degrees * 3.14159265f / 180.0f;
+}
+
+static mat4
+mat4_identity(void) {
+  mat4 result = {{0}};
+
+  result.m[0] = result.m[5] = result.m[10] = result.m[15] = 1.0f;
+
+  return result;
+}
+
+static mat4
+mat4_mul(mat4 a, mat4 b) {
+  mat4 result;
+
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; k++)
+        sum += a.m[4*k + r] * b.m[4*c + k];
+      result.m[4*c + r] = sum;
+    }
+  }
+
+  return result;
+}
+
+static mat4
+mat4_view_frustum(float angle_of_view, float aspect_ratio,
+                  float z_near, float z_far) {
+  mat4 result = {{0}};
+
+  result.m[0] = 1.0f / tanf(angle_of_view);
+  result.m[5] = aspect_ratio / tanf(angle_of_view);
+  result.m[10] = (z_far + z_near) / (z_far - z_near);
+  result.m[11] = 1.0f;
+  result.m[14] = -2.0f * z_far * z_near / (z_far - z_near);
+
+  return result;
+}
+
+static mat4
+mat4_scale(float x, float y, float z) {
+  mat4 result = mat4_identity();
+
+  result.m[0] = x;
+  result.m[5] = y;
+  result.m[10] = z;
+
+  return result;
+}
+
+static mat4
+mat4_translate(float x, float y, float z) {
+  mat4 result = mat4_identity();
+
+  result.m[12] = x;
+  result.m[13] = y;
+  result.m[14] = z;
+
+  return result;
+}
+
+static mat4
+mat4_rotate_x(float t) {
+  mat4 result = mat4_identity();
+  float st = sinf(t), ct = cosf(t);
+
+  result.m[5] = ct;
+  result.m[6] = st;
+  result.m[9] = -st;
+  result.m[10] = ct;
+
+  return result;
+}
+
+static mat4
+mat4_rotate_y(float t) {
+  mat4 result = mat4_identity();
+  float st = sinf(t), ct = cosf(t);
+
+  result.m[0] = ct;
+  result.m[2] = st;
+  result.m[8] = -st;
+  result.m[10] = ct;
+
+  return result;
+}
+
+static mat4
+mat4_rotate_z(float t) {
+  mat4 result = mat4_identity();
+  float st = sinf(t), ct = cosf(t);
+
+  result.m[0] = ct;
+  result.m[1] = st;
+  result.m[4] = -st;
+  result.m[5] = ct;
+
+  return result;
+}
@@ -0,0 +1,441 @@
+/* Integrator micro-benchmarks, built with `make microbench` and run
+   with `make bench`.
+
+   Every integrator is timed on its own, away from GL and the render
+   loop: the scalar lorenz() and rk4() of rk4.c, each batch kernel for
+   every instruction set the CPU supports and every precision, the
+   widest kernels that also estimate the Lyapunov exponents, and
+   dopri5. Each configuration of trajectory count and thread count is
+   warmed up, then timed over several repetitions of about `--work`
+   trajectory steps each, and summarized as steps per second (mean,
+   standard deviation, minimum, median and maximum) in CSV or JSON.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "vec3.c"
+#include "util.c"
+#include "system.c"
+#include "rk4.c"
+#include "batch.c"
+#include "dopri.c"
+#include "lyapunov.c"
+#include "pool.c"
+
+#define MICROBENCH_MAX_LIST 16
+#define MICROBENCH_MAX_REPS 100
+#define MICROBENCH_DT 0.005f
+#define MICROBENCH_LYAPUNOV_INTERVAL 10
+
+typedef struct {
+  int count;
+  int values[MICROBENCH_MAX_LIST];
+} int_list;
+
+typedef struct {
+  system_id system;
+  int_list counts, threads;
+  long work;
+  int reps, warmup;
+  bool json;
+} microbench_options;
+
+/* One configuration to time. `run` takes `steps` steps of the whole
+   set of trajectories. */
+typedef struct microbench microbench;
+struct microbench {
+  const char *name, *isa, *precision;
+  int count, threads;
+  void (*run)(microbench *m, long steps);
+
+  vec3 *states;
+  batch b;
+  batch_kernel kernel;
+  dopri adaptive;
+  lyapunov spectrum;
+  long step;
+  pool workers;
+};
+
+static volatile float microbench_sink;
+static int microbench_rows;
+
+static double
+microbench_seconds(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+parse_int_list(const char *value, int_list *list) {
+  const char *p = value;
+  char *end;
+
+  list->count = 0;
+  for (;;) {
+    long v = strtol(p, &end, 10);
+    if (end == p || v < 1 || v > 1 << 30
+        || list->count == MICROBENCH_MAX_LIST)
+      return 0;
+    list->values[list->count++] = v;
+    if (*end == '\0')
+      return 1;
+    if (*end != ',')
+      return 0;
+    p = end + 1;
+  }
+}
+
+static void
+microbench_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--OPTION VALUE]...\n\n"
+          "  --system    system for the batch kernels, lyapunov and dopri5\n"
+          "              (lorenz() and rk4() always integrate Lorenz)\n"
+          "  --counts    trajectory counts, as n,n,...\n"
+          "  --threads   thread counts, as n,n,...\n"
+          "  --work      trajectory steps per repetition\n"
+          "  --reps      timed repetitions\n"
+          "  --warmup    untimed repetitions first\n"
+          "  --format    csv or json\n", program);
+}
+
+static int
+microbench_parse_args(microbench_options *o, int argc, char **argv) {
+  for (int i = 1; i < argc; i += 2) {
+    const char *key = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+    bool ok;
+
+    if (!value) {
+      ok = false;
+    }
+    else if (strcmp(key, "--system") == 0) {
+      int s;
+      for (s = 0; system_names[s] && strcmp(system_names[s], value); s++)
+        ;
+      ok = system_names[s] != NULL;
+      o->system = s;
+    }
+    else if (strcmp(key, "--counts") == 0) {
+      ok = parse_int_list(value, &o->counts);
+    }
+    else if (strcmp(key, "--threads") == 0) {
+      ok = parse_int_list(value, &o->threads);
+    }
+    else if (strcmp(key, "--work") == 0) {
+      o->work = strtol(value, NULL, 10);
+      ok = o->work > 0;
+    }
+    else if (strcmp(key, "--reps") == 0) {
+      o->reps = atoi(value);
+      ok = o->reps > 0 && o->reps <= MICROBENCH_MAX_REPS;
+    }
+    else if (strcmp(key, "--warmup") == 0) {
+      o->warmup = atoi(value);
+      ok = o->warmup >= 0;
+    }
+    else if (strcmp(key, "--format") == 0) {
+      o->json = strcmp(value, "json") == 0;
+      ok = o->json || strcmp(value, "csv") == 0;
+    }
+    else {
+      ok = false;
+    }
+
+    if (!ok) {
+      microbench_usage(argv[0]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Spread the trajectories a little around (1, 1, 1), where every
+   system is well behaved; the warm-up takes them onto the attractor. */
+static vec3
+microbench_initial(int i) {
+  vec3 p = {1.0f + 1e-3f * (i % 97), 1.0f + 1e-3f * (i % 89),
+            1.0f + 1e-3f * (i % 83)};
+  return p;
+}
+
+static void
+run_lorenz(microbench *m, long steps) {
+  vec3 sum = {0, 0, 0};
+
+  for (long s = 0; s < steps; s++) {
+    for (int i = 0; i < m->count; i++)
+      sum = vec3_add(sum, lorenz(m->states[i]));
+  }
+  microbench_sink = sum.x + sum.y + sum.z;
+}
+
+static void
+run_rk4(microbench *m, long steps) {
+  for (long s = 0; s < steps; s++) {
+    for (int i = 0; i < m->count; i++)
+      m->states[i] = rk4(m->states[i], MICROBENCH_DT);
+  }
+  microbench_sink = m->states[0].x;
+}
+
+static void
+batch_task(void *arg, int begin, int end) {
+  microbench *m = arg;
+  m->kernel(&m->b, begin, end, MICROBENCH_DT);
+}
+
+static void
+run_batch(microbench *m, long steps) {
+  for (long s = 0; s < steps; s++)
+    pool_run(&m->workers, batch_task, m, m->b.capacity, BATCH_GRAIN);
+}
+
+static void
+dopri_task(void *arg, int begin, int end) {
+  microbench *m = arg;
+  int last = end < m->b.count ? end : m->b.count;
+  dopri_advance(&m->adaptive, &m->b, begin, last,
+                m->step * (double)MICROBENCH_DT);
+}
+
+static void
+run_dopri(microbench *m, long steps) {
+  for (long s = 0; s < steps; s++) {
+    m->step++;
+    pool_run(&m->workers, dopri_task, m, m->b.capacity, BATCH_GRAIN);
+  }
+}
+
+static void
+lyapunov_task(void *arg, int begin, int end) {
+  microbench *m = arg;
+  lyapunov_advance(&m->spectrum, &m->b, begin, end, MICROBENCH_DT, m->step);
+}
+
+static void
+run_lyapunov(microbench *m, long steps) {
+  for (long s = 0; s < steps; s++) {
+    pool_run(&m->workers, lyapunov_task, m, m->b.capacity, BATCH_GRAIN);
+    m->step++;
+  }
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+microbench_report(const microbench_options *o, const microbench *m,
+                  long steps, double *rates) {
+  double mean = 0.0, var = 0.0, median;
+  int n = o->reps;
+
+  for (int r = 0; r < n; r++)
+    mean += rates[r] / n;
+  for (int r = 0; r < n; r++)
+    var += (rates[r] - mean) * (rates[r] - mean) / (n > 1 ? n - 1 : 1);
+  qsort(rates, n, sizeof(double), compare_doubles);
+  median = n % 2 ? rates[n / 2] : (rates[n / 2 - 1] + rates[n / 2]) / 2;
+
+  if (o->json) {
+    printf("%s  {\"benchmark\": \"%s\", \"isa\": \"%s\", "
+           "\"precision\": \"%s\", \"count\": %d, \"threads\": %d, "
+           "\"steps\": %ld, \"reps\": %d, \"mean\": %.6g, \"stddev\": %.6g, "
+           "\"min\": %.6g, \"median\": %.6g, \"max\": %.6g}",
+           microbench_rows ? ",\n" : "", m->name, m->isa, m->precision,
+           m->count, m->threads, steps, n, mean, sqrt(var), rates[0], median,
+           rates[n - 1]);
+  }
+  else {
+    printf("%s,%s,%s,%d,%d,%ld,%d,%.6g,%.6g,%.6g,%.6g,%.6g\n", m->name,
+           m->isa, m->precision, m->count, m->threads, steps, n, mean,
+           sqrt(var), rates[0], median, rates[n - 1]);
+  }
+  microbench_rows++;
+  fflush(stdout);
+}
+
+/* Warm up, time and report one configuration. */
+static void
+microbench_time(const microbench_options *o, microbench *m) {
+  long steps = o->work / m->count > 0 ? o->work / m->count : 1;
+  double rates[MICROBENCH_MAX_REPS];
+
+  for (int r = 0; r < o->warmup; r++)
+    m->run(m, steps);
+  for (int r = 0; r < o->reps; r++) {
+    double start = microbench_seconds(), elapsed;
+    m->run(m, steps);
+    elapsed = microbench_seconds() - start;
+    rates[r] = elapsed > 0.0 ? (double)steps * m->count / elapsed : 0.0;
+  }
+  microbench_report(o, m, steps, rates);
+}
+
+static void
+microbench_scalar(const microbench_options *o, int count) {
+  microbench m = {0};
+
+  m.isa = "scalar";
+  m.precision = "float";
+  m.count = count;
+  m.threads = 1;
+  m.states = alloc_aligned(sizeof(vec3) * count);
+  if (!m.states)
+    return;
+
+  for (int i = 0; i < count; i++)
+    m.states[i] = microbench_initial(i);
+  m.name = "rk4";
+  m.run = run_rk4;
+  microbench_time(o, &m);
+  m.name = "lorenz";
+  m.run = run_lorenz;
+  microbench_time(o, &m);
+
+  free(m.states);
+}
+
+static int
+microbench_batch_init(const microbench_options *o, microbench *m, int count,
+                      batch_precision precision) {
+  if (!batch_init(&m->b, count, precision))
+    return 0;
+  batch_set_params(&m->b, systems[o->system].defaults);
+  for (int i = 0; i < count; i++)
+    batch_set(&m->b, i, microbench_initial(i));
+  return 1;
+}
+
+static void
+microbench_kernels(const microbench_options *o, int count, int threads) {
+  static const char *const precisions[PRECISION_COUNT] = {
+    "float", "double", "mixed"
+  };
+  static const batch_kernel scalar[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_SCALAR_ROW)
+  };
+  struct {
+    const char *name;
+    const batch_kernel (*kernels)[PRECISION_COUNT];
+    bool supported;
+  } isas[3] = {{"scalar", scalar, true}};
+  int isa_count = 1;
+#ifdef HAVE_X86_KERNELS
+  static const batch_kernel sse[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_SSE_ROW)
+  };
+  static const batch_kernel avx2[SYSTEM_COUNT][PRECISION_COUNT] = {
+    SYSTEM_LIST(RK4_AVX2_ROW)
+  };
+
+  __builtin_cpu_init();
+  isas[1].name = "sse2";
+  isas[1].kernels = sse;
+  isas[1].supported = __builtin_cpu_supports("sse2");
+  isas[2].name = "avx2";
+  isas[2].kernels = avx2;
+  isas[2].supported = __builtin_cpu_supports("avx2")
+    && __builtin_cpu_supports("fma");
+  isa_count = 3;
+#endif
+  microbench m = {0};
+
+  m.name = "batch";
+  m.count = count;
+  m.threads = threads;
+  m.run = run_batch;
+  pool_init(&m.workers, threads);
+  for (int i = 0; i < isa_count; i++) {
+    if (!isas[i].supported)
+      continue;
+    for (int p = 0; p < PRECISION_COUNT; p++) {
+      if (!microbench_batch_init(o, &m, count, p))
+        continue;
+      m.isa = isas[i].name;
+      m.precision = precisions[p];
+      m.kernel = isas[i].kernels[o->system][p];
+      microbench_time(o, &m);
+      batch_free(&m.b);
+    }
+  }
+
+  /* Only the kernel lyapunov_select_kernel would pick. */
+  m.name = "lyapunov";
+  m.run = run_lyapunov;
+  for (int p = PRECISION_FLOAT; p <= PRECISION_DOUBLE; p++) {
+    if (!microbench_batch_init(o, &m, count, p))
+      continue;
+    if (lyapunov_init(&m.spectrum, &m.b, o->system,
+                      MICROBENCH_LYAPUNOV_INTERVAL)) {
+      for (int i = 0; i < isa_count; i++) {
+        if (isas[i].supported)
+          m.isa = isas[i].name;
+      }
+      m.precision = precisions[p];
+      m.step = 0;
+      microbench_time(o, &m);
+      lyapunov_free(&m.spectrum);
+    }
+    batch_free(&m.b);
+  }
+
+  m.name = "dopri5";
+  m.isa = "scalar";
+  m.precision = "double";
+  m.run = run_dopri;
+  if (microbench_batch_init(o, &m, count, PRECISION_FLOAT)) {
+    if (dopri_init(&m.adaptive, &m.b, o->system, MICROBENCH_DT,
+                   1e-6f)) {
+      microbench_time(o, &m);
+      dopri_free(&m.adaptive);
+    }
+    batch_free(&m.b);
+  }
+  pool_free(&m.workers);
+}
+
+int
+main(int argc, char **argv) {
+  microbench_options o = {
+    .system = SYSTEM_LORENZ,
+    .counts = {3, {1000, 100000, 1000000}},
+    .threads = {2, {1, pool_cpu_count()}},
+    .work = 10000000,
+    .reps = 5,
+    .warmup = 1,
+  };
+
+  if (o.threads.values[1] == 1)
+    o.threads.count = 1;
+  if (!microbench_parse_args(&o, argc, argv))
+    return 1;
+
+  if (o.json)
+    printf("[\n");
+  else
+    printf("benchmark,isa,precision,count,threads,steps,reps,"
+           "mean,stddev,min,median,max\n");
+
+  for (int c = 0; c < o.counts.count; c++) {
+    microbench_scalar(&o, o.counts.values[c]);
+    for (int t = 0; t < o.threads.count; t++)
+      microbench_kernels(&o, o.counts.values[c], o.threads.values[t]);
+  }
+
+  if (o.json)
+    printf("\n]\n");
+  return 0;
+}
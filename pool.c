@@ -0,0 +1,170 @@
+/* Persistent worker pool.
+
+   Threads are created once at startup and parked on a condition
+   variable between jobs, so handing out work every frame costs a
+   wake-up rather than a thread creation. A job is a range [0, n) which
+   is cut into one contiguous slice per thread; the calling thread
+   works on the first slice itself and then waits for the others.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef void (*pool_task)(void *arg, int begin, int end);
+
+typedef struct {
+  int nthreads;
+  pthread_t *threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  unsigned generation;
+  int pending;
+  bool quit;
+
+  pool_task task;
+  void *arg;
+  int n, slice;
+} pool;
+
+typedef struct {
+  pool *p;
+  int index;
+} pool_worker;
+
+static void
+pool_run_slice(pool *p, int index) {
+  int begin = index * p->slice;
+  int end = begin + p->slice;
+
+  if (end > p->n)
+    end = p->n;
+  if (begin < end)
+    p->task(p->arg, begin, end);
+}
+
+static void *
+pool_worker_main(void *arg) {
+  pool_worker *w = arg;
+  pool *p = w->p;
+  int index = w->index;
+  unsigned seen = 0;
+
+  free(w);
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->generation == seen && !p->quit)
+      pthread_cond_wait(&p->wake, &p->lock);
+    if (p->quit)
+      break;
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    pool_run_slice(p, index);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->pending == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static int
+pool_cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int)n;
+}
+
+/* Start a pool of nthreads threads in total, including the caller. A
+   worker that cannot be started shrinks the pool, down to the caller
+   alone, rather than failing it. */
+static int
+pool_init(pool *p, int nthreads) {
+  memset(p, 0, sizeof(*p));
+  p->nthreads = nthreads < 1 ? 1 : nthreads;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  p->threads = calloc(p->nthreads, sizeof(pthread_t));
+  if (!p->threads) {
+    fprintf(stderr, "Unable to allocate %d worker threads\n",
+            p->nthreads - 1);
+    p->nthreads = 1;
+  }
+  for (int i = 1; i < p->nthreads; i++) {
+    pool_worker *w = malloc(sizeof(*w));
+    if (w) {
+      w->p = p;
+      w->index = i;
+    }
+    if (!w
+        || pthread_create(&p->threads[i], NULL, pool_worker_main, w) != 0) {
+      fprintf(stderr, "Unable to start worker thread %d\n", i);
+      free(w);
+      p->nthreads = i;
+      break;
+    }
+  }
+
+  return 1;
+}
+
+static void
+pool_free(pool *p) {
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 1; i < p->nthreads; i++)
+    pthread_join(p->threads[i], NULL);
+
+  free(p->threads);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+}
+
+/* Run task over [0, n) and wait for it to finish. Slice boundaries are
+   multiples of grain, so a task never has to deal with a partial SIMD
+   block or share a cache line with a neighbouring slice. */
+static void
+pool_run(pool *p, pool_task task, void *arg, int n, int grain) {
+  int blocks = (n + grain - 1) / grain;
+  int workers = blocks < p->nthreads ? blocks : p->nthreads;
+
+  if (workers <= 1) {
+    p->slice = 0;
+    if (n > 0)
+      task(arg, 0, n);
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->task = task;
+  p->arg = arg;
+  p->n = n;
+  p->slice = (blocks + workers - 1) / workers * grain;
+  p->pending = p->nthreads - 1;
+  p->generation++;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  pool_run_slice(p, 0);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->pending > 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* The index of the slice that starts at `begin` during pool_run, for
+   tasks that keep something per slice. */
+static __attribute__((unused)) int
+pool_slice(const pool *p, int begin) {
+  return p->slice > 0 ? begin / p->slice : 0;
+}
@@ -0,0 +1,274 @@
+/* Frame phase instrumentation, turned on with --profile 1 or --trace.
+
+   Each phase of a frame is timed on the CPU and, when it runs on the
+   render thread, on the GPU with a GL_TIME_ELAPSED query around the
+   same commands. Results of a query only arrive once the GPU gets
+   there, so there are two sets of queries used on alternate frames:
+   the set a frame reuses was issued two frames earlier and is normally
+   complete by then, and reading it does not stall the pipeline.
+
+   Durations go into histograms with quarter-octave buckets, which are
+   summarized at exit, and optionally into a Chrome trace (the JSON
+   format chrome://tracing and Perfetto load) with the render thread,
+   the simulation thread and the GPU as separate tracks.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define PROFILE_PHASES(X)                       \
+  X(INTEGRATE, integrate)                       \
+  X(UPLOAD, upload)                             \
+  X(INDEX, index)                               \
+  X(DRAW, draw)                                 \
+  X(SWAP, swap)                                 \
+  X(CAPTURE, capture)                           \
+  X(FRAME, frame)
+
+typedef enum {
+#define PROFILE_ENUM(NAME, name) PROFILE_##NAME,
+  PROFILE_PHASES(PROFILE_ENUM)
+#undef PROFILE_ENUM
+  PROFILE_PHASE_COUNT
+} profile_phase;
+
+static const char *const profile_phase_names[] = {
+#define PROFILE_NAME(NAME, name) #name,
+  PROFILE_PHASES(PROFILE_NAME)
+#undef PROFILE_NAME
+};
+
+/* Trace tracks. */
+enum {PROFILE_RENDER_THREAD = 1, PROFILE_SIM_THREAD, PROFILE_GPU};
+
+/* Quarter octaves from 1 us up to about 16 s. */
+#define PROFILE_BUCKETS 96
+
+typedef struct {
+  unsigned long count;
+  double total, max;
+  unsigned long buckets[PROFILE_BUCKETS];
+} profile_histogram;
+
+typedef struct {
+  bool enabled;
+  double origin;
+
+  FILE *trace;
+  unsigned long events;
+  pthread_mutex_t trace_lock;
+
+  profile_histogram cpu[PROFILE_PHASE_COUNT];
+  profile_histogram gpu[PROFILE_PHASE_COUNT];
+  double started[PROFILE_PHASE_COUNT];
+
+  /* GPU timing, once there is a context. The whole frame is not
+     measured there: time elapsed queries cannot nest. */
+  bool gl;
+  int set;
+  GLuint queries[2][PROFILE_PHASE_COUNT];
+  bool pending[2][PROFILE_PHASE_COUNT];
+  double issued[2][PROFILE_PHASE_COUNT];
+} profiler;
+
+static double
+profile_now(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Nothing is measured unless `enabled` or a `trace` file is given. */
+static int
+profile_init(profiler *p, bool enabled, const char *trace) {
+  memset(p, 0, sizeof(*p));
+  p->enabled = enabled || trace;
+  p->origin = profile_now();
+  if (!trace)
+    return 1;
+
+  p->trace = fopen(trace, "w");
+  if (!p->trace) {
+    fprintf(stderr, "Unable to open %s for writing\n", trace);
+    return 0;
+  }
+  pthread_mutex_init(&p->trace_lock, NULL);
+  fprintf(p->trace, "{\"traceEvents\":[\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"render\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"simulation\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"gpu\"}}",
+          PROFILE_RENDER_THREAD, PROFILE_SIM_THREAD, PROFILE_GPU);
+  return 1;
+}
+
+/* Create the timer queries; needs a current context. */
+static void
+profile_init_gl(profiler *p) {
+  if (!p->enabled)
+    return;
+  glGenQueries(2 * PROFILE_PHASE_COUNT, &p->queries[0][0]);
+  p->gl = true;
+}
+
+static void
+profile_histogram_add(profile_histogram *h, double seconds) {
+  double us = seconds * 1e6;
+  int bucket = us > 1.0 ? (int)(4.0 * log2(us)) : 0;
+
+  if (bucket >= PROFILE_BUCKETS)
+    bucket = PROFILE_BUCKETS - 1;
+  h->buckets[bucket]++;
+  h->count++;
+  h->total += seconds;
+  if (seconds > h->max)
+    h->max = seconds;
+}
+
+/* Upper bound of the bucket holding quantile `q`, in seconds. */
+static double
+profile_histogram_quantile(const profile_histogram *h, double q) {
+  unsigned long seen = 0;
+
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > 0 && seen >= q * h->count) {
+      double bound = exp2((i + 1) / 4.0) * 1e-6;
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void
+profile_event(profiler *p, profile_phase phase, int track, double start,
+              double seconds) {
+  pthread_mutex_lock(&p->trace_lock);
+  fprintf(p->trace, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+          "\"ts\":%.3f,\"dur\":%.3f}", profile_phase_names[phase], track,
+          (start - p->origin) * 1e6, seconds * 1e6);
+  p->events++;
+  pthread_mutex_unlock(&p->trace_lock);
+}
+
+/* Record a phase timed on the CPU by the caller, from any thread; each
+   phase must only ever be recorded from one. */
+static void
+profile_span(profiler *p, profile_phase phase, int track, double start,
+             double end) {
+  if (!p->enabled)
+    return;
+  profile_histogram_add(&p->cpu[phase], end - start);
+  if (p->trace)
+    profile_event(p, phase, track, start, end - start);
+}
+
+/* Read back the queries of `set`, waiting for any still in flight. */
+static void
+profile_collect(profiler *p, int set) {
+  for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+    GLuint64 ns;
+    double seconds;
+
+    if (!p->pending[set][i])
+      continue;
+    glGetQueryObjectui64v(p->queries[set][i], GL_QUERY_RESULT, &ns);
+    p->pending[set][i] = false;
+    seconds = ns * 1e-9;
+    /* Some drivers (llvmpipe among them) answer the first query of a
+       context with garbage; nothing can take longer than the program
+       has been running. */
+    if (seconds > profile_now() - p->origin)
+      continue;
+    profile_histogram_add(&p->gpu[i], seconds);
+    if (p->trace)
+      profile_event(p, i, PROFILE_GPU, p->issued[set][i], seconds);
+  }
+}
+
+/* Start timing a phase on the render thread. Starting a frame switches
+   to the other set of queries, collecting what it measured before. */
+static void
+profile_begin(profiler *p, profile_phase phase) {
+  if (!p->enabled)
+    return;
+  p->started[phase] = profile_now();
+  if (!p->gl)
+    return;
+  if (phase == PROFILE_FRAME) {
+    p->set = 1 - p->set;
+    profile_collect(p, p->set);
+    return;
+  }
+  glBeginQuery(GL_TIME_ELAPSED, p->queries[p->set][phase]);
+  p->issued[p->set][phase] = p->started[phase];
+}
+
+static void
+profile_end(profiler *p, profile_phase phase) {
+  if (!p->enabled)
+    return;
+  if (p->gl && phase != PROFILE_FRAME) {
+    glEndQuery(GL_TIME_ELAPSED);
+    p->pending[p->set][phase] = true;
+  }
+  profile_span(p, phase, PROFILE_RENDER_THREAD, p->started[phase],
+               profile_now());
+}
+
+/* Collect the last frames' queries and release them, before the
+   context goes away. */
+static void
+profile_finish_gl(profiler *p) {
+  if (!p->gl)
+    return;
+  profile_collect(p, 0);
+  profile_collect(p, 1);
+  glDeleteQueries(2 * PROFILE_PHASE_COUNT, &p->queries[0][0]);
+  p->gl = false;
+}
+
+/* Print a summary of every phase measured, in milliseconds. */
+static void
+profile_report(const profiler *p, FILE *f) {
+  if (!p->enabled)
+    return;
+  fprintf(f, "%-9s %7s %8s %8s %8s %8s %8s %9s %8s %8s\n", "phase", "count",
+          "cpu mean", "p50", "p90", "p99", "max", "gpu mean", "p50", "p99");
+  for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+    const profile_histogram *c = &p->cpu[i], *g = &p->gpu[i];
+
+    if (c->count == 0)
+      continue;
+    fprintf(f, "%-9s %7lu %8.3f %8.3f %8.3f %8.3f %8.3f",
+            profile_phase_names[i], c->count, 1e3 * c->total / c->count,
+            1e3 * profile_histogram_quantile(c, 0.5),
+            1e3 * profile_histogram_quantile(c, 0.9),
+            1e3 * profile_histogram_quantile(c, 0.99), 1e3 * c->max);
+    if (g->count > 0)
+      fprintf(f, " %9.3f %8.3f %8.3f", 1e3 * g->total / g->count,
+              1e3 * profile_histogram_quantile(g, 0.5),
+              1e3 * profile_histogram_quantile(g, 0.99));
+    fputc('\n', f);
+  }
+}
+
+/* Finish the trace file. Returns 0 if it could not be written. */
+static int
+profile_close(profiler *p) {
+  int ok;
+
+  if (!p->trace)
+    return 1;
+  fprintf(p->trace, "\n]}\n");
+  ok = !ferror(p->trace);
+  ok = fclose(p->trace) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing trace\n");
+  pthread_mutex_destroy(&p->trace_lock);
+  p->trace = NULL;
+  return ok;
+}
@@ -0,0 +1,442 @@
+/* Trajectory recordings.
+
+   A recording is a header page followed by fixed-size chunks. Every
+   chunk holds up to `steps_per_chunk` consecutive steps, and every step
+   is the state of all `count` trajectories as x, y, z floats, laid out
+   exactly like one slot of the tail ring. Chunks are padded to a whole
+   number of pages so each one can be mapped on its own, and because
+   they all have the same size the chunk holding any step is found with
+   arithmetic alone. Closing the file adds an index of chunk offsets
+   and fills in the totals in the header.
+
+   All fields are stored in the byte order of the machine that wrote
+   them; `byte_order` lets a reader detect a mismatch.
+
+   Writing is double-buffered: the simulation fills one chunk while a
+   background thread writes out the other with a single pwrite().
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC "LRZTRAJ1"
+#define RECORD_VERSION 2
+#define RECORD_BYTE_ORDER 0x01020304u
+#define RECORD_PAGE 4096
+/* Chunks default to about this many bytes. */
+#define RECORD_CHUNK_BYTES (4 << 20)
+
+#define RECORD_HAS_INDEX 1u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t byte_order;
+  uint32_t count;
+  uint32_t steps_per_chunk;
+  uint32_t flags;
+  uint64_t chunk_bytes;
+  uint64_t chunk_count;
+  uint64_t total_steps;
+  uint64_t index_offset;
+  float dt;
+  uint32_t system;
+  /* All of the system's parameters, the defaults filled in. */
+  double params[SYSTEM_MAX_PARAMS];
+} record_header;
+
+typedef struct {
+  uint64_t first_step;
+  uint32_t steps;
+  uint32_t reserved;
+} record_chunk;
+
+typedef struct {
+  uint64_t first_step;
+  uint64_t offset;
+} record_index_entry;
+
+typedef struct {
+  int fd;
+  record_header header;
+  size_t step_bytes;
+
+  unsigned char *chunks[2];
+  int filling;
+  uint32_t filled;
+  uint64_t next_step;
+
+  uint64_t *index;
+  size_t index_capacity;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  /* Chunk waiting for the writer, or -1. */
+  int pending;
+  uint64_t pending_number;
+  bool done;
+  bool failed;
+} recorder;
+
+static uint64_t
+record_chunk_offset(const record_header *h, uint64_t chunk) {
+  return h->header_size + chunk * h->chunk_bytes;
+}
+
+/* Bytes a chunk of `steps_per_chunk` steps of `count` states takes on
+   disk: the chunk header and the states, padded to whole pages. */
+static uint64_t
+record_chunk_bytes(uint32_t count, uint32_t steps_per_chunk) {
+  return (sizeof(record_chunk)
+          + (uint64_t)steps_per_chunk * count * 3 * sizeof(float)
+          + RECORD_PAGE - 1) / RECORD_PAGE * RECORD_PAGE;
+}
+
+static bool
+write_all(int fd, const void *data, size_t size, uint64_t offset) {
+  const unsigned char *p = data;
+
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static void *
+recorder_writer_main(void *arg) {
+  recorder *r = arg;
+
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    int chunk;
+    uint64_t number;
+
+    while (r->pending < 0 && !r->done)
+      pthread_cond_wait(&r->changed, &r->lock);
+    if (r->pending < 0)
+      break;
+    chunk = r->pending;
+    number = r->pending_number;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!write_all(r->fd, r->chunks[chunk], r->header.chunk_bytes,
+                   record_chunk_offset(&r->header, number))) {
+      perror("Recording");
+      r->failed = true;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->pending = -1;
+    pthread_cond_broadcast(&r->changed);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  return NULL;
+}
+
+static bool
+recorder_write_header(recorder *r) {
+  unsigned char page[RECORD_PAGE] = {0};
+
+  memcpy(page, &r->header, sizeof(r->header));
+  return write_all(r->fd, page, sizeof(page), 0);
+}
+
+/* Pick up the recording in `r->fd` where it holds `steps` steps, for a
+   run restored from a checkpoint: keep the whole chunks before that
+   point, load the partial chunk after them to go on filling, and cut
+   off anything recorded later. The chunk geometry is the file's. */
+static int
+recorder_resume(recorder *r, const char *filename, uint64_t steps) {
+  record_header *h = &r->header, old;
+  struct stat st;
+  uint64_t whole;
+  uint32_t partial;
+
+  if (pread(r->fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old)
+      || fstat(r->fd, &st) != 0
+      || memcmp(old.magic, RECORD_MAGIC, sizeof(old.magic)) != 0
+      || old.version != RECORD_VERSION || old.byte_order != h->byte_order
+      || old.count != h->count || old.system != h->system
+      || old.dt != h->dt || old.steps_per_chunk == 0
+      || old.chunk_bytes != record_chunk_bytes(old.count,
+                                               old.steps_per_chunk)) {
+    fprintf(stderr, "%s is not a recording of this run\n", filename);
+    return 0;
+  }
+  h->steps_per_chunk = old.steps_per_chunk;
+  h->chunk_bytes = old.chunk_bytes;
+  whole = steps / h->steps_per_chunk;
+  partial = steps % h->steps_per_chunk;
+  if ((uint64_t)st.st_size < record_chunk_offset(h, whole + (partial > 0))) {
+    fprintf(stderr, "%s ends before step %llu of the checkpoint\n",
+            filename, (unsigned long long)steps);
+    return 0;
+  }
+
+  r->index_capacity = whole + 64;
+  r->index = malloc(r->index_capacity * sizeof(uint64_t));
+  if (!r->index) {
+    fprintf(stderr, "Unable to allocate the recording index\n");
+    return 0;
+  }
+  for (uint64_t i = 0; i < whole; i++)
+    r->index[i] = i * h->steps_per_chunk;
+
+  if (partial > 0) {
+    const record_chunk *chunk = (const record_chunk *)r->chunks[0];
+    ssize_t n = pread(r->fd, r->chunks[0], h->chunk_bytes,
+                      record_chunk_offset(h, whole));
+    if (n != (ssize_t)h->chunk_bytes
+        || chunk->first_step != whole * h->steps_per_chunk
+        || chunk->steps < partial) {
+      fprintf(stderr, "%s ends before step %llu of the checkpoint\n",
+              filename, (unsigned long long)steps);
+      return 0;
+    }
+  }
+  if (ftruncate(r->fd, record_chunk_offset(h, whole)) != 0) {
+    perror("Recording");
+    return 0;
+  }
+  h->chunk_count = whole;
+  r->filling = 0;
+  r->filled = partial;
+  r->next_step = steps;
+  return 1;
+}
+
+/* steps_per_chunk of 0 picks a size of about RECORD_CHUNK_BYTES. With
+   `resume` of 0 or more the existing file is kept up to that step and
+   appended to, as recorder_resume describes. */
+static int
+recorder_open(recorder *r, const char *filename, int count, float dt,
+              system_id system, const double *params,
+              int steps_per_chunk, bool with_index, long resume) {
+  record_header *h = &r->header;
+
+  memset(r, 0, sizeof(*r));
+  r->pending = -1;
+  r->step_bytes = (size_t)count * 3 * sizeof(float);
+  if (steps_per_chunk <= 0) {
+    steps_per_chunk = RECORD_CHUNK_BYTES / r->step_bytes;
+    if (steps_per_chunk < 1)
+      steps_per_chunk = 1;
+  }
+
+  memcpy(h->magic, RECORD_MAGIC, sizeof(h->magic));
+  h->version = RECORD_VERSION;
+  h->header_size = RECORD_PAGE;
+  h->byte_order = RECORD_BYTE_ORDER;
+  h->count = count;
+  h->steps_per_chunk = steps_per_chunk;
+  h->flags = with_index ? RECORD_HAS_INDEX : 0;
+  h->chunk_bytes = record_chunk_bytes(count, steps_per_chunk);
+  h->dt = dt;
+  h->system = system;
+  memcpy(h->params, params, sizeof(h->params));
+
+  r->fd = resume < 0 ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+    : open(filename, O_RDWR);
+  if (r->fd < 0) {
+    fprintf(stderr, "Unable to open %s for writing\n", filename);
+    return 0;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    r->chunks[i] = alloc_aligned(h->chunk_bytes);
+    if (!r->chunks[i]) {
+      fprintf(stderr, "Unable to allocate recording buffers\n");
+      goto fail;
+    }
+  }
+  if (resume >= 0 && !recorder_resume(r, filename, resume))
+    goto fail;
+
+  /* Written again with the totals on close; until then readers can
+     still find the chunks from the file size. */
+  if (!recorder_write_header(r)) {
+    perror("Recording");
+    goto fail;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->changed, NULL);
+  if (pthread_create(&r->writer, NULL, recorder_writer_main, r) != 0) {
+    fprintf(stderr, "Unable to start recording thread\n");
+    pthread_cond_destroy(&r->changed);
+    pthread_mutex_destroy(&r->lock);
+    goto fail;
+  }
+
+  return 1;
+
+ fail:
+  close(r->fd);
+  free(r->chunks[0]);
+  free(r->chunks[1]);
+  free(r->index);
+  memset(r, 0, sizeof(*r));
+  return 0;
+}
+
+/* Fill in the header of the chunk being filled. */
+static void
+recorder_seal(recorder *r) {
+  record_chunk *chunk = (record_chunk *)r->chunks[r->filling];
+
+  chunk->first_step = r->next_step - r->filled;
+  chunk->steps = r->filled;
+  /* Keep the unused part of a final, partial chunk deterministic. */
+  if (r->filled < r->header.steps_per_chunk) {
+    unsigned char *end = r->chunks[r->filling] + sizeof(record_chunk)
+      + r->filled * r->step_bytes;
+    memset(end, 0, r->chunks[r->filling] + r->header.chunk_bytes - end);
+  }
+}
+
+/* Hand the chunk being filled to the writer and start on the other
+   one, waiting only if the writer is still busy with it. */
+static void
+recorder_flush(recorder *r) {
+  record_chunk *chunk = (record_chunk *)r->chunks[r->filling];
+  uint64_t number = r->header.chunk_count;
+
+  if (r->filled == 0)
+    return;
+
+  recorder_seal(r);
+
+  if (number == r->index_capacity) {
+    size_t capacity = r->index_capacity ? 2 * r->index_capacity : 64;
+    uint64_t *index = realloc(r->index, capacity * sizeof(uint64_t));
+
+    /* Drop the chunk rather than lose track of the ones before it. */
+    if (!index) {
+      fprintf(stderr, "Unable to grow the recording index\n");
+      pthread_mutex_lock(&r->lock);
+      r->failed = true;
+      pthread_mutex_unlock(&r->lock);
+      r->filled = 0;
+      return;
+    }
+    r->index = index;
+    r->index_capacity = capacity;
+  }
+  r->index[number] = chunk->first_step;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->pending >= 0)
+    pthread_cond_wait(&r->changed, &r->lock);
+  r->pending = r->filling;
+  r->pending_number = number;
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+
+  r->header.chunk_count++;
+  r->filling = 1 - r->filling;
+  r->filled = 0;
+}
+
+/* Get the file up to date for a checkpoint: wait for the writer, then
+   write the chunk being filled to its place ourselves and go on
+   filling it. Returns 0 if anything could not be written. */
+static int
+recorder_sync(recorder *r) {
+  bool ok;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->pending >= 0)
+    pthread_cond_wait(&r->changed, &r->lock);
+  ok = !r->failed;
+  pthread_mutex_unlock(&r->lock);
+
+  if (ok && r->filled > 0) {
+    recorder_seal(r);
+    ok = write_all(r->fd, r->chunks[r->filling], r->header.chunk_bytes,
+                   record_chunk_offset(&r->header, r->header.chunk_count));
+    if (!ok) {
+      perror("Recording");
+      pthread_mutex_lock(&r->lock);
+      r->failed = true;
+      pthread_mutex_unlock(&r->lock);
+    }
+  }
+  return ok;
+}
+
+/* Append `steps` consecutive states of every trajectory. */
+static void
+recorder_append(recorder *r, const vec3 *states, int steps) {
+  while (steps > 0) {
+    uint32_t room = r->header.steps_per_chunk - r->filled;
+    uint32_t n = (uint32_t)steps < room ? (uint32_t)steps : room;
+
+    memcpy(r->chunks[r->filling] + sizeof(record_chunk)
+           + r->filled * r->step_bytes,
+           states, n * r->step_bytes);
+    states += (size_t)n * r->header.count;
+    steps -= n;
+    r->filled += n;
+    r->next_step += n;
+
+    if (r->filled == r->header.steps_per_chunk)
+      recorder_flush(r);
+  }
+}
+
+/* Write out what is left, the index and the final header. */
+static int
+recorder_close(recorder *r) {
+  record_header *h = &r->header;
+  bool ok;
+
+  recorder_flush(r);
+
+  pthread_mutex_lock(&r->lock);
+  r->done = true;
+  pthread_cond_broadcast(&r->changed);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->writer, NULL);
+  ok = !r->failed;
+
+  h->total_steps = r->next_step;
+  if (h->flags & RECORD_HAS_INDEX) {
+    size_t size = h->chunk_count * sizeof(record_index_entry);
+    record_index_entry *entries = malloc(size ? size : 1);
+
+    for (uint64_t i = 0; entries && i < h->chunk_count; i++) {
+      entries[i].first_step = r->index[i];
+      entries[i].offset = record_chunk_offset(h, i);
+    }
+    h->index_offset = record_chunk_offset(h, h->chunk_count);
+    ok = ok && entries && write_all(r->fd, entries, size, h->index_offset);
+    free(entries);
+  }
+
+  ok = ok && recorder_write_header(r);
+  ok = close(r->fd) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Recording is incomplete\n");
+
+  pthread_cond_destroy(&r->changed);
+  pthread_mutex_destroy(&r->lock);
+  free(r->chunks[0]);
+  free(r->chunks[1]);
+  free(r->index);
+
+  return ok;
+}
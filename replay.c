@@ -0,0 +1,174 @@
+/* Playback of recordings made with --record.
+
+   The whole file is mapped read-only, so opening even a very large
+   recording costs nothing up front and the states of a step are read
+   straight out of the page cache: replay_step() returns a pointer into
+   the mapping that can be handed to the GPU upload as it is.
+*/
+
+#include <sys/mman.h>
+
+typedef struct {
+  int fd;
+  const unsigned char *base;
+  size_t size;
+
+  record_header header;
+  const record_index_entry *index;
+  uint64_t chunks;
+  uint64_t total_steps;
+} replay;
+
+static const record_chunk *
+replay_chunk(const replay *p, uint64_t chunk) {
+  return (const record_chunk *)(p->base
+                                + record_chunk_offset(&p->header, chunk));
+}
+
+static void
+replay_close(replay *p) {
+  if (p->base)
+    munmap((void *)p->base, p->size);
+  if (p->fd >= 0)
+    close(p->fd);
+  p->base = NULL;
+  p->fd = -1;
+}
+
+static int
+replay_open(replay *p, const char *filename) {
+  struct stat st;
+  record_header *h = &p->header;
+  uint64_t step_bytes, room, i;
+
+  memset(p, 0, sizeof(*p));
+  p->fd = open(filename, O_RDONLY);
+  if (p->fd < 0 || fstat(p->fd, &st) != 0) {
+    fprintf(stderr, "Unable to open %s for reading\n", filename);
+    goto fail;
+  }
+  p->size = st.st_size;
+  if (p->size < RECORD_PAGE) {
+    fprintf(stderr, "%s is not a trajectory recording\n", filename);
+    goto fail;
+  }
+
+  p->base = mmap(NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0);
+  if (p->base == MAP_FAILED) {
+    p->base = NULL;
+    perror("mmap");
+    goto fail;
+  }
+  posix_madvise((void *)p->base, p->size, POSIX_MADV_SEQUENTIAL);
+
+  /* Everything below is checked against the size of the file before
+     any chunk is touched, so a damaged header cannot send a read past
+     the end of the mapping. */
+  memcpy(h, p->base, sizeof(*h));
+  step_bytes = (uint64_t)h->count * 3 * sizeof(float);
+  if (memcmp(h->magic, RECORD_MAGIC, sizeof(h->magic)) != 0
+      || h->version != RECORD_VERSION || h->header_size != RECORD_PAGE
+      || h->count == 0 || h->steps_per_chunk == 0
+      || h->chunk_bytes == 0
+      || h->steps_per_chunk > h->chunk_bytes / step_bytes
+      || h->chunk_bytes != record_chunk_bytes(h->count,
+                                              h->steps_per_chunk)) {
+    fprintf(stderr, "%s is not a trajectory recording\n", filename);
+    goto fail;
+  }
+  if (h->byte_order != RECORD_BYTE_ORDER) {
+    fprintf(stderr, "%s was recorded with a different byte order\n",
+            filename);
+    goto fail;
+  }
+  room = (p->size - h->header_size) / h->chunk_bytes;
+
+  if (h->chunk_count > 0) {
+    if (h->chunk_count > room
+        || h->total_steps > h->chunk_count * h->steps_per_chunk) {
+      fprintf(stderr, "%s is truncated\n", filename);
+      goto fail;
+    }
+    p->chunks = h->chunk_count;
+    p->total_steps = h->total_steps;
+    if ((h->flags & RECORD_HAS_INDEX) && h->index_offset <= p->size
+        && p->chunks <= (p->size - h->index_offset)
+                        / sizeof(record_index_entry))
+      p->index = (const record_index_entry *)(p->base + h->index_offset);
+  }
+  else {
+    /* Never closed: recover what made it to disk. Chunks are written
+       in order, each starting a whole chunk of steps after the last. */
+    p->chunks = room;
+    if (p->chunks > 0) {
+      const record_chunk *last = replay_chunk(p, p->chunks - 1);
+      if (last->first_step != (p->chunks - 1) * h->steps_per_chunk
+          || last->steps > h->steps_per_chunk) {
+        fprintf(stderr, "%s is damaged\n", filename);
+        goto fail;
+      }
+      p->total_steps = last->first_step + last->steps;
+    }
+  }
+  if (p->total_steps == 0) {
+    fprintf(stderr, "%s holds no steps\n", filename);
+    goto fail;
+  }
+
+  /* replay_find_chunk() searches the index, so it must be in order and
+     agree with where the chunks are. */
+  for (i = 0; p->index && i < p->chunks; i++) {
+    const record_index_entry *e = &p->index[i];
+    uint64_t next = i + 1 < p->chunks ? e[1].first_step : p->total_steps;
+    if (e->offset != record_chunk_offset(h, i) || e->first_step >= next
+        || next - e->first_step > h->steps_per_chunk
+        || (i == 0 && e->first_step != 0)) {
+      fprintf(stderr, "%s has a damaged index\n", filename);
+      goto fail;
+    }
+  }
+
+  return 1;
+
+ fail:
+  replay_close(p);
+  return 0;
+}
+
+/* Find the chunk holding `step`, by the index when there is one. */
+static uint64_t
+replay_find_chunk(const replay *p, uint64_t step) {
+  uint64_t lo = 0, hi = p->chunks;
+
+  if (!p->index)
+    return step / p->header.steps_per_chunk;
+
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (p->index[mid].first_step <= step)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* States of all trajectories at `step`, which must be below
+   total_steps. `*run` receives how many following steps are stored
+   contiguously after it. */
+static const vec3 *
+replay_step(const replay *p, uint64_t step, uint64_t *run) {
+  uint64_t number = replay_find_chunk(p, step);
+  const record_chunk *chunk = replay_chunk(p, number);
+  uint64_t steps = p->header.steps_per_chunk;
+  uint64_t offset = step - (p->index ? p->index[number].first_step
+                                     : number * steps);
+
+  /* The chunk's own count is only trusted as far as it fits. */
+  if (chunk->steps < steps)
+    steps = chunk->steps;
+  if (run)
+    *run = steps > offset ? steps - offset : 1;
+  return (const vec3 *)((const unsigned char *)(chunk + 1)
+                        + offset * p->header.count * sizeof(vec3));
+}
@@ -0,0 +1,47 @@
+/* The original single-trajectory integrator for the Lorenz system with
+   its classic parameters. Nothing in the program steps with it any
+   more; it stays as the scalar baseline the batch kernels are measured
+   against in microbench. */
+
+static vec3
+lorenz(vec3 state) {
+  vec3 result;
+
+  /*
+    x' = 10(y-x)
+    y' = 28x - y - xz
+    z' = (-8/3)z + xy
+  */
+
+  result.x = SIGMA * (state.y - state.x);
+  result.y = RHO*state.x - state.y - state.x*state.z;
+  result.z = BETA*state.z + state.x*state.y;
+
+  return result;
+}
+
+static vec3
+rk4_weighted_avg(vec3 a, vec3 b, vec3 c, vec3 d) {
+  vec3 result;
+
+  result.x = (a.x + 2*b.x + 2*c.x + d.x) / 6.0;
+  result.y = (a.y + 2*b.y + 2*c.y + d.y) / 6.0;
+  result.z = (a.z + 2*b.z + 2*c.z + d.z) / 6.0;
+
+  return result;
+}
+
+/* Compute next step of autonomous differential equation. */
+static vec3
+rk4(vec3 current, float dt) {
+  vec3 k1 = lorenz(current);
+  vec3 k2 = lorenz(vec3_add(current, vec3_scale(dt/2, k1)));
+  vec3 k3 = lorenz(vec3_add(current, vec3_scale(dt/2, k2)));
+  vec3 k4 = lorenz(vec3_add(current, vec3_scale(dt, k3)));
+
+  vec3 k = rk4_weighted_avg(k1, k2, k3, k4);
+
+  vec3 result = vec3_add(current, vec3_scale(dt, k));
+
+  return result;
+}
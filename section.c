@@ -0,0 +1,438 @@
+/* Poincaré sections, turned on with --section FILE.
+
+   After every step each trajectory's signed distance from the plane
+   n . x = d is compared with its distance before the step. The
+   distances live in one array like the state, and the comparison runs
+   on BATCH_WIDTH lanes at a time with no branches, over the block of
+   trajectories just stepped while it is still in cache. Only when a
+   lane crossed are the lanes looked at one by one, and only the few
+   trajectories that did go on to have their crossing refined.
+
+   The crossing is found on the cubic Hermite interpolant of the step,
+   built from the states at both ends and the derivatives there, by
+   Newton iterations started from the straight line between the ends.
+   For rk4 that is accurate to the fourth order in dt, like the step
+   itself.
+
+   Crossings are collected per pool slice, then written out as CSV
+   (trajectory, t, x, y, z) and appended, in coordinates on the plane,
+   to a ring that lorenz draws as a 2D plot.
+*/
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum {
+  SECTION_UP, SECTION_DOWN, SECTION_BOTH, SECTION_DIRECTION_COUNT
+} section_direction;
+
+typedef struct {
+  int trajectory;
+  double t;
+  float point[3];
+} section_crossing;
+
+/* A crossing in coordinates on the plane, for plotting. */
+typedef struct {
+  float u, v;
+  int32_t trajectory;
+} section_point;
+
+/* What one pool slice found during a tick, and whether memory ran out
+   for any of it. */
+typedef struct {
+  section_crossing *crossings;
+  int count, capacity;
+  bool failed;
+} section_slice;
+
+typedef struct section section;
+
+/* Scans trajectories [begin, end) for crossings, several lanes at a
+   time. */
+typedef int (*section_kernel)(section *s, section_slice *sl, const batch *b,
+                              const vec3 *before, int begin, int end,
+                              long step);
+
+struct section {
+  double normal[3], offset;
+  /* Which changes of sign count, as 0 or 1. */
+  int up, down;
+  /* Unit vectors spanning the plane. */
+  double axes[2][3];
+
+  system_derivative derivative;
+  double params[SYSTEM_MAX_PARAMS];
+  double dt;
+
+  /* Signed distance from the plane of every trajectory after the last
+     step. */
+  float *distance;
+  section_slice *slices;
+  int slice_count;
+
+  FILE *file;
+  const char *filename;
+  unsigned long total;
+
+  /* The newest crossings as a ring of plot_length points; the next one
+     goes to slot plot_total % plot_length. */
+  section_point *plot;
+  int plot_length;
+  long plot_total;
+
+  section_kernel scan;
+};
+
+/* Pick two unit vectors perpendicular to the normal and to each other,
+   starting from the coordinate axis furthest from the normal. */
+static void
+section_make_axes(section *s) {
+  const double *n = s->normal;
+  double *u = s->axes[0], *v = s->axes[1];
+  double a[3] = {0, 0, 0}, dot, length;
+  int least = 0;
+
+  for (int j = 1; j < 3; j++) {
+    if (fabs(n[j]) < fabs(n[least]))
+      least = j;
+  }
+  a[least] = 1;
+  dot = a[0]*n[0] + a[1]*n[1] + a[2]*n[2];
+  for (int j = 0; j < 3; j++)
+    u[j] = a[j] - dot * n[j];
+  length = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+  for (int j = 0; j < 3; j++)
+    u[j] /= length;
+  v[0] = n[1]*u[2] - n[2]*u[1];
+  v[1] = n[2]*u[0] - n[0]*u[2];
+  v[2] = n[0]*u[1] - n[1]*u[0];
+}
+
+static void
+section_free(section *s) {
+  for (int i = 0; s->slices && i < s->slice_count; i++)
+    free(s->slices[i].crossings);
+  free(s->slices);
+  free(s->distance);
+  free(s->plot);
+  if (s->file && s->file != stdout)
+    fclose(s->file);
+  s->file = NULL;
+}
+
+/* Refine the crossing of trajectory c between `before` and `after`, the
+   states at the start and end of step `step`. */
+static section_crossing
+section_refine(const section *s, int c, const vec3 *before,
+               const float after[3], long step) {
+  const double *n = s->normal;
+  double p0[3] = {before->x, before->y, before->z};
+  double p1[3] = {after[0], after[1], after[2]};
+  double f0[3], f1[3], g0 = -s->offset, g1 = -s->offset, h = s->dt;
+  double theta, correction, point[3];
+  section_crossing crossing;
+
+  s->derivative(s->params, p0, f0);
+  s->derivative(s->params, p1, f1);
+  for (int j = 0; j < 3; j++) {
+    g0 += n[j] * p0[j];
+    g1 += n[j] * p1[j];
+  }
+  theta = g0 / (g0 - g1);
+
+  for (int iteration = 0; iteration < 4; iteration++) {
+    double t2 = theta * theta, t3 = t2 * theta;
+    double h00 = 2*t3 - 3*t2 + 1, h10 = t3 - 2*t2 + theta;
+    double h01 = 3*t2 - 2*t3, h11 = t3 - t2;
+    double d00 = 6*t2 - 6*theta, d10 = 3*t2 - 4*theta + 1;
+    double d11 = 3*t2 - 2*theta;
+    double g = -s->offset, slope = 0.0;
+
+    for (int j = 0; j < 3; j++) {
+      point[j] = h00 * p0[j] + h10 * h * f0[j] + h01 * p1[j]
+        + h11 * h * f1[j];
+      g += n[j] * point[j];
+      slope += n[j] * (d00 * (p0[j] - p1[j]) + d10 * h * f0[j]
+                       + d11 * h * f1[j]);
+    }
+    if (slope == 0.0)
+      break;
+    correction = g / slope;
+    theta -= correction;
+    theta = theta < 0.0 ? 0.0 : theta > 1.0 ? 1.0 : theta;
+    if (fabs(correction) < 1e-9)
+      break;
+  }
+
+  {
+    double t2 = theta * theta, t3 = t2 * theta;
+    double h00 = 2*t3 - 3*t2 + 1, h10 = t3 - 2*t2 + theta;
+    double h01 = 3*t2 - 2*t3, h11 = t3 - t2;
+    for (int j = 0; j < 3; j++) {
+      crossing.point[j] = h00 * p0[j] + h10 * h * f0[j] + h01 * p1[j]
+        + h11 * h * f1[j];
+    }
+  }
+  crossing.trajectory = c;
+  crossing.t = (step + theta) * s->dt;
+  return crossing;
+}
+
+/* Refine the crossing of trajectory c during step `step` and add it to
+   slice `sl`. Returns 0 if memory ran out. */
+static int
+section_add(const section *s, section_slice *sl, const batch *b,
+            const vec3 *before, int c, long step) {
+  float after[3] = {b->x[c], b->y[c], b->z[c]};
+
+  if (sl->count == sl->capacity) {
+    int capacity = sl->capacity ? 2 * sl->capacity : 256;
+    section_crossing *grown =
+      realloc(sl->crossings, sizeof(section_crossing) * capacity);
+    if (!grown)
+      return 0;
+    sl->crossings = grown;
+    sl->capacity = capacity;
+  }
+  sl->crossings[sl->count++] = section_refine(s, c, before + c, after,
+                                              step);
+  return 1;
+}
+
+/* Compare the distances of W lanes at a time, as vectors of type T with
+   comparisons giving masks of type M, before and after the step. A
+   lane's mask is nonzero where its trajectory crossed in a direction
+   that counts; the lanes are only looked at one by one if one did. */
+#define SECTION_SCAN_BODY(T, M, W)                                      \
+  for (int c = begin; c < end; c += (W)) {                              \
+    T x, y, z, was, now;                                                \
+    M below, was_below, crossed;                                        \
+    int32_t lanes[W], any = 0;                                          \
+                                                                        \
+    memcpy(&x, b->x + c, sizeof(T));                                    \
+    memcpy(&y, b->y + c, sizeof(T));                                    \
+    memcpy(&z, b->z + c, sizeof(T));                                    \
+    memcpy(&was, s->distance + c, sizeof(T));                           \
+    now = nx * x + ny * y + nz * z - offset;                            \
+    memcpy(s->distance + c, &now, sizeof(T));                           \
+                                                                        \
+    below = now < 0.0f;                                                 \
+    was_below = was < 0.0f;                                             \
+    crossed = (was_below & ~below & up) | (~was_below & below & down);  \
+    memcpy(lanes, &crossed, sizeof(lanes));                             \
+    for (int j = 0; j < (W); j++)                                       \
+      any |= lanes[j];                                                  \
+    if (!any)                                                           \
+      continue;                                                         \
+                                                                        \
+    for (int j = 0; j < (W) && c + j < b->count; j++) {                 \
+      if (lanes[j] && !section_add(s, sl, b, before, c + j, step))      \
+        ok = 0;                                                         \
+    }                                                                   \
+  }
+
+#define SECTION_SCAN_KERNEL(name, T, M, W)                              \
+  static int                                                            \
+  name(section *s, section_slice *sl, const batch *b,                   \
+       const vec3 *before, int begin, int end, long step) {             \
+    float nx = s->normal[0], ny = s->normal[1], nz = s->normal[2];      \
+    float offset = s->offset;                                           \
+    /* All ones or all zeros, to mask the lanes with. */                \
+    int32_t up = -s->up, down = -s->down;                               \
+    int ok = 1;                                                         \
+                                                                        \
+    SECTION_SCAN_BODY(T, M, W)                                          \
+    return ok;                                                          \
+  }
+
+SECTION_SCAN_KERNEL(section_scan_scalar, float, int32_t, 1)
+
+#ifdef HAVE_X86_VECTORS
+typedef int32_t int4 __attribute__((vector_size(16)));
+typedef int32_t int8 __attribute__((vector_size(32)));
+
+__attribute__((target("sse2")))
+SECTION_SCAN_KERNEL(section_scan_sse, float4, int4, 4)
+__attribute__((target("avx2,fma")))
+SECTION_SCAN_KERNEL(section_scan_avx2, float8, int8, 8)
+#endif
+
+/* Pick the widest scan the running CPU supports, as
+   batch_select_kernel does. */
+static section_kernel
+section_select_kernel(void) {
+#ifdef HAVE_X86_VECTORS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return section_scan_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return section_scan_sse;
+#endif
+  return section_scan_scalar;
+}
+
+/* Start looking for crossings of the plane normal . x = offset by the
+   trajectories of `b`, in the directions `direction` allows, from up
+   to `slices` pool slices at once. Crossings are written to `filename`
+   (- for stdout, "" or NULL for nowhere) and the last `plot_length` of
+   them kept for plotting. With `resume` of 0 or more the first `resume`
+   bytes of the file are kept and the crossings appended to them. */
+static int
+section_open(section *s, const char *filename, vec3 normal, float offset,
+             section_direction direction, const batch *b, system_id system,
+             float dt, int slices, int plot_length, long resume) {
+  double length = sqrt((double)normal.x * normal.x
+                       + (double)normal.y * normal.y
+                       + (double)normal.z * normal.z);
+
+  memset(s, 0, sizeof(*s));
+  if (!(length > 0.0)) {
+    fprintf(stderr, "The section plane needs a nonzero normal\n");
+    return 0;
+  }
+  s->normal[0] = normal.x / length;
+  s->normal[1] = normal.y / length;
+  s->normal[2] = normal.z / length;
+  s->offset = offset / length;
+  s->up = direction != SECTION_DOWN;
+  s->down = direction != SECTION_UP;
+  section_make_axes(s);
+
+  s->derivative = system_derivatives[system];
+  for (int i = 0; i < SYSTEM_MAX_PARAMS; i++)
+    s->params[i] = b->params[i];
+  s->dt = dt;
+  s->scan = section_select_kernel();
+
+  s->distance = alloc_aligned(sizeof(float) * b->capacity);
+  s->slices = calloc(slices, sizeof(section_slice));
+  s->slice_count = slices;
+  s->plot_length = plot_length;
+  if (plot_length > 0)
+    s->plot = calloc(plot_length, sizeof(section_point));
+  if (!s->distance || !s->slices || (plot_length > 0 && !s->plot)) {
+    fprintf(stderr, "Unable to allocate section state for %d "
+            "trajectories\n", b->count);
+    section_free(s);
+    return 0;
+  }
+  for (int c = 0; c < b->capacity; c++) {
+    s->distance[c] = s->normal[0] * b->x[c] + s->normal[1] * b->y[c]
+      + s->normal[2] * b->z[c] - s->offset;
+  }
+
+  if (filename && *filename) {
+    s->filename = filename;
+    s->file = strcmp(filename, "-") == 0 ? stdout
+      : fopen(filename, resume < 0 ? "w" : "r+");
+    if (!s->file) {
+      fprintf(stderr, "Unable to open %s for writing\n", filename);
+      section_free(s);
+      return 0;
+    }
+    if (resume >= 0 && s->file != stdout) {
+      struct stat st;
+
+      if (fstat(fileno(s->file), &st) != 0 || st.st_size < resume
+          || ftruncate(fileno(s->file), resume) != 0
+          || fseek(s->file, resume, SEEK_SET) != 0) {
+        fprintf(stderr, "%s ends before the crossings of the checkpoint\n",
+                filename);
+        section_free(s);
+        return 0;
+      }
+    }
+    /* Nothing is kept of a run that wrote to stdout. */
+    if (resume < 0 || (resume == 0 && s->file != stdout))
+      fprintf(s->file, "trajectory,t,x,y,z\n");
+  }
+  return 1;
+}
+
+/* Get the file up to date for a checkpoint, and tell how many bytes
+   are in it so far. Returns 0 if it could not be written. */
+static int
+section_sync(section *s, uint64_t *bytes) {
+  long end;
+
+  *bytes = 0;
+  if (!s->file)
+    return 1;
+  if (fflush(s->file) != 0 || ferror(s->file)) {
+    fprintf(stderr, "Error writing %s\n", s->filename);
+    return 0;
+  }
+  /* Standard output is only ever appended to. */
+  end = s->file == stdout ? 0 : ftell(s->file);
+  if (end < 0) {
+    perror(s->filename);
+    return 0;
+  }
+  *bytes = end;
+  return 1;
+}
+
+/* Look for crossings by trajectories [begin, end) of `b`, a multiple
+   of BATCH_WIDTH, during step `step`, which started from the states in
+   `before`, and add them to slice `slice`. Padding lanes are skipped.
+   Returns 0 if memory ran out and a crossing was lost; the distances
+   are brought up to date all the same. */
+static int
+section_scan(section *s, int slice, const batch *b, const vec3 *before,
+             int begin, int end, long step) {
+  return s->scan(s, &s->slices[slice], b, before, begin, end, step);
+}
+
+/* Write out and plot what the slices found, and empty them. Returns 0
+   if a slice lost crossings since the last flush. */
+static int
+section_flush(section *s) {
+  int ok = 1;
+
+  for (int i = 0; i < s->slice_count; i++) {
+    section_slice *sl = &s->slices[i];
+
+    ok = ok && !sl->failed;
+    sl->failed = false;
+
+    for (int k = 0; k < sl->count; k++) {
+      const section_crossing *c = &sl->crossings[k];
+
+      if (s->file)
+        fprintf(s->file, "%d,%.9g,%.9g,%.9g,%.9g\n", c->trajectory, c->t,
+                c->point[0], c->point[1], c->point[2]);
+      if (s->plot) {
+        section_point *p = &s->plot[s->plot_total % s->plot_length];
+        p->u = s->axes[0][0] * c->point[0] + s->axes[0][1] * c->point[1]
+          + s->axes[0][2] * c->point[2];
+        p->v = s->axes[1][0] * c->point[0] + s->axes[1][1] * c->point[1]
+          + s->axes[1][2] * c->point[2];
+        p->trajectory = c->trajectory;
+        s->plot_total++;
+      }
+    }
+    s->total += sl->count;
+    sl->count = 0;
+  }
+  return ok;
+}
+
+/* Finish the file. Returns 0 if it could not be written. */
+static int
+section_close(section *s) {
+  int ok = 1;
+
+  if (s->file) {
+    ok = !ferror(s->file);
+    if (s->file != stdout)
+      ok = fclose(s->file) == 0 && ok;
+    else
+      ok = fflush(s->file) == 0 && ok;
+    s->file = NULL;
+    if (!ok)
+      fprintf(stderr, "Error writing %s\n", s->filename);
+  }
+  section_free(s);
+  return ok;
+}
@@ -0,0 +1,18 @@
+#version 330
+
+/* A section crossing in coordinates on the plane, and the trajectory
+   that made it. */
+in vec2 point;
+in int trajectory;
+
+out vec3 Color;
+
+/* The extent of the points so far, as lower u, v and upper u, v. */
+uniform vec4 bounds;
+uniform samplerBuffer colors;
+
+void main() {
+  vec2 size = max(bounds.zw - bounds.xy, vec2(1e-6));
+  gl_Position = vec4((point - bounds.xy) / size * 1.9 - 0.95, 0.0, 1.0);
+  Color = texelFetch(colors, trajectory).rgb;
+}
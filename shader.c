@@ -0,0 +1,303 @@
+/* Shader sources and the program binary cache.
+
+   Shader files may pull in shared code with `#include "file"`, resolved
+   relative to the including file. Every file gets its own GLSL source
+   string number in the #line directives the preprocessor inserts, so
+   compiler messages of the form "N:LINE" can be traced back to the file
+   listed as N.
+
+   Linked programs are saved to a cache directory with
+   glGetProgramBinary, keyed on a hash of the preprocessed sources and
+   of the driver's vendor, renderer and version strings, and loaded back
+   with glProgramBinary on later runs so nothing has to be compiled.
+   Drivers are free to reject a binary anyway, in which case the program
+   is simply built from source again and the cache entry replaced.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHADER_MAX_FILES 16
+#define PROGRAM_CACHE_MAGIC "LRZPROG1"
+
+typedef struct {
+  char *text;
+  size_t length, capacity;
+  int files;
+  char *names[SHADER_MAX_FILES];
+} shader_source;
+
+typedef struct {
+  char magic[8];
+  uint32_t format;
+  uint32_t length;
+} program_cache_header;
+
+static int
+shader_append(shader_source *s, const char *text, size_t length) {
+  if (s->length + length + 1 > s->capacity) {
+    size_t capacity = s->capacity ? s->capacity : 4096;
+    char *grown;
+
+    while (s->length + length + 1 > capacity)
+      capacity *= 2;
+    grown = realloc(s->text, capacity);
+    if (!grown)
+      return 0;
+    s->text = grown;
+    s->capacity = capacity;
+  }
+  memcpy(s->text + s->length, text, length);
+  s->length += length;
+  s->text[s->length] = '\0';
+  return 1;
+}
+
+static int
+shader_append_line_directive(shader_source *s, int line, int file) {
+  char directive[64];
+  int length = snprintf(directive, sizeof(directive), "#line %d %d\n",
+                        line, file);
+  return shader_append(s, directive, length);
+}
+
+/* If `line` is an #include directive, store the quoted name in `name`
+   and return 1. */
+static int
+shader_parse_include(const char *line, const char *end,
+                     char *name, size_t size) {
+  const char *close;
+
+  while (line < end && (*line == ' ' || *line == '\t'))
+    line++;
+  if (end - line < 8 || strncmp(line, "#include", 8) != 0)
+    return 0;
+  line += 8;
+  while (line < end && (*line == ' ' || *line == '\t'))
+    line++;
+  if (line == end || *line != '"')
+    return 0;
+  close = memchr(line + 1, '"', end - line - 1);
+  if (!close || (size_t)(close - line) > size)
+    return 0;
+  memcpy(name, line + 1, close - line - 1);
+  name[close - line - 1] = '\0';
+  return 1;
+}
+
+static int
+shader_expand(shader_source *s, const char *filename, int depth) {
+  long length;
+  char *contents;
+  const char *line, *slash;
+  int file = s->files;
+  int lineno = 1;
+  int ok = 1;
+
+  if (depth > SHADER_MAX_FILES || s->files == SHADER_MAX_FILES) {
+    fprintf(stderr, "%s: too many nested #includes\n", filename);
+    return 0;
+  }
+  contents = file_contents(filename, &length);
+  if (!contents)
+    return 0;
+  s->names[s->files++] = strdup(filename);
+
+  slash = strrchr(filename, '/');
+  for (line = contents; ok && *line; lineno++) {
+    const char *end = strchr(line, '\n');
+    bool terminated = end != NULL;
+    const char *next;
+    char name[1024];
+
+    if (!terminated)
+      end = line + strlen(line);
+    next = terminated ? end + 1 : end;
+
+    if (shader_parse_include(line, end, name, sizeof(name))) {
+      char path[4096];
+      int dir = slash ? (int)(slash - filename + 1) : 0;
+
+      snprintf(path, sizeof(path), "%.*s%s", dir, filename, name);
+      ok = shader_append_line_directive(s, 1, s->files)
+        && shader_expand(s, path, depth + 1)
+        && shader_append_line_directive(s, lineno + 1, file);
+    }
+    else {
+      ok = shader_append(s, line, next - line);
+      if (ok && !terminated)
+        ok = shader_append(s, "\n", 1);
+    }
+    line = next;
+  }
+
+  free(contents);
+  return ok;
+}
+
+/* Read `filename` with all of its #includes expanded. */
+static int
+shader_load(shader_source *s, const char *filename) {
+  memset(s, 0, sizeof(*s));
+  return shader_expand(s, filename, 0);
+}
+
+/* Print which file each source string number refers to. */
+static void
+shader_show_files(const shader_source *s) {
+  for (int i = 0; i < s->files; i++)
+    fprintf(stderr, "  %d: %s\n", i, s->names[i]);
+}
+
+static void
+shader_free(shader_source *s) {
+  for (int i = 0; i < s->files; i++)
+    free(s->names[i]);
+  free(s->text);
+}
+
+/* FNV-1a, continuing from `hash`. */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *p = data;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t
+hash_string(uint64_t hash, const char *s) {
+  return hash_bytes(hash, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+/* `fragment` may be empty and `feedback` NULL. */
+static uint64_t
+program_cache_key(const shader_source *vertex,
+                  const shader_source *fragment,
+                  const char *const *feedback) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  hash = hash_string(hash, vertex->text);
+  hash = hash_string(hash, fragment->text);
+  for (int i = 0; feedback && feedback[i]; i++)
+    hash = hash_string(hash, feedback[i]);
+  hash = hash_string(hash, (const char *)glGetString(GL_VENDOR));
+  hash = hash_string(hash, (const char *)glGetString(GL_RENDERER));
+  hash = hash_string(hash, (const char *)glGetString(GL_VERSION));
+  return hash;
+}
+
+static void
+program_cache_path(char *path, size_t size, const char *dir, uint64_t key) {
+  snprintf(path, size, "%s/%016llx.bin", dir, (unsigned long long)key);
+}
+
+/* Create the program from a cached binary, or return 0. */
+static GLuint
+program_cache_load(const char *dir, uint64_t key) {
+  char path[4096];
+  long length;
+  program_cache_header *header;
+  GLuint program = 0;
+  GLint ok;
+
+  program_cache_path(path, sizeof(path), dir, key);
+  if (access(path, R_OK) != 0)
+    return 0;
+  header = file_contents(path, &length);
+  if (!header)
+    return 0;
+
+  if ((size_t)length >= sizeof(*header)
+      && memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(header->magic)) == 0
+      && header->length == length - sizeof(*header)) {
+    program = glCreateProgram();
+    glProgramBinary(program, header->format, header + 1, header->length);
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+      glDeleteProgram(program);
+      program = 0;
+    }
+  }
+
+  free(header);
+  return program;
+}
+
+/* Create `path` and any missing parents. */
+static int
+make_directories(const char *path) {
+  char buffer[4096];
+
+  snprintf(buffer, sizeof(buffer), "%s", path);
+  for (char *p = buffer + 1; ; p++) {
+    if (*p == '/' || *p == '\0') {
+      char c = *p;
+      *p = '\0';
+      if (mkdir(buffer, 0755) != 0 && errno != EEXIST)
+        return 0;
+      *p = c;
+      if (c == '\0')
+        break;
+    }
+  }
+  return 1;
+}
+
+/* Save a linked program. The file is written under a temporary name and
+   renamed into place, so a concurrent run never sees half of it. */
+static void
+program_cache_store(const char *dir, uint64_t key, GLuint program) {
+  char path[4096], temporary[4200];
+  program_cache_header header;
+  GLint length = 0;
+  GLenum format;
+  void *binary;
+  FILE *f;
+  int ok;
+
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0 || !make_directories(dir))
+    return;
+  binary = malloc(length);
+  if (!binary)
+    return;
+  glGetProgramBinary(program, length, &length, &format, binary);
+
+  memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+  header.format = format;
+  header.length = length;
+
+  program_cache_path(path, sizeof(path), dir, key);
+  snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+  f = fopen(temporary, "wb");
+  if (f) {
+    ok = fwrite(&header, sizeof(header), 1, f) == 1
+      && fwrite(binary, 1, length, f) == (size_t)length;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temporary, path) != 0)
+      remove(temporary);
+  }
+
+  free(binary);
+}
+
+/* $XDG_CACHE_HOME/lorenz, or ~/.cache/lorenz. */
+static const char *
+program_cache_default_dir(void) {
+  static char dir[4096];
+  const char *base = getenv("XDG_CACHE_HOME");
+
+  if (base && *base)
+    snprintf(dir, sizeof(dir), "%s/lorenz", base);
+  else if ((base = getenv("HOME")) && *base)
+    snprintf(dir, sizeof(dir), "%s/.cache/lorenz", base);
+  else
+    return NULL;
+  return dir;
+}
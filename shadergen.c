@@ -0,0 +1,55 @@
+/* Writes systems.glsl, the GPU engine's copy of the vector fields, to
+   stdout; `make` runs it whenever system.c changes.
+
+   The fields are the NAME_DX, _DY and _DZ macros of system.c, expanded
+   and turned into strings by the preprocessor, so the shader always
+   integrates exactly the expressions the CPU kernels do. Their integer
+   constants are fine in GLSL, which converts them to float next to a
+   float operand; sin() is the one function they call.
+*/
+
+#include <stdio.h>
+
+/* Only the macros and the names of system.c are used. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "system.c"
+#pragma GCC diagnostic pop
+
+#undef SYSTEM_SIN
+#define SYSTEM_SIN(v) sin(v)
+
+#define SHADERGEN_STRING(text) #text
+#define SHADERGEN_EXPAND(text) SHADERGEN_STRING(text)
+
+int
+main(void) {
+  printf("/* Generated from system.c by shadergen; edit the vector fields "
+         "there.\n"
+         "   `system` follows the order of SYSTEM_LIST and `params` holds "
+         "p0..p%d;\n"
+         "   every vertex takes the same branch. */\n"
+         "uniform int system;\n"
+         "uniform float params[%d];\n"
+         "\n"
+         "vec3 derivative(vec3 v) {\n"
+         "  float x = v.x, y = v.y, z = v.z;\n"
+         "  float p0 = params[0], p1 = params[1], p2 = params[2];\n"
+         "  float p3 = params[3], p4 = params[4], p5 = params[5];\n"
+         "\n", SYSTEM_MAX_PARAMS - 1, SYSTEM_MAX_PARAMS);
+
+#define SHADERGEN_FIELD(NAME, name)                                     \
+  printf("  if (system == %d) /* %s */\n"                               \
+         "    return vec3(%s,\n"                                        \
+         "                %s,\n"                                        \
+         "                %s);\n", SYSTEM_##NAME, #name,                \
+         SHADERGEN_EXPAND(NAME##_DX(x, y, z)),                          \
+         SHADERGEN_EXPAND(NAME##_DY(x, y, z)),                          \
+         SHADERGEN_EXPAND(NAME##_DZ(x, y, z)));
+  SYSTEM_LIST(SHADERGEN_FIELD)
+#undef SHADERGEN_FIELD
+
+  printf("  return vec3(0.0);\n"
+         "}\n");
+  return ferror(stdout) || fflush(stdout) != 0;
+}
@@ -0,0 +1,690 @@
+/* Simulation core.
+
+   Everything needed to integrate the trajectories and record them, and
+   nothing that touches GL: lorenz.c includes this file into its single
+   translation unit and adds the display around it, while compiled on
+   its own it is libsim.a, which exports the functions of sim.h for
+   programs such as lorenz-sim that run on machines without a display.
+*/
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "sim.h"
+
+#include "vec3.c"
+#include "util.c"
+#include "system.c"
+#include "batch.c"
+#include "dopri.c"
+#include "lyapunov.c"
+#include "section.c"
+#include "pool.c"
+#include "config.c"
+#include "record.c"
+#include "density.c"
+#include "sweep.c"
+#include "checkpoint.c"
+
+struct sim {
+  config cfg;
+
+  batch current;
+  pool workers;
+  batch_kernel kernel;
+  /* Set when integrating adaptively; the kernel is unused then. */
+  dopri *adaptive;
+  dopri adaptive_state;
+  /* Set when estimating the Lyapunov exponents; its kernel advances the
+     state in place of `kernel`. */
+  lyapunov *spectrum;
+  lyapunov spectrum_state;
+  /* Set when taking a Poincare section; crossings_lost once memory ran
+     out for some of them. */
+  section *crossings;
+  section section_state;
+  bool crossings_lost;
+  /* Set when counting points in a density grid. */
+  density *histogram;
+  density histogram_state;
+  recorder *recording;
+  recorder recording_state;
+  /* Set when taking checkpoints; the next is due at step
+     next_checkpoint. */
+  checkpointer *saving;
+  checkpointer saving_state;
+  long next_checkpoint;
+
+  /* Steps integrated so far, and how many the running tick takes. */
+  long step;
+  int tick_steps;
+
+  /* The tail is a ring of tail_length slots, each holding one point of
+     every trajectory: point c of slot s lives at tail[s*count + c].
+     Every step fills exactly one slot, so whatever was written since a
+     given step is at most two contiguous runs of memory. */
+  vec3 *tail;
+  /* The newest state of every trajectory as x, y, z floats. */
+  float *position;
+};
+
+/* Split the slots written by steps [from, to) of a ring of `ring` slots
+   into at most two runs that do not wrap around the end of the ring.
+   Returns the number of runs. */
+static int
+tail_runs(int ring, long from, long to, int first[2], int length[2]) {
+  int start, total;
+
+  if (to - from >= ring)
+    from = to - ring;
+  if (to <= from)
+    return 0;
+
+  start = from % ring;
+  total = to - from;
+  first[0] = start;
+  if (start + total <= ring) {
+    length[0] = total;
+    return 1;
+  }
+
+  length[0] = ring - start;
+  first[1] = 0;
+  length[1] = total - length[0];
+  return 2;
+}
+
+static void
+sim_copy_positions(sim *s, int begin, int end) {
+  for (int c = begin; c < end; c++) {
+    s->position[3*c + 0] = s->current.x[c];
+    s->position[3*c + 1] = s->current.y[c];
+    s->position[3*c + 2] = s->current.z[c];
+  }
+}
+
+/* The arrays that make up the state of `s`, in the order they are
+   checkpointed, the tail ring first, then the density totals if they
+   are counted. Returns how many there are. */
+static int
+sim_regions(sim *s, checkpoint_region *regions) {
+  batch *b = &s->current;
+  size_t floats = sizeof(float) * b->capacity;
+  size_t doubles = sizeof(double) * b->capacity;
+  int n = 0;
+
+#define SIM_REGION(array, bytes)                                        \
+  do {                                                                  \
+    regions[n].data = (array);                                          \
+    regions[n].size = (bytes);                                          \
+    n++;                                                                \
+  } while (0)
+
+  SIM_REGION(s->tail, sizeof(vec3) * s->cfg.count * s->cfg.tail_length);
+  SIM_REGION(b->x, floats);
+  SIM_REGION(b->y, floats);
+  SIM_REGION(b->z, floats);
+  if (b->xd) {
+    SIM_REGION(b->xd, doubles);
+    SIM_REGION(b->yd, doubles);
+    SIM_REGION(b->zd, doubles);
+  }
+  if (b->cx) {
+    SIM_REGION(b->cx, floats);
+    SIM_REGION(b->cy, floats);
+    SIM_REGION(b->cz, floats);
+  }
+  if (s->adaptive)
+    SIM_REGION(s->adaptive->states, sizeof(dopri_state) * b->count);
+  if (s->spectrum) {
+    for (int j = 0; j < 3 * LYAPUNOV_VECTORS; j++) {
+      if (s->spectrum->tangentd[j])
+        SIM_REGION(s->spectrum->tangentd[j], doubles);
+      else
+        SIM_REGION(s->spectrum->tangent[j], floats);
+    }
+    for (int k = 0; k < LYAPUNOV_VECTORS; k++)
+      SIM_REGION(s->spectrum->octaves[k], doubles);
+  }
+  if (s->histogram)
+    SIM_REGION(s->histogram->totals,
+               sizeof(uint64_t) * s->histogram->voxels);
+#undef SIM_REGION
+
+  return n;
+}
+
+/* Write a checkpoint of the state as of now, or return 0 if the last
+   one is still being written and `wait` is not set. The outputs are
+   brought up to date first; one that cannot be is left out, and starts
+   afresh when the checkpoint is restored. */
+static int
+sim_checkpoint(sim *s, bool wait) {
+  checkpoint_region regions[CHECKPOINT_MAX_REGIONS];
+  checkpoint_header h = {{0}};
+  int n;
+
+  if (!wait && checkpoint_busy(s->saving))
+    return 0;
+  if (s->crossings && section_sync(s->crossings, &h.section_bytes)) {
+    h.outputs |= CHECKPOINT_SECTION;
+    h.section_total = s->crossings->total;
+  }
+  if (s->recording && recorder_sync(s->recording)) {
+    h.outputs |= CHECKPOINT_RECORDING;
+    h.record_steps = s->recording->next_step;
+  }
+  if (s->histogram) {
+    density *d = s->histogram;
+
+    density_reduce(d);
+    h.outputs |= CHECKPOINT_DENSITY;
+    h.density_outside = d->outside;
+    h.density_resolution = d->resolution;
+    memcpy(h.density_lo, d->lo, sizeof(h.density_lo));
+    memcpy(h.density_hi, d->hi, sizeof(h.density_hi));
+  }
+  n = sim_regions(s, regions);
+
+  h.system = s->cfg.system;
+  h.integrator = s->cfg.integrator;
+  h.precision = s->cfg.precision;
+  h.count = s->cfg.count;
+  h.tail_length = s->cfg.tail_length;
+  h.lyapunov = s->cfg.lyapunov;
+  h.step = s->step;
+  h.dt = s->cfg.dt;
+  h.tolerance = s->cfg.tolerance;
+  memcpy(h.params, s->current.params, sizeof(h.params));
+  return checkpoint_take(s->saving, &h, regions, n, wait);
+}
+
+/* Copy the state back from the --restore checkpoint `f`, which the
+   config was set up from, before any output is open. Everything but
+   the tail must be the same size; a tail ring of another length keeps
+   the newest points that fit, and when it is longer than the
+   checkpoint's, repeats the oldest one before them. */
+static int
+sim_restore(sim *s, const checkpoint_file *f) {
+  checkpoint_region regions[CHECKPOINT_MAX_REGIONS];
+  int n = sim_regions(s, regions);
+  const checkpoint_header *h = &f->header;
+  uint32_t state = h->region_count - ((h->outputs & CHECKPOINT_DENSITY) != 0);
+  const vec3 *tail;
+  size_t slot = sizeof(vec3) * s->cfg.count;
+  long step, kept;
+
+  for (int i = 1; i < n; i++) {
+    if (state == (uint32_t)n && h->region_size[i] == regions[i].size)
+      continue;
+    fprintf(stderr, "%s does not match the simulation it is restored "
+            "into\n", s->cfg.restore);
+    return 0;
+  }
+  for (int i = 1; i < n; i++)
+    memcpy(regions[i].data, checkpoint_region_data(f, i), regions[i].size);
+
+  step = s->step = h->step;
+  tail = checkpoint_region_data(f, 0);
+  if (h->tail_length == (uint32_t)s->cfg.tail_length) {
+    memcpy(s->tail, tail, regions[0].size);
+  }
+  else {
+    kept = step - (long)h->tail_length;
+    for (long k = step - 1; k >= 0 && k >= step - s->cfg.tail_length; k--) {
+      long from = k > kept ? k : kept;
+      memcpy(s->tail + k % s->cfg.tail_length * s->cfg.count,
+             tail + from % h->tail_length * s->cfg.count, slot);
+    }
+  }
+
+  sim_copy_positions(s, 0, s->cfg.count);
+  return 1;
+}
+
+/* Open the section, the density grid and the recording `cfg` asks for.
+   Those the --restore checkpoint `f` holds the progress of go on from
+   there, the files cut back to where they were at the checkpoint; the
+   others start afresh. `f` is NULL when not restoring. */
+static int
+sim_open_outputs(sim *s, const checkpoint_file *f) {
+  const config *cfg = &s->cfg;
+  const checkpoint_header *h = f ? &f->header : NULL;
+  uint32_t outputs = h ? h->outputs : 0;
+
+  if (cfg->section) {
+    bool resume = outputs & CHECKPOINT_SECTION;
+
+    if (!section_open(&s->section_state, cfg->section, cfg->section_normal,
+                      cfg->section_offset, cfg->section_direction,
+                      &s->current, cfg->system, cfg->dt,
+                      s->workers.nthreads, cfg->section_plot,
+                      resume ? (long)h->section_bytes : -1))
+      return 0;
+    s->crossings = &s->section_state;
+    if (resume)
+      s->crossings->total = h->section_total;
+  }
+
+  if (cfg->density > 0) {
+    vec3 lo, hi;
+    density *d = &s->histogram_state;
+
+    config_density_box(cfg, &lo, &hi);
+    if (!density_open(d, cfg->density, lo, hi, cfg->density_interval,
+                      cfg->density_output, cfg->density_show, &s->current,
+                      cfg->system, &s->workers))
+      return 0;
+    s->histogram = d;
+    if (outputs & CHECKPOINT_DENSITY) {
+      int last = h->region_count - 1;
+
+      if (h->density_resolution != (uint32_t)d->resolution
+          || memcmp(h->density_lo, d->lo, sizeof(d->lo)) != 0
+          || memcmp(h->density_hi, d->hi, sizeof(d->hi)) != 0
+          || h->region_size[last] != sizeof(uint64_t) * d->voxels) {
+        fprintf(stderr, "%s counted the density in another grid\n",
+                cfg->restore);
+        return 0;
+      }
+      memcpy(d->totals, checkpoint_region_data(f, last),
+             sizeof(uint64_t) * d->voxels);
+      d->outside = h->density_outside;
+    }
+  }
+
+  if (cfg->record) {
+    if (!recorder_open(&s->recording_state, cfg->record, cfg->count,
+                       cfg->dt, cfg->system, s->current.params,
+                       cfg->record_chunk, cfg->record_index,
+                       outputs & CHECKPOINT_RECORDING
+                       ? (long)h->record_steps : -1))
+      return 0;
+    s->recording = &s->recording_state;
+  }
+  return 1;
+}
+
+/* Allocate and start from the initial conditions `cfg` asks for. */
+static int
+sim_init(sim *s, const config *cfg) {
+  size_t count = cfg->count;
+
+  memset(s, 0, sizeof(*s));
+  s->cfg = *cfg;
+  s->tail = alloc_aligned(sizeof(vec3) * count * cfg->tail_length);
+  s->position = alloc_aligned(3 * sizeof(float) * count);
+  if (!s->tail || !s->position
+      || !batch_init(&s->current, cfg->count, cfg->precision)) {
+    fprintf(stderr, "Unable to allocate state for %d trajectories\n",
+            cfg->count);
+    return 0;
+  }
+  config_initial_state(cfg, &s->current);
+  for (int c = 0; c < cfg->count; c++) {
+    vec3 p = batch_get(&s->current, c);
+    s->position[3*c + 0] = p.x;
+    s->position[3*c + 1] = p.y;
+    s->position[3*c + 2] = p.z;
+  }
+
+  /* Only the cpu engine integrates here; the gpu engine and a replay
+     take no section, density or exponents either, so they never use
+     the pool. */
+  if (cfg->engine == ENGINE_CPU && !cfg->replay)
+    pool_init(&s->workers,
+              cfg->threads > 0 ? cfg->threads : pool_cpu_count());
+  s->kernel = batch_select_kernel(cfg->system, cfg->precision);
+
+  if (cfg->integrator == INTEGRATOR_DOPRI5) {
+    if (!dopri_init(&s->adaptive_state, &s->current, cfg->system, cfg->dt,
+                    cfg->tolerance))
+      return 0;
+    s->adaptive = &s->adaptive_state;
+  }
+
+  if (cfg->lyapunov > 0) {
+    if (!lyapunov_init(&s->spectrum_state, &s->current, cfg->system,
+                       cfg->lyapunov))
+      return 0;
+    s->spectrum = &s->spectrum_state;
+  }
+
+  /* The state goes back before anything that starts from it, such as
+     the section's distances, is set up. */
+  if (cfg->restore) {
+    checkpoint_file f;
+    int ok;
+
+    if (!checkpoint_map(&f, cfg->restore))
+      return 0;
+    ok = sim_restore(s, &f) && sim_open_outputs(s, &f);
+    checkpoint_unmap(&f);
+    if (!ok)
+      return 0;
+  }
+  else if (!sim_open_outputs(s, NULL)) {
+    return 0;
+  }
+
+  if (cfg->checkpoint) {
+    checkpoint_region regions[CHECKPOINT_MAX_REGIONS];
+    checkpoint_header h = {{0}};
+    int n = sim_regions(s, regions);
+
+    h.header_size = RECORD_PAGE;
+    for (int i = 0; i < n; i++)
+      h.region_size[i] = regions[i].size;
+    if (!checkpoint_open(&s->saving_state, cfg->checkpoint,
+                         checkpoint_region_offset(&h, n)))
+      return 0;
+    s->saving = &s->saving_state;
+    s->next_checkpoint = (s->step / cfg->checkpoint_interval + 1)
+      * cfg->checkpoint_interval;
+  }
+  return 1;
+}
+
+/* Trajectories stepped together before moving on to the next ones:
+   enough to fill the SIMD kernels, few enough that their state stays
+   in the L1/L2 cache across all the steps of a tick and the passes
+   over it within each step. */
+#define SIM_BLOCK 2048
+
+/* Work handed to the pool each tick: every block of trajectories runs
+   its own tick_steps steps, recording the tail, looking for section
+   crossings and counting the points in the density grid as it goes. */
+static void
+sim_step_range(void *arg, int begin, int end) {
+  sim *s = arg;
+  batch *b = &s->current;
+  int count = s->cfg.count;
+  int slice = pool_slice(&s->workers, begin);
+
+  for (int from = begin; from < end; from += SIM_BLOCK) {
+    int to = end - from > SIM_BLOCK ? from + SIM_BLOCK : end;
+    int last = to < count ? to : count;
+
+    for (int i = 0; i < s->tick_steps; i++) {
+      long slot = (s->step + i) % s->cfg.tail_length;
+      vec3 *tail = s->tail + slot*count;
+      for (int c = from; c < last; c++) {
+        tail[c] = batch_get(b, c);
+      }
+
+      if (s->adaptive)
+        dopri_advance(s->adaptive, b, from, last,
+                      (double)(s->step + i + 1) * s->cfg.dt);
+      else if (s->spectrum)
+        lyapunov_advance(s->spectrum, b, from, to, s->cfg.dt, s->step + i);
+      else
+        s->kernel(b, from, to, s->cfg.dt);
+
+      if (s->crossings
+          && !section_scan(s->crossings, slice, b, tail, from, to,
+                           s->step + i))
+        s->crossings->slices[slice].failed = true;
+      if (s->histogram)
+        density_count(s->histogram, slice, b, from, last);
+    }
+  }
+
+  sim_copy_positions(s, begin, end < count ? end : count);
+}
+
+/* Integrate `steps` steps, at most tail_length, and append them to the
+   recording. */
+static void
+sim_advance(sim *s, int steps) {
+  s->tick_steps = steps;
+  if (s->histogram)
+    density_before(s->histogram, s->cfg.count, steps);
+  pool_run(&s->workers, sim_step_range, s, s->current.capacity,
+           BATCH_GRAIN);
+
+  if (s->crossings && !section_flush(s->crossings)) {
+    if (!s->crossings_lost)
+      fprintf(stderr, "section: out of memory, crossings lost from step "
+              "%ld on\n", s->step);
+    s->crossings_lost = true;
+  }
+  if (s->histogram)
+    density_after(s->histogram, steps);
+
+  if (s->recording) {
+    int first[2], length[2];
+    int runs = tail_runs(s->cfg.tail_length, s->step, s->step + steps,
+                         first, length);
+    for (int r = 0; r < runs; r++) {
+      recorder_append(s->recording, s->tail + first[r]*s->cfg.count,
+                      length[r]);
+    }
+  }
+
+  s->step += steps;
+
+  /* Put off to the next tick if the writer is still busy. */
+  if (s->saving && s->step >= s->next_checkpoint && sim_checkpoint(s, false))
+    s->next_checkpoint = (s->step / s->cfg.checkpoint_interval + 1)
+      * s->cfg.checkpoint_interval;
+}
+
+/* Print the running Lyapunov exponent estimates, if any. */
+static void
+sim_report_lyapunov(const sim *s, FILE *f) {
+  double mean[LYAPUNOV_VECTORS], spread[LYAPUNOV_VECTORS];
+  int finite;
+
+  if (!s->spectrum)
+    return;
+  finite = lyapunov_estimate(s->spectrum, s->step, s->cfg.dt, mean, spread);
+  if (finite == 0)
+    return;
+  fprintf(f, "lyapunov: %.4g %.4g %.4g (+- %.2g %.2g %.2g over %d "
+          "trajectories, t = %g)\n", mean[0], mean[1], mean[2], spread[0],
+          spread[1], spread[2], finite,
+          s->step * s->cfg.dt);
+}
+
+/* Write a last checkpoint, close the recording, the section and the
+   density grid, report how hard dopri5 worked, what the Lyapunov
+   exponents came to and how many crossings and points were found, and
+   free everything. Returns 0 if any of the files could not be
+   completed. */
+static int
+sim_close(sim *s) {
+  int ok = 1;
+
+  if (s->saving) {
+    sim_checkpoint(s, true);
+    if (!checkpoint_close(s->saving))
+      ok = 0;
+    fprintf(stderr, "checkpoint: %lu written to %s, the last at step %ld\n",
+            s->saving->written, s->cfg.checkpoint, s->step);
+  }
+
+  if (s->recording && !recorder_close(s->recording))
+    ok = 0;
+
+  if (s->adaptive) {
+    unsigned long accepted, rejected;
+    int diverged;
+    dopri_stats(s->adaptive, &accepted, &rejected, &diverged);
+    if (s->step > 0)
+      fprintf(stderr, "dopri5: %.2f steps per output step, %.1f%% "
+              "rejected\n", (double)accepted / s->step / s->cfg.count,
+              100.0 * rejected / (accepted + rejected));
+    if (diverged > 0)
+      fprintf(stderr, "dopri5: %d of %d trajectories diverged and were "
+              "stopped\n", diverged, s->cfg.count);
+    dopri_free(s->adaptive);
+  }
+  if (s->spectrum) {
+    sim_report_lyapunov(s, stderr);
+    lyapunov_free(s->spectrum);
+  }
+  if (s->crossings) {
+    fprintf(stderr, "section: %lu crossings%s\n", s->crossings->total,
+            s->crossings_lost ? ", some lost" : "");
+    if (s->crossings_lost)
+      ok = 0;
+    if (!section_close(s->crossings))
+      ok = 0;
+  }
+  if (s->histogram && !density_close(s->histogram))
+    ok = 0;
+  if (s->workers.nthreads > 0)
+    pool_free(&s->workers);
+  batch_free(&s->current);
+  free(s->tail);
+  free(s->position);
+  return ok;
+}
+
+/* Reject the options only lorenz can act on, which would otherwise be
+   ignored without a word. */
+static int
+sim_check_options(const config *cfg) {
+  const char *option = cfg->engine == ENGINE_GPU ? "--engine gpu"
+    : cfg->replay ? "--replay"
+    : cfg->headless > 0 ? "--headless"
+    : cfg->capture > 0 ? "--capture"
+    : cfg->profile ? "--profile"
+    : cfg->trace ? "--trace"
+    : cfg->bench_precision > 0 ? "--bench-precision" : NULL;
+
+  if (option) {
+    fprintf(stderr, "%s is only available in lorenz\n", option);
+    return 0;
+  }
+  return 1;
+}
+
+sim *
+sim_create(int argc, char **argv) {
+  config cfg;
+  sim *s = malloc(sizeof(*s));
+
+  config_defaults(&cfg);
+  if (!s || !config_parse_args(&cfg, argc, argv)
+      || !sim_check_options(&cfg)) {
+    free(s);
+    return NULL;
+  }
+  /* A restore takes the system and the size of the run from the
+     checkpoint. */
+  if (cfg.restore && (!checkpoint_configure(&cfg, NULL, NULL)
+                      || !config_validate(&cfg))) {
+    free(s);
+    return NULL;
+  }
+  /* Nothing is drawn, so the tail only has to hold one run of steps on
+     its way to the recording. */
+  cfg.tail_length = cfg.steps_per_frame > 1 ? cfg.steps_per_frame : 2;
+  cfg.section_plot = 0;
+  cfg.density_show = 0;
+  if (!sim_init(s, &cfg)) {
+    sim_close(s);
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void
+sim_run(sim *s, long steps) {
+  while (steps > 0) {
+    int n = steps < s->cfg.steps_per_frame ? steps : s->cfg.steps_per_frame;
+    sim_advance(s, n);
+    steps -= n;
+  }
+}
+
+int
+sim_count(const sim *s) {
+  return s->cfg.count;
+}
+
+long
+sim_steps(const sim *s) {
+  return s->step;
+}
+
+double
+sim_dt(const sim *s) {
+  return s->cfg.dt;
+}
+
+void
+sim_state(const sim *s, int i, double state[3]) {
+  const batch *b = &s->current;
+
+  /* --precision only applies to rk4; dopri5 leaves its output in the
+     float arrays. */
+  if (b->xd && !s->adaptive) {
+    state[0] = b->xd[i];
+    state[1] = b->yd[i];
+    state[2] = b->zd[i];
+  }
+  else {
+    state[0] = b->x[i];
+    state[1] = b->y[i];
+    state[2] = b->z[i];
+  }
+}
+
+int
+sim_lyapunov(const sim *s, double exponents[3], double spread[3]) {
+  return s->spectrum ? lyapunov_estimate(s->spectrum, s->step, s->cfg.dt,
+                                         exponents, spread) : 0;
+}
+
+int
+sim_density(sim *s, const uint64_t **counts, float lo[3], float hi[3]) {
+  density *d = s->histogram;
+
+  if (!d)
+    return 0;
+  density_reduce(d);
+  *counts = d->totals;
+  memcpy(lo, d->lo, sizeof(d->lo));
+  memcpy(hi, d->hi, sizeof(d->hi));
+  return d->resolution;
+}
+
+void
+sim_set_view(sim *s, const float view[6]) {
+  if (s->saving)
+    checkpoint_set_view(s->saving, view);
+}
+
+int
+sim_sweep(int argc, char **argv) {
+  config cfg;
+
+  config_defaults(&cfg);
+  if (!config_parse_args(&cfg, argc, argv) || !sim_check_options(&cfg))
+    return 0;
+  if (cfg.sweep < 1) {
+    fprintf(stderr, "Nothing to sweep: give --sweep N, --sweep-param, "
+            "--sweep-from and --sweep-to\n");
+    return 0;
+  }
+  return sweep_run(&cfg);
+}
+
+int
+sim_destroy(sim *s) {
+  int ok = sim_close(s);
+
+  free(s);
+  return ok;
+}
@@ -0,0 +1,60 @@
+/* Interface of libsim.a, the simulation core without any GL.
+
+   A simulation is set up from the same options lorenz takes, on the
+   command line or in a --config file, except that the options only
+   lorenz acts on, such as --engine gpu or --capture, are rejected. It
+   integrates every trajectory on the worker pool and appends each step
+   to the --record file if one was given.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+typedef struct sim sim;
+
+/* NULL if the options are invalid (after printing why) or memory runs
+   out. Options only lorenz acts on, such as --engine gpu, --replay,
+   --headless and --capture, are invalid here. */
+sim *sim_create(int argc, char **argv);
+
+/* Integrate `steps` more steps. */
+void sim_run(sim *s, long steps);
+
+int sim_count(const sim *s);
+long sim_steps(const sim *s);
+double sim_dt(const sim *s);
+
+/* Current state of trajectory `i`. */
+void sim_state(const sim *s, int i, double state[3]);
+
+/* Running estimates of the three Lyapunov exponents, largest first,
+   averaged over the trajectories, and their standard deviation across
+   them. Returns how many trajectories were averaged: 0 without
+   --lyapunov or before the first step. */
+int sim_lyapunov(const sim *s, double exponents[3], double spread[3]);
+
+/* The --density grid so far: counts of the points that fell in each of
+   its resolution^3 voxels, x varying fastest, then y, then z, over the
+   box from `lo` to `hi`. The counts stay valid until the next call to
+   sim_run. Returns the resolution, 0 without --density. */
+int sim_density(sim *s, const uint64_t **counts, float lo[3], float hi[3]);
+
+/* The camera of a program that displays the run, as rotation x, y, z
+   and translation x, y, z, to store in --checkpoint files. May be
+   called from any thread. */
+void sim_set_view(sim *s, const float view[6]);
+
+/* Draw a bifurcation diagram: integrate --count trajectories for each
+   of the --sweep values of --sweep-param from --sweep-from to
+   --sweep-to, and write the points they settle onto to --sweep-data and
+   --sweep-image. Returns 0 if the options are invalid or the output
+   could not be written. */
+int sim_sweep(int argc, char **argv);
+
+/* Finish the recording and the other output files and free everything.
+   Returns 0 if any of them could not be completed. */
+int sim_destroy(sim *s);
+
+#endif
@@ -0,0 +1,195 @@
+/* lorenz-sim: integrate without a display.
+
+   Takes lorenz's options (system, params, count, dt, integrator,
+   precision, initial conditions, threads, record, ...) plus
+
+     --steps N       steps to integrate (default 1000)
+     --states FILE   write the final state of every trajectory as CSV,
+                     - for stdout
+     --progress N    print the running Lyapunov exponent estimates every
+                     N steps (with --lyapunov)
+
+   and prints a summary of the final states and the throughput. Only
+   libsim.a is linked, so it runs where there is no GL at all.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "sim.h"
+
+static double
+seconds(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+write_states(const sim *s, const char *filename) {
+  FILE *f = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+  int ok;
+
+  if (!f) {
+    fprintf(stderr, "Unable to open %s for writing\n", filename);
+    return 0;
+  }
+  fprintf(f, "x,y,z\n");
+  for (int i = 0; i < sim_count(s); i++) {
+    double v[3];
+    sim_state(s, i, v);
+    fprintf(f, "%.9g,%.9g,%.9g\n", v[0], v[1], v[2]);
+  }
+  ok = !ferror(f);
+  if (f != stdout)
+    ok = fclose(f) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing %s\n", filename);
+  return ok;
+}
+
+/* Integrate `steps` steps, printing the Lyapunov exponents estimated so
+   far every `progress` of them. */
+static void
+run(sim *s, long steps, long progress, FILE *f) {
+  while (steps > 0) {
+    long n = progress > 0 && progress < steps ? progress : steps;
+    double exponents[3], spread[3];
+    int finite;
+
+    sim_run(s, n);
+    steps -= n;
+    if (progress <= 0)
+      continue;
+    finite = sim_lyapunov(s, exponents, spread);
+    if (finite > 0)
+      fprintf(f, "step %ld: lyapunov %.4g %.4g %.4g (+- %.2g %.2g %.2g, "
+              "%d trajectories)\n", sim_steps(s), exponents[0],
+              exponents[1], exponents[2], spread[0], spread[1], spread[2],
+              finite);
+  }
+}
+
+/* Mean, spread and bounds of the final states; trajectories that blew
+   up to infinity or NaN are only counted. */
+static void
+report(FILE *f, const sim *s, double elapsed) {
+  double sum[3] = {0}, sq[3] = {0}, lo[3], hi[3];
+  int count = sim_count(s), finite = 0;
+  long steps = sim_steps(s);
+
+  for (int j = 0; j < 3; j++) {
+    lo[j] = INFINITY;
+    hi[j] = -INFINITY;
+  }
+  for (int i = 0; i < count; i++) {
+    double v[3];
+    sim_state(s, i, v);
+    if (!isfinite(v[0]) || !isfinite(v[1]) || !isfinite(v[2]))
+      continue;
+    finite++;
+    for (int j = 0; j < 3; j++) {
+      sum[j] += v[j];
+      sq[j] += v[j] * v[j];
+      lo[j] = v[j] < lo[j] ? v[j] : lo[j];
+      hi[j] = v[j] > hi[j] ? v[j] : hi[j];
+    }
+  }
+
+  fprintf(f, "trajectories %d (%d diverged)\n", count, count - finite);
+  fprintf(f, "steps        %ld (t = %g)\n", steps, steps * sim_dt(s));
+  fprintf(f, "time         %.3f s, %.4g steps/s\n", elapsed,
+             elapsed > 0.0 ? (double)steps * count / elapsed : 0.0);
+  if (finite == 0)
+    return;
+  fprintf(f, "%-12s %12s %12s %12s\n", "", "x", "y", "z");
+  fprintf(f, "%-12s", "mean");
+  for (int j = 0; j < 3; j++)
+    fprintf(f, " %12.6g", sum[j] / finite);
+  fprintf(f, "\n%-12s", "stddev");
+  for (int j = 0; j < 3; j++) {
+    double mean = sum[j] / finite;
+    double var = sq[j] / finite - mean * mean;
+    fprintf(f, " %12.6g", var > 0.0 ? sqrt(var) : 0.0);
+  }
+  fprintf(f, "\n%-12s", "min");
+  for (int j = 0; j < 3; j++)
+    fprintf(f, " %12.6g", lo[j]);
+  fprintf(f, "\n%-12s", "max");
+  for (int j = 0; j < 3; j++)
+    fprintf(f, " %12.6g", hi[j]);
+  fprintf(f, "\n");
+}
+
+int
+main(int argc, char **argv) {
+  long steps = 1000, progress = 0;
+  const char *states = NULL;
+  bool crossings_to_stdout = false;
+  FILE *summary;
+  char **args = malloc(sizeof(char *) * (argc + 1));
+  int nargs = 0;
+  double start;
+  sim *s;
+  int ok;
+
+  if (!args)
+    return 1;
+
+  /* Take out the options of our own and leave the rest to the core. */
+  args[nargs++] = argv[0];
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+      char *end;
+      steps = strtol(argv[++i], &end, 10);
+      if (*end || steps < 0) {
+        fprintf(stderr, "Invalid value '%s' for steps\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+      char *end;
+      progress = strtol(argv[++i], &end, 10);
+      if (*end || progress < 0) {
+        fprintf(stderr, "Invalid value '%s' for progress\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--states") == 0 && i + 1 < argc) {
+      states = argv[++i];
+    }
+    else {
+      if (strcmp(argv[i], "--section") == 0 && i + 1 < argc)
+        crossings_to_stdout = strcmp(argv[i + 1], "-") == 0;
+      if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        fprintf(stderr, "Usage: %s [--steps N] [--states FILE] "
+                "[--progress N] [lorenz options]\n\n", argv[0]);
+      args[nargs++] = argv[i];
+    }
+  }
+  args[nargs] = NULL;
+
+  s = sim_create(nargs, args);
+  free(args);
+  if (!s)
+    return 1;
+
+  /* Keep the summary out of the way of states or section crossings
+     written to stdout. */
+  summary = crossings_to_stdout || (states && strcmp(states, "-") == 0)
+    ? stderr : stdout;
+  start = seconds();
+  run(s, steps, progress, summary);
+  report(summary, s, seconds() - start);
+
+  ok = !states || write_states(s, states);
+  ok = sim_destroy(s) && ok;
+  return !ok;
+}
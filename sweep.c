@@ -0,0 +1,311 @@
+/* Parameter sweeps for bifurcation diagrams, run by lorenz-sweep.
+
+   The parameter named by --sweep-param takes --sweep values evenly
+   spaced from --sweep-from to --sweep-to, and every value gets a batch
+   of its own: --count trajectories from the usual initial conditions.
+   The values are split over the pool, so a worker steps whole batches
+   from start to finish while they sit in its L1 cache, and there is
+   nothing to synchronize until the end. After --sweep-transient steps
+   to settle onto the attractor, the next --sweep-steps steps give the
+   points of the diagram: the local maxima of one coordinate, placed on
+   the parabola through the three samples around each, or that
+   coordinate where the trajectories cross the section plane, found as
+   for --section.
+
+   The points are kept per value, so the output is the same for any
+   number of threads: CSV rows of (param, value), and a PGM image with
+   a column per value, darker where more of its points fell.
+*/
+
+/* The points found for one parameter value. */
+typedef struct {
+  float param;
+  float *points;
+  int count, capacity;
+  /* Set if memory ran out. */
+  int failed;
+} sweep_column;
+
+typedef struct {
+  const config *cfg;
+  int param;
+  batch_kernel kernel;
+  sweep_column *columns;
+} sweep;
+
+static int
+sweep_append(sweep_column *col, float point) {
+  if (col->count == col->capacity) {
+    int capacity = col->capacity > 0 ? 2 * col->capacity : 256;
+    float *points = realloc(col->points, sizeof(float) * capacity);
+
+    if (!points)
+      return 0;
+    col->points = points;
+    col->capacity = capacity;
+  }
+  col->points[col->count++] = point;
+  return 1;
+}
+
+static const float *
+sweep_coordinate(const batch *b, axis a) {
+  return a == AXIS_X ? b->x : a == AXIS_Y ? b->y : b->z;
+}
+
+/* Step `b` --sweep-steps times and add the local maxima of every
+   trajectory's coordinate to `col`. */
+static int
+sweep_maxima(const sweep *sw, batch *b, sweep_column *col) {
+  const config *cfg = sw->cfg;
+  const float *now = sweep_coordinate(b, cfg->sweep_coordinate);
+  float *older = malloc(sizeof(float) * 2 * b->count), *prev;
+  int ok = 1;
+
+  if (!older)
+    return 0;
+  prev = older + b->count;
+  memcpy(older, now, sizeof(float) * b->count);
+  memcpy(prev, now, sizeof(float) * b->count);
+
+  for (int i = 0; i < cfg->sweep_steps && ok; i++) {
+    sw->kernel(b, 0, b->capacity, cfg->dt);
+    for (int c = 0; c < b->count; c++) {
+      float y0 = older[c], y1 = prev[c], y2 = now[c];
+
+      if (y1 > y0 && y1 >= y2) {
+        float curve = y0 - 2.0f * y1 + y2;
+        ok = sweep_append(col, curve < 0.0f
+                          ? y1 - 0.125f * (y2 - y0) * (y2 - y0) / curve
+                          : y1) && ok;
+      }
+      older[c] = y1;
+      prev[c] = y2;
+    }
+  }
+
+  free(older);
+  return ok;
+}
+
+/* Step `b` --sweep-steps times and add the coordinate of every crossing
+   of the section plane to `col`. */
+static int
+sweep_crossings(const sweep *sw, batch *b, sweep_column *col) {
+  const config *cfg = sw->cfg;
+  vec3 *before = malloc(sizeof(vec3) * b->capacity);
+  section s;
+  int ok;
+
+  if (!before)
+    return 0;
+  if (!section_open(&s, NULL, cfg->section_normal, cfg->section_offset,
+                    cfg->section_direction, b, cfg->system, cfg->dt, 1, 0,
+                    -1)) {
+    free(before);
+    return 0;
+  }
+
+  ok = 1;
+  for (int i = 0; i < cfg->sweep_steps && ok; i++) {
+    section_slice *sl = &s.slices[0];
+
+    for (int c = 0; c < b->count; c++)
+      before[c] = batch_get(b, c);
+    sw->kernel(b, 0, b->capacity, cfg->dt);
+    ok = section_scan(&s, 0, b, before, 0, b->capacity, i);
+    for (int k = 0; k < sl->count; k++)
+      ok = sweep_append(col, sl->crossings[k].point[cfg->sweep_coordinate])
+        && ok;
+    sl->count = 0;
+  }
+
+  section_close(&s);
+  free(before);
+  return ok;
+}
+
+/* Integrate the batch of column `col` and collect its points. */
+static void
+sweep_value(const sweep *sw, sweep_column *col) {
+  config cfg = *sw->cfg;
+  batch b;
+
+  config_system_params(sw->cfg, cfg.params.values);
+  cfg.params.count = systems[cfg.system].param_count;
+  cfg.params.values[sw->param] = col->param;
+  if (!batch_init(&b, cfg.count, cfg.precision)) {
+    col->failed = 1;
+    return;
+  }
+  config_initial_state(&cfg, &b);
+
+  for (int i = 0; i < cfg.sweep_transient; i++)
+    sw->kernel(&b, 0, b.capacity, cfg.dt);
+  if (cfg.sweep_collect == SWEEP_SECTION)
+    col->failed = !sweep_crossings(sw, &b, col);
+  else
+    col->failed = !sweep_maxima(sw, &b, col);
+
+  batch_free(&b);
+}
+
+/* Pool task: sweep columns [begin, end). */
+static void
+sweep_range(void *arg, int begin, int end) {
+  sweep *sw = arg;
+
+  for (int v = begin; v < end; v++)
+    sweep_value(sw, &sw->columns[v]);
+}
+
+static int
+sweep_write_data(const sweep *sw, const char *filename) {
+  FILE *f = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+  int ok;
+
+  if (!f) {
+    fprintf(stderr, "Unable to open %s for writing\n", filename);
+    return 0;
+  }
+  fprintf(f, "%s,%s\n", sw->cfg->sweep_param,
+          axis_names[sw->cfg->sweep_coordinate]);
+  for (int v = 0; v < sw->cfg->sweep; v++) {
+    const sweep_column *col = &sw->columns[v];
+
+    for (int k = 0; k < col->count; k++)
+      fprintf(f, "%.9g,%.9g\n", col->param, col->points[k]);
+  }
+  ok = !ferror(f);
+  if (f != stdout)
+    ok = fclose(f) == 0 && ok;
+  else
+    ok = fflush(f) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing %s\n", filename);
+  return ok;
+}
+
+/* Draw the diagram between `lo` at the bottom and `hi` at the top. Each
+   column is scaled to its own largest count, log(1 + count), so that a
+   value whose points spread over a chaotic band shows up as clearly as
+   one whose points pile up on a few periodic branches. */
+static int
+sweep_write_image(const sweep *sw, const char *filename, float lo, float hi) {
+  int width = sw->cfg->sweep, height = sw->cfg->sweep_height;
+  unsigned char *pixels = malloc((size_t)width * height);
+  uint32_t *counts = malloc(sizeof(uint32_t) * height);
+  float scale = height / (hi - lo);
+  FILE *f = NULL;
+  int ok = 0;
+
+  if (!pixels || !counts) {
+    fprintf(stderr, "Unable to allocate a %dx%d diagram\n", width, height);
+    goto done;
+  }
+  for (int v = 0; v < width; v++) {
+    const sweep_column *col = &sw->columns[v];
+    uint32_t largest = 0;
+    float shade;
+
+    memset(counts, 0, sizeof(uint32_t) * height);
+    for (int k = 0; k < col->count; k++) {
+      float row = (hi - col->points[k]) * scale;
+      if (row >= 0.0f && row < height)
+        counts[(int)row]++;
+    }
+    for (int r = 0; r < height; r++)
+      largest = counts[r] > largest ? counts[r] : largest;
+    shade = largest > 0 ? 255.0f / log1pf(largest) : 0.0f;
+    for (int r = 0; r < height; r++)
+      pixels[(size_t)r * width + v] =
+        255 - (unsigned char)(log1pf(counts[r]) * shade + 0.5f);
+  }
+
+  f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(stderr, "Unable to open %s for writing\n", filename);
+    goto done;
+  }
+  fprintf(f, "P5\n%d %d\n255\n", width, height);
+  ok = fwrite(pixels, (size_t)width * height, 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Error writing %s\n", filename);
+
+ done:
+  free(pixels);
+  free(counts);
+  return ok;
+}
+
+/* Run the sweep `cfg` asks for and write out the diagram. Returns 0 if
+   memory ran out or a file could not be written. */
+static int
+sweep_run(const config *cfg) {
+  sweep sw = {cfg, config_sweep_param(cfg),
+              batch_select_kernel(cfg->system, cfg->precision), NULL};
+  float lo = INFINITY, hi = -INFINITY;
+  long points = 0;
+  struct timespec start, end;
+  pool workers;
+  int ok = 1;
+
+  sw.columns = calloc(cfg->sweep, sizeof(sweep_column));
+  if (!sw.columns) {
+    fprintf(stderr, "Unable to allocate %d sweep columns\n", cfg->sweep);
+    return 0;
+  }
+  for (int v = 0; v < cfg->sweep; v++) {
+    float t = cfg->sweep > 1 ? (float)v / (cfg->sweep - 1) : 0.0f;
+    sw.columns[v].param =
+      cfg->sweep_from + t * (cfg->sweep_to - cfg->sweep_from);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pool_init(&workers, cfg->threads > 0 ? cfg->threads : pool_cpu_count());
+  pool_run(&workers, sweep_range, &sw, cfg->sweep, 1);
+  pool_free(&workers);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int v = 0; v < cfg->sweep; v++) {
+    const sweep_column *col = &sw.columns[v];
+
+    if (col->failed) {
+      fprintf(stderr, "Unable to allocate the points for %s = %g\n",
+              cfg->sweep_param, col->param);
+      ok = 0;
+    }
+    for (int k = 0; k < col->count; k++) {
+      if (!isfinite(col->points[k]))
+        continue;
+      lo = col->points[k] < lo ? col->points[k] : lo;
+      hi = col->points[k] > hi ? col->points[k] : hi;
+    }
+    points += col->count;
+  }
+
+  fprintf(stderr, "sweep: %d values of %s from %g to %g, %ld points "
+          "(%s %g to %g), %.3f s\n", cfg->sweep, cfg->sweep_param,
+          cfg->sweep_from, cfg->sweep_to, points,
+          axis_names[cfg->sweep_coordinate], lo, hi,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+
+  if (ok && cfg->sweep_data)
+    ok = sweep_write_data(&sw, cfg->sweep_data);
+  if (ok && cfg->sweep_image) {
+    /* A little room above and below, and some height for a diagram
+       that is all one value. */
+    float margin = hi > lo ? 0.02f * (hi - lo) : 1.0f;
+    if (lo > hi) {
+      lo = 0.0f;
+      hi = 0.0f;
+    }
+    ok = sweep_write_image(&sw, cfg->sweep_image, lo - margin, hi + margin);
+  }
+
+  for (int v = 0; v < cfg->sweep; v++)
+    free(sw.columns[v].points);
+  free(sw.columns);
+  return ok;
+}
@@ -0,0 +1,194 @@
+/* Dynamical systems.
+
+   Each system's vector field is spelled out once as three expressions
+   in x, y, z and the parameters p0..p5, which SYSTEM_PARAMS brings into
+   scope. Being macros, the same text works on plain floats and doubles
+   and on GCC vector types: every integrator kernel is instantiated once
+   per entry of SYSTEM_LIST with the field inlined, and the system is
+   chosen once at startup from a table of kernels rather than on every
+   step.
+
+   Next to the field, NAME_JX, _JY and _JZ give the product of its
+   Jacobian at x, y, z with a tangent vector u, v, w, which the Lyapunov
+   estimator integrates alongside the state.
+*/
+
+#include <math.h>
+
+#define SYSTEM_MAX_PARAMS 6
+
+/* The classic Lorenz parameters. */
+#define SIGMA 10.0f
+#define BETA (-8.0f/3.0f)
+#define RHO 28.0f
+
+#define SYSTEM_LIST(X)                          \
+  X(LORENZ, lorenz)                             \
+  X(ROSSLER, rossler)                           \
+  X(THOMAS, thomas)                             \
+  X(CHEN, chen)                                 \
+  X(AIZAWA, aizawa)                             \
+  X(HALVORSEN, halvorsen)
+
+typedef enum {
+#define SYSTEM_ENUM(NAME, name) SYSTEM_##NAME,
+  SYSTEM_LIST(SYSTEM_ENUM)
+#undef SYSTEM_ENUM
+  SYSTEM_COUNT
+} system_id;
+
+typedef struct {
+  const char *params;
+  int param_count;
+  double defaults[SYSTEM_MAX_PARAMS];
+  /* Rough size of the attractor, to fit it in view. */
+  float extent;
+  /* A box around the attractor, with some room to spare, for the
+     density grid. */
+  float box[2][3];
+} system_info;
+
+static const char *const system_names[] = {
+#define SYSTEM_NAME(NAME, name) #name,
+  SYSTEM_LIST(SYSTEM_NAME)
+#undef SYSTEM_NAME
+  NULL
+};
+
+static const system_info systems[SYSTEM_COUNT] = {
+  {"sigma,rho,beta", 3, {10.0, 28.0, 8.0 / 3.0}, 25.0f,
+   {{-22.0f, -30.0f, 0.0f}, {22.0f, 30.0f, 50.0f}}},
+  {"a,b,c", 3, {0.2, 0.2, 5.7}, 15.0f,
+   {{-12.0f, -12.0f, 0.0f}, {14.0f, 10.0f, 25.0f}}},
+  {"b", 1, {0.208186}, 5.0f,
+   {{-4.5f, -4.5f, -4.5f}, {4.5f, 4.5f, 4.5f}}},
+  {"a,b,c", 3, {35.0, 3.0, 28.0}, 30.0f,
+   {{-30.0f, -34.0f, 0.0f}, {30.0f, 34.0f, 60.0f}}},
+  {"a,b,c,d,e,f", 6, {0.95, 0.7, 0.6, 3.5, 0.25, 0.1}, 1.5f,
+   {{-1.6f, -1.6f, -1.2f}, {1.6f, 1.6f, 2.2f}}},
+  {"a", 1, {1.89}, 12.0f,
+   {{-13.0f, -13.0f, -13.0f}, {8.0f, 8.0f, 8.0f}}},
+};
+
+/* Declare the parameters p0..p5 as type E, read from `params`. */
+#define SYSTEM_PARAMS(E, params)                                        \
+  E p0 = (params)[0], p1 = (params)[1], p2 = (params)[2];               \
+  E p3 = (params)[3], p4 = (params)[4], p5 = (params)[5];               \
+  (void)p0; (void)p1; (void)p2; (void)p3; (void)p4; (void)p5
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_VECTORS 1
+
+typedef float float4 __attribute__((vector_size(16)));
+typedef float float8 __attribute__((vector_size(32)));
+typedef double double2 __attribute__((vector_size(16)));
+typedef double double4 __attribute__((vector_size(32)));
+
+/* There are no vector versions of the libm functions, so the few
+   systems that need them go lane by lane. They are declared const so
+   the repeated calls of a Jacobian on the same point are merged. */
+#define SYSTEM_LANEWISE(name, T, f)                                     \
+  __attribute__((const)) static T                                       \
+  name(T v) {                                                           \
+    for (int i = 0; i < (int)(sizeof(T) / sizeof(v[0])); i++)           \
+      v[i] = f(v[i]);                                                   \
+    return v;                                                           \
+  }
+
+__attribute__((target("sse2"))) SYSTEM_LANEWISE(sin_float4, float4, sinf)
+__attribute__((target("sse2"))) SYSTEM_LANEWISE(sin_double2, double2, sin)
+__attribute__((target("avx2,fma"))) SYSTEM_LANEWISE(sin_float8, float8, sinf)
+__attribute__((target("avx2,fma"))) SYSTEM_LANEWISE(sin_double4, double4, sin)
+__attribute__((target("sse2"))) SYSTEM_LANEWISE(cos_float4, float4, cosf)
+__attribute__((target("sse2"))) SYSTEM_LANEWISE(cos_double2, double2, cos)
+__attribute__((target("avx2,fma"))) SYSTEM_LANEWISE(cos_float8, float8, cosf)
+__attribute__((target("avx2,fma"))) SYSTEM_LANEWISE(cos_double4, double4, cos)
+
+#define SYSTEM_SIN(v) _Generic((v), float: sinf, double: sin,          \
+                               float4: sin_float4, float8: sin_float8,  \
+                               double2: sin_double2,                    \
+                               double4: sin_double4)(v)
+#define SYSTEM_COS(v) _Generic((v), float: cosf, double: cos,          \
+                               float4: cos_float4, float8: cos_float8,  \
+                               double2: cos_double2,                    \
+                               double4: cos_double4)(v)
+#else
+#define SYSTEM_SIN(v) _Generic((v), float: sinf, double: sin)(v)
+#define SYSTEM_COS(v) _Generic((v), float: cosf, double: cos)(v)
+#endif
+
+#define LORENZ_DX(x, y, z) (p0 * ((y) - (x)))
+#define LORENZ_DY(x, y, z) (p1 * (x) - (y) - (x) * (z))
+#define LORENZ_DZ(x, y, z) ((x) * (y) - p2 * (z))
+
+#define LORENZ_JX(x, y, z, u, v, w) (p0 * ((v) - (u)))
+#define LORENZ_JY(x, y, z, u, v, w) ((p1 - (z)) * (u) - (v) - (x) * (w))
+#define LORENZ_JZ(x, y, z, u, v, w) ((y) * (u) + (x) * (v) - p2 * (w))
+
+#define ROSSLER_DX(x, y, z) (-(y) - (z))
+#define ROSSLER_DY(x, y, z) ((x) + p0 * (y))
+#define ROSSLER_DZ(x, y, z) (p1 + (z) * ((x) - p2))
+
+#define ROSSLER_JX(x, y, z, u, v, w) (-(v) - (w))
+#define ROSSLER_JY(x, y, z, u, v, w) ((u) + p0 * (v))
+#define ROSSLER_JZ(x, y, z, u, v, w) ((z) * (u) + ((x) - p2) * (w))
+
+#define THOMAS_DX(x, y, z) (SYSTEM_SIN(y) - p0 * (x))
+#define THOMAS_DY(x, y, z) (SYSTEM_SIN(z) - p0 * (y))
+#define THOMAS_DZ(x, y, z) (SYSTEM_SIN(x) - p0 * (z))
+
+#define THOMAS_JX(x, y, z, u, v, w) (SYSTEM_COS(y) * (v) - p0 * (u))
+#define THOMAS_JY(x, y, z, u, v, w) (SYSTEM_COS(z) * (w) - p0 * (v))
+#define THOMAS_JZ(x, y, z, u, v, w) (SYSTEM_COS(x) * (u) - p0 * (w))
+
+#define CHEN_DX(x, y, z) (p0 * ((y) - (x)))
+#define CHEN_DY(x, y, z) ((p2 - p0) * (x) - (x) * (z) + p2 * (y))
+#define CHEN_DZ(x, y, z) ((x) * (y) - p1 * (z))
+
+#define CHEN_JX(x, y, z, u, v, w) (p0 * ((v) - (u)))
+#define CHEN_JY(x, y, z, u, v, w)                                       \
+  ((p2 - p0 - (z)) * (u) + p2 * (v) - (x) * (w))
+#define CHEN_JZ(x, y, z, u, v, w) ((y) * (u) + (x) * (v) - p1 * (w))
+
+#define AIZAWA_DX(x, y, z) (((z) - p1) * (x) - p3 * (y))
+#define AIZAWA_DY(x, y, z) (p3 * (x) + ((z) - p1) * (y))
+#define AIZAWA_DZ(x, y, z)                                              \
+  (p2 + p0 * (z) - (z) * (z) * (z) / 3                                  \
+   - ((x) * (x) + (y) * (y)) * (1 + p4 * (z)) + p5 * (z) * (x) * (x) * (x))
+
+#define AIZAWA_JX(x, y, z, u, v, w)                                     \
+  (((z) - p1) * (u) - p3 * (v) + (x) * (w))
+#define AIZAWA_JY(x, y, z, u, v, w)                                     \
+  (p3 * (u) + ((z) - p1) * (v) + (y) * (w))
+#define AIZAWA_JZ(x, y, z, u, v, w)                                     \
+  ((3 * p5 * (z) * (x) * (x) - 2 * (x) * (1 + p4 * (z))) * (u)          \
+   - 2 * (y) * (1 + p4 * (z)) * (v)                                     \
+   + (p0 - (z) * (z) - p4 * ((x) * (x) + (y) * (y))                     \
+      + p5 * (x) * (x) * (x)) * (w))
+
+#define HALVORSEN_DX(x, y, z) (-p0 * (x) - 4 * (y) - 4 * (z) - (y) * (y))
+#define HALVORSEN_DY(x, y, z) (-p0 * (y) - 4 * (z) - 4 * (x) - (z) * (z))
+#define HALVORSEN_DZ(x, y, z) (-p0 * (z) - 4 * (x) - 4 * (y) - (x) * (x))
+
+#define HALVORSEN_JX(x, y, z, u, v, w)                                  \
+  (-p0 * (u) - (4 + 2 * (y)) * (v) - 4 * (w))
+#define HALVORSEN_JY(x, y, z, u, v, w)                                  \
+  (-4 * (u) - p0 * (v) - (4 + 2 * (z)) * (w))
+#define HALVORSEN_JZ(x, y, z, u, v, w)                                  \
+  (-(4 + 2 * (x)) * (u) - 4 * (v) - p0 * (w))
+
+/* Scalar double precision derivatives, for integrators that step one
+   trajectory at a time. */
+typedef void (*system_derivative)(const double *params, const double *v,
+                                  double *f);
+
+#define SYSTEM_DERIVATIVE(NAME, name)                                   \
+  static void                                                           \
+  name##_derivative(const double *params, const double *v, double *f) { \
+    SYSTEM_PARAMS(double, params);                                      \
+    f[0] = NAME##_DX(v[0], v[1], v[2]);                                 \
+    f[1] = NAME##_DY(v[0], v[1], v[2]);                                 \
+    f[2] = NAME##_DZ(v[0], v[1], v[2]);                                 \
+  }
+SYSTEM_LIST(SYSTEM_DERIVATIVE)
+#undef SYSTEM_DERIVATIVE
@@ -0,0 +1,51 @@
+/* Lock-free triple buffer.
+
+   One writer and one reader exchange whole buffers without ever
+   blocking each other. Of the three slots the writer owns `back`, the
+   reader owns `front`, and the third is parked in `middle` together
+   with a flag saying whether it holds data the reader has not seen.
+   Publishing swaps back with middle; consuming swaps front with middle
+   only when that flag is set, so the reader always gets the most
+   recent complete buffer and the writer never waits for it.
+*/
+
+#include <stdatomic.h>
+
+#define TRIPLE_FRESH 4
+#define TRIPLE_INDEX 3
+
+typedef struct {
+  atomic_int middle;
+  int back;
+  int front;
+} triple;
+
+static void
+triple_init(triple *t) {
+  t->back = 0;
+  atomic_init(&t->middle, 1);
+  t->front = 2;
+}
+
+/* Writer: hand the finished back buffer over and get a new one. */
+static void
+triple_publish(triple *t) {
+  int old = atomic_exchange_explicit(&t->middle, t->back | TRIPLE_FRESH,
+                                     memory_order_acq_rel);
+  t->back = old & TRIPLE_INDEX;
+}
+
+/* Reader: switch front to the newest published buffer, if any.
+   Returns false when nothing new has been published since last time. */
+static bool
+triple_consume(triple *t) {
+  int old;
+
+  if (!(atomic_load_explicit(&t->middle, memory_order_relaxed)
+        & TRIPLE_FRESH))
+    return false;
+
+  old = atomic_exchange_explicit(&t->middle, t->front, memory_order_acq_rel);
+  t->front = old & TRIPLE_INDEX;
+  return true;
+}
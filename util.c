@@ -1,4 +1,5 @@
-void *file_contents(const char *filename, GLint *length) {
+static __attribute__((unused)) void *
+file_contents(const char *filename, long *length) {
   FILE *f = fopen(filename, "r");
   void *buffer;
 
@@ -18,3 +19,27 @@ void *file_contents(const char *filename, GLint *length) {
 
   return buffer;
 }
+
+/* Zero-filled allocation aligned to a cache line, so that arrays split
+   between threads or copied in bulk start on a line boundary. */
+static void *
+alloc_aligned(size_t size) {
+  size_t rounded = (size + 63) / 64 * 64;
+  void *buffer = aligned_alloc(64, rounded ? rounded : 64);
+
+  if (buffer)
+    memset(buffer, 0, rounded);
+  return buffer;
+}
+
+/* Write an RGB image as a binary PPM. Rows are expected bottom first,
+   the way glReadPixels returns them. */
+static __attribute__((unused)) int
+write_ppm(FILE *f, const unsigned char *rgb, int width, int height) {
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int y = height - 1; y >= 0; y--) {
+    if (fwrite(rgb + (size_t)y*width*3, 3, width, f) != (size_t)width)
+      return 0;
+  }
+  return 1;
+}